@@ -0,0 +1,620 @@
+/*
+ * bluehome_bench - throughput and latency benchmark for bluehome_eib
+ *
+ * generates synthetic cEMI traffic as a capture file, runs bluehome_eib in replay
+ * mode (-b --replay) against a minimal local MQTT broker which also sends commands
+ * to the gateway, and reports the figures measured by the gateway and the broker.
+ * With -k the traffic is sent as KNXnet/IP routing indications to the gateway
+ * started with --routing instead, standing in for a KNX IP router.
+ *
+ * requires linking with -lpthread -lm
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <libgen.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "bluehome_eib.h"
+
+#define BENCH_PORT              18830
+#define BENCH_GATEWAY           "./bluehome_eib"
+#define COMMAND_TOPIC           "iot-2/type/HomeGateway/id/HomePi3/cmd/bench/fmt/json"
+
+/*
+ * MQTT control packet types
+ */
+#define MQTT_CONNECT            1
+#define MQTT_CONNACK            2
+#define MQTT_PUBLISH            3
+#define MQTT_PUBACK             4
+#define MQTT_PUBREC             5
+#define MQTT_PUBREL             6
+#define MQTT_PUBCOMP            7
+#define MQTT_SUBSCRIBE          8
+#define MQTT_SUBACK             9
+#define MQTT_PINGREQ            12
+#define MQTT_PINGRESP           13
+#define MQTT_DISCONNECT         14
+
+/*
+ * Benchmark parameters
+ */
+typedef struct benchconfig {
+        char            *gateway;
+        char            *workdir;
+        int             frames;
+        int             groups;
+        int             sizes[8];
+        int             nsizes;
+        int             rate;               // frames per second, 0 as fast as possible
+        int             commands;
+        int             commandrate;        // commands per second, 0 as fast as possible
+        int             qos;
+        int             maxinflight;
+        int             port;
+        int             knxport;            // KNXnet/IP routing port, 0 replays the capture file
+} benchconfig;
+
+/*
+ * Local MQTT broker state
+ */
+typedef struct sink {
+        int             listenfd;
+        int             fd;
+        int             version;            // MQTT protocol level of the gateway connection
+        pthread_mutex_t writelock;
+        unsigned long   published;
+        unsigned long   bytes;
+        uint64_t        first;
+        uint64_t        last;
+        int             subscribed;
+} sink;
+
+struct benchconfig      bench;
+volatile uint64_t       routerdone;         // monotonic ns the router stand-in sent its last frame
+struct sink             broker = { -1, -1, 4, PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0 };
+
+static void Usage( char *progname ) {
+    fprintf(stderr, "Usage: %s [options]\n"
+                    "\n"
+                    "options:\n"
+                    "  -x filename                          gateway executable                     default: %s\n"
+                    "  -d directory                         keep generated files in directory      default: temporary\n"
+                    "  -n count                             number of bus frames                   default: 100000\n"
+                    "  -g count                             number of group addresses              default: 1000\n"
+                    "  -s sizes                             comma separated cEMI data lengths      default: 1,2,3\n"
+                    "  -r rate                              frames per second, 0 as fast as possible  default: 0\n"
+                    "  -m count                             number of MQTT commands                default: 1000\n"
+                    "  -M rate                              commands per second, 0 as fast as possible  default: 1000\n"
+                    "  -Q qos                               QoS of the gateway publishes           default: 1\n"
+                    "  -i count                             MQTT in-flight window of the gateway   default: 32\n"
+                    "  -p port                              port of the local MQTT broker          default: %d\n"
+                    "  -k port                              send the frames as KNXnet/IP routing indications to port\n"
+                    "\n", basename( progname ), BENCH_GATEWAY, BENCH_PORT);
+}
+
+static uint64_t monotonic_ns( void ) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Group address of the n-th synthetic device, in network byte order
+ */
+static uint16_t bench_group( int n ) {
+    return htons((uint16_t)(n + 1));
+}
+
+/*
+ * EIS type matching a cEMI data length
+ */
+static int bench_eis( int length ) {
+    switch (length) {
+        case 1:     return 1;       // switch
+        case 2:     return 6;       // percentage
+        case 3:     return 5;       // 2 byte float
+        case 4:     return 3;       // time
+        default:    return 11;      // 4 byte counter
+    }
+}
+
+/*
+ * Write the gateway configuration with one device per group address
+ */
+static int write_config( const char *filename ) {
+    FILE            *file;
+    int             grp;
+    int             n;
+
+    if ((file = fopen(filename, "w")) == NULL)
+        return -1;
+    fprintf(file, "ADDRESS=tcp://127.0.0.1:%d\n", bench.port);
+    fprintf(file, "CLIENTID=g:bench:HomeGateway:HomePi3\n");
+    fprintf(file, "USERNAME=bench\n");
+    fprintf(file, "PASSWORD=bench\n");
+    fprintf(file, "QOS=%d\n", bench.qos);
+    fprintf(file, "MAXINFLIGHT=%d\n", bench.maxinflight);
+    fprintf(file, "TIMEOUT=10000L\n");
+    fprintf(file, "TELEGRAMRING=65536\n");
+    fprintf(file, "COMMANDQUEUE=%d\n", bench.commands > 64 ? bench.commands : 64);
+    // measure the gateway, not the TP1 pacing or the confirmations a replay never sees
+    fprintf(file, "WRITEBUDGET=0\n");
+    fprintf(file, "CONFIRMTIMEOUT=0\n");
+    for (n = 0; n < bench.groups; n++) {
+        grp = ntohs(bench_group(n));
+        fprintf(file, "DEVICE=%d/%d/%d Bench%d Bench Value eis=%d\n", (grp >> 11) & 0x1f, (grp >> 8) & 0x07, grp & 0xff,
+                n, bench_eis(bench.sizes[n % bench.nsizes]));
+    }
+    return fclose(file);
+}
+
+/*
+ * Build the n-th synthetic frame, returns its raw length
+ * group addresses are picked with a linear congruential generator so the gateway
+ * sees a realistic spread instead of a sequential walk through its device table
+ */
+static int bench_frame( int n, uint32_t *seed, CEMIFRAME *frame ) {
+    int                     length;
+    int                     grp;
+
+    *seed = *seed * 1103515245 + 12345;
+    grp = (*seed >> 8) % bench.groups;
+    length = bench.sizes[grp % bench.nsizes];
+
+    memset(frame, 0, sizeof(*frame));
+    frame->code = L_DATA_IND;
+    frame->ctrl = 0xbc;
+    frame->ntwrk = EIB_DAF_GROUP | 0x60;
+    frame->saddr = htons(0x1100 + (n % 250) + 1);
+    frame->daddr = bench_group(grp);
+    frame->length = length;
+    frame->tpci = T_GROUPDATA_REQ;
+    frame->apci = A_WRITE_VALUE_REQ | ((length == 1) ? (n & 1) : 0);
+    memset(frame->data, (*seed >> 16) & 0x7f, length - 1);
+    return offsetof(CEMIFRAME, apci) + length;
+}
+
+/*
+ * Write the synthetic bus traffic as a capture file
+ */
+static int write_capture( const char *filename ) {
+    struct captureheader    hdr;
+    struct capturerecord    rec;
+    CEMIFRAME               frame;
+    FILE                    *file;
+    uint32_t                seed = 12345;
+    uint64_t                pos;
+    int                     raw;
+    int                     n;
+    static const char       zero[8];
+
+    if ((file = fopen(filename, "w")) == NULL)
+        return -1;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CAPTURE_MAGIC, 8);
+    hdr.version = CAPTURE_VERSION;
+    hdr.headersize = CAPTURE_ALIGN(sizeof(struct captureheader));
+    hdr.created = time(NULL);
+    fwrite(&hdr, sizeof(hdr), 1, file);
+    fwrite(zero, hdr.headersize - sizeof(hdr), 1, file);
+    pos = hdr.headersize;
+
+    for (n = 0; n < bench.frames; n++) {
+        raw = bench_frame(n, &seed, &frame);
+
+        rec.timestamp = bench.rate ? (uint64_t)n * 1000000000 / bench.rate : (uint64_t)n + 1;
+        rec.length = raw;
+        if (pos / CAPTURE_CHUNK != (pos + CAPTURE_ALIGN(sizeof(rec) + raw) - 1) / CAPTURE_CHUNK) {
+            struct capturerecord skip = { 0, CAPTURE_SKIP };
+
+            fwrite(&skip, sizeof(skip), 1, file);
+            fseek(file, (pos / CAPTURE_CHUNK + 1) * CAPTURE_CHUNK, SEEK_SET);
+            pos = (pos / CAPTURE_CHUNK + 1) * CAPTURE_CHUNK;
+        }
+        fwrite(&rec, sizeof(rec), 1, file);
+        fwrite(&frame, raw, 1, file);
+        fwrite(zero, CAPTURE_ALIGN(sizeof(rec) + raw) - sizeof(rec) - raw, 1, file);
+        pos += CAPTURE_ALIGN(sizeof(rec) + raw);
+    }
+    return fclose(file);
+}
+
+/*
+ * KNX IP router stand-in: sends the synthetic traffic as routing indications to
+ * the gateway once it has subscribed, at the configured rate
+ */
+static void *router_sender( void *arg ) {
+    struct sockaddr_in      addr;
+    unsigned char           packet[6 + sizeof(CEMIFRAME)];
+    uint32_t                seed = 12345;
+    uint64_t                start;
+    uint64_t                due;
+    int                     fd;
+    int                     raw;
+    int                     n;
+
+    while (! broker.subscribed)
+        usleep(10000);
+    usleep(500000);                         // the gateway opens KNXnet/IP after MQTT
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(bench.knxport);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    start = monotonic_ns();
+    for (n = 0; n < bench.frames; n++) {
+        raw = bench_frame(n, &seed, (CEMIFRAME *)(packet + 6));
+        packet[0] = 6;
+        packet[1] = 0x10;
+        packet[2] = KNXIP_ROUTING_IND >> 8;
+        packet[3] = KNXIP_ROUTING_IND & 0xff;
+        packet[4] = (6 + raw) >> 8;
+        packet[5] = (6 + raw) & 0xff;
+        sendto(fd, packet, 6 + raw, 0, (struct sockaddr *)&addr, sizeof(addr));
+        if (bench.rate) {
+            due = start + (uint64_t)(n + 1) * 1000000000 / bench.rate;
+            while (monotonic_ns() < due)
+                usleep((due - monotonic_ns()) / 1000 + 1);
+        }
+    }
+    close(fd);
+    routerdone = monotonic_ns();
+    return NULL;
+}
+
+/*
+ * Write a complete packet to the gateway connection
+ */
+static void sink_send( const unsigned char *packet, size_t len ) {
+    ssize_t         done;
+
+    pthread_mutex_lock(&broker.writelock);
+    while (len > 0) {
+        done = write(broker.fd, packet, len);
+        if (done <= 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        packet += done;
+        len -= done;
+    }
+    pthread_mutex_unlock(&broker.writelock);
+}
+
+/*
+ * Acknowledge a packet carrying a packet identifier (PUBACK, PUBREC, PUBCOMP)
+ */
+static void sink_ack( int type, const unsigned char *id ) {
+    unsigned char   packet[4];
+
+    packet[0] = type << 4;
+    packet[1] = 2;
+    packet[2] = id[0];
+    packet[3] = id[1];
+    sink_send(packet, sizeof(packet));
+}
+
+/*
+ * Command injector: sends MQTT commands to the gateway once it has subscribed
+ */
+static void *command_injector( void *arg ) {
+    unsigned char   packet[256];
+    char            payload[128];
+    size_t          topiclen = strlen(COMMAND_TOPIC);
+    size_t          len;
+    size_t          pos;
+    int             n;
+
+    for (n = 0; n < bench.commands; n++) {
+        len = snprintf(payload, sizeof(payload), "{\"d\":{\"Bench\":\"Bench%d\",\"BYTE\":\"%d\"}}", n % bench.groups, n & 1);
+        pos = 0;
+        packet[pos++] = MQTT_PUBLISH << 4;
+        packet[pos++] = 2 + topiclen + (broker.version == 5 ? 1 : 0) + len;
+        packet[pos++] = topiclen >> 8;
+        packet[pos++] = topiclen & 0xff;
+        memcpy(packet + pos, COMMAND_TOPIC, topiclen);
+        pos += topiclen;
+        if (broker.version == 5)
+            packet[pos++] = 0;              // no properties
+        memcpy(packet + pos, payload, len);
+        pos += len;
+        sink_send(packet, pos);
+        if (bench.commandrate)
+            usleep(1000000 / bench.commandrate);
+    }
+    return NULL;
+}
+
+/*
+ * Read exactly len bytes
+ */
+static int read_full( int fd, unsigned char *buf, size_t len ) {
+    ssize_t         done;
+
+    while (len > 0) {
+        done = read(fd, buf, len);
+        if (done <= 0) {
+            if (done < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += done;
+        len -= done;
+    }
+    return 0;
+}
+
+/*
+ * Minimal MQTT broker: serves one gateway connection until it disconnects
+ */
+static void *sink_serve( void *arg ) {
+    unsigned char   header;
+    unsigned char   byte;
+    unsigned char   *packet = NULL;
+    size_t          size = 0;
+    size_t          len;
+    size_t          topiclen;
+    int             shift;
+    int             qos;
+    int             one = 1;
+    pthread_t       injector;
+
+    if ((broker.fd = accept(broker.listenfd, NULL, NULL)) < 0)
+        return NULL;
+    setsockopt(broker.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    for (;;) {
+        if (read_full(broker.fd, &header, 1) != 0)
+            break;
+        len = 0;
+        shift = 0;
+        do {
+            if (read_full(broker.fd, &byte, 1) != 0)
+                goto done;
+            len |= (size_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        if (len > size) {
+            size = len;
+            packet = realloc(packet, size);
+        }
+        if (len > 0 && read_full(broker.fd, packet, len) != 0)
+            break;
+
+        switch (header >> 4) {
+            case MQTT_CONNECT:
+                broker.version = (len > 6) ? packet[6] : 4;
+                if (broker.version == 5) {
+                    unsigned char connack[] = { MQTT_CONNACK << 4, 3, 0, 0, 0 };
+                    sink_send(connack, sizeof(connack));
+                } else {
+                    unsigned char connack[] = { MQTT_CONNACK << 4, 2, 0, 0 };
+                    sink_send(connack, sizeof(connack));
+                }
+                break;
+            case MQTT_PUBLISH:
+                qos = (header >> 1) & 3;
+                topiclen = (packet[0] << 8) | packet[1];
+                if (broker.published == 0)
+                    broker.first = monotonic_ns();
+                broker.last = monotonic_ns();
+                broker.published++;
+                broker.bytes += len + 2;
+                if (qos == 1)
+                    sink_ack(MQTT_PUBACK, packet + 2 + topiclen);
+                else if (qos == 2)
+                    sink_ack(MQTT_PUBREC, packet + 2 + topiclen);
+                break;
+            case MQTT_PUBREL:
+                sink_ack(MQTT_PUBCOMP, packet);
+                break;
+            case MQTT_SUBSCRIBE: {
+                unsigned char suback[] = { MQTT_SUBACK << 4, 3, packet[0], packet[1], 0, 0 };
+
+                if (broker.version == 5) {
+                    suback[1] = 4;
+                    suback[4] = 0;          // no properties
+                    sink_send(suback, 6);
+                } else {
+                    sink_send(suback, 5);
+                }
+                if (! broker.subscribed) {
+                    broker.subscribed = 1;
+                    pthread_create(&injector, NULL, command_injector, NULL);
+                    pthread_detach(injector);
+                }
+                break;
+            }
+            case MQTT_PINGREQ: {
+                unsigned char pingresp[] = { MQTT_PINGRESP << 4, 0 };
+
+                sink_send(pingresp, sizeof(pingresp));
+                break;
+            }
+            case MQTT_DISCONNECT:
+                goto done;
+            default:
+                break;
+        }
+    }
+done:
+    free(packet);
+    return NULL;
+}
+
+/*
+ * Parse the comma separated list of frame sizes
+ */
+static void parse_sizes( const char *list ) {
+    char            *copy = strdup(list);
+    char            *token;
+
+    bench.nsizes = 0;
+    for (token = strtok(copy, ","); token && bench.nsizes < 8; token = strtok(NULL, ",")) {
+        int length = atoi(token);
+
+        if (length >= 1 && length <= 15)
+            bench.sizes[bench.nsizes++] = length;
+    }
+    free(copy);
+    if (bench.nsizes == 0) {
+        fprintf(stderr, "No valid frame sizes in %s\n", list);
+        exit( -1 );
+    }
+}
+
+int main( int argc, char **argv ) {
+    struct sockaddr_in  addr;
+    char                tmpl[] = "/tmp/bluehome_bench.XXXXXX";
+    char                conffile[1024];
+    char                capfile[1024];
+    char                logname[1024];
+    char                line[1024];
+    FILE                *log;
+    pthread_t           server;
+    pthread_t           router;
+    char                knxtarget[64];
+    char                count[16];
+    pid_t               pid;
+    pid_t               reaped;
+    int                 status;
+    int                 c;
+    int                 one = 1;
+    uint64_t            started;
+    double              seconds;
+
+    bench.gateway = BENCH_GATEWAY;
+    bench.frames = 100000;
+    bench.groups = 1000;
+    bench.commands = 1000;
+    bench.commandrate = 1000;
+    bench.qos = 1;
+    bench.maxinflight = 32;
+    bench.port = BENCH_PORT;
+    parse_sizes("1,2,3");
+
+    while( ( c = getopt( argc, argv, "x:d:n:g:s:r:m:M:Q:i:p:k:" )) != -1 ) {
+        switch( c ) {
+            case 'x':   bench.gateway = optarg;                 break;
+            case 'd':   bench.workdir = optarg;                 break;
+            case 'n':   bench.frames = atoi( optarg );          break;
+            case 'g':   bench.groups = atoi( optarg );          break;
+            case 's':   parse_sizes( optarg );                  break;
+            case 'r':   bench.rate = atoi( optarg );            break;
+            case 'm':   bench.commands = atoi( optarg );        break;
+            case 'M':   bench.commandrate = atoi( optarg );     break;
+            case 'Q':   bench.qos = atoi( optarg );             break;
+            case 'i':   bench.maxinflight = atoi( optarg );     break;
+            case 'p':   bench.port = atoi( optarg );            break;
+            case 'k':   bench.knxport = atoi( optarg );         break;
+            default:
+                Usage( argv[0] );
+                exit( -1 );
+        }
+    }
+    if (bench.frames < 1 || bench.groups < 1 || bench.groups > 65535) {
+        Usage( argv[0] );
+        exit( -1 );
+    }
+    if (bench.workdir != NULL && mkdir(bench.workdir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Can not create work directory %s: %s\n", bench.workdir, strerror( errno ));
+        exit( -1 );
+    }
+    if (bench.workdir == NULL && (bench.workdir = mkdtemp(tmpl)) == NULL) {
+        fprintf(stderr, "Can not create work directory: %s\n", strerror( errno ));
+        exit( -1 );
+    }
+    snprintf(conffile, sizeof(conffile), "%s/bench.conf", bench.workdir);
+    snprintf(capfile, sizeof(capfile), "%s/bench.cap", bench.workdir);
+    snprintf(logname, sizeof(logname), "%s/gateway.log", bench.workdir);
+    unlink(logname);
+    if (write_config(conffile) != 0 || write_capture(capfile) != 0) {
+        fprintf(stderr, "Can not write benchmark files in %s: %s\n", bench.workdir, strerror( errno ));
+        exit( -1 );
+    }
+
+    // local MQTT broker
+    broker.listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(broker.listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(bench.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(broker.listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(broker.listenfd, 1) != 0) {
+        fprintf(stderr, "Can not listen on port %d: %s\n", bench.port, strerror( errno ));
+        exit( -2 );
+    }
+    signal(SIGPIPE, SIG_IGN);
+    pthread_create(&server, NULL, sink_serve, NULL);
+
+    // gateway in replay mode, or receiving from the router stand-in
+    started = monotonic_ns();
+    if (bench.knxport) {
+        snprintf(knxtarget, sizeof(knxtarget), "--routing=127.0.0.1:%d", bench.knxport);
+        snprintf(count, sizeof(count), "%d", bench.frames);
+        pthread_create(&router, NULL, router_sender, NULL);
+        pthread_detach(router);
+    }
+    if ((pid = fork()) == 0) {
+        if (bench.knxport)
+            execl(bench.gateway, bench.gateway, "-q", "-b", "-f", conffile, "-l", logname, knxtarget, "-c", count, (char *)NULL);
+        else if (bench.rate)
+            execl(bench.gateway, bench.gateway, "-q", "-b", "-f", conffile, "-l", logname, "--replay", capfile, (char *)NULL);
+        else
+            execl(bench.gateway, bench.gateway, "-q", "-b", "-f", conffile, "-l", logname, "--replay", capfile, "--fast", (char *)NULL);
+        fprintf(stderr, "Can not start %s: %s\n", bench.gateway, strerror( errno ));
+        _exit( 127 );
+    }
+    // datagrams may get lost, stop the gateway when it did not see them all
+    reaped = 0;
+    while (bench.knxport && pid > 0 && (reaped = waitpid(pid, &status, WNOHANG)) == 0) {
+        if (routerdone && monotonic_ns() - routerdone > 5000000000ULL) {
+            fprintf(stderr, "Gateway did not receive all frames, stopping it\n");
+            kill(pid, SIGTERM);
+            break;
+        }
+        usleep(10000);
+    }
+    if (pid < 0 || (reaped <= 0 && waitpid(pid, &status, 0) < 0)) {
+        fprintf(stderr, "Can not run %s: %s\n", bench.gateway, strerror( errno ));
+        exit( -3 );
+    }
+    seconds = (monotonic_ns() - started) / 1e9;
+    shutdown(broker.listenfd, SHUT_RDWR);
+    if (broker.fd >= 0)
+        shutdown(broker.fd, SHUT_RDWR);
+    pthread_join(server, NULL);
+
+    printf("Benchmark: %d frames over %d group addresses, %d commands, QoS %d, in-flight window %d\n",
+           bench.frames, bench.groups, bench.commands, bench.qos, bench.maxinflight);
+    if ((log = fopen(logname, "r")) != NULL) {
+        while (fgets(line, sizeof(line), log) != NULL)
+            if (strncmp(line, "Benchmark", 9) == 0)
+                fputs(line, stdout);
+        fclose(log);
+    }
+    printf("Benchmark broker: %lu publishes, %lu bytes, %.0f publishes/s\n", broker.published, broker.bytes,
+           (broker.last > broker.first) ? (broker.published - 1) / ((broker.last - broker.first) / 1e9) : 0.0);
+    printf("Benchmark total: %.3f s wall clock, gateway exit status %d\n", seconds,
+           WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : 1;
+}
@@ -1,5 +1,5 @@
 /*
- * bluehouse_eib - link eib with MQTTClient
+ * bluehouse_eib - link eib with MQTTAsync
  *
  * based on
  *    eibtrace - eib packet trace - requires linking with -L /usr/local/lib -leibnetmux -lm -lpth
@@ -7,6 +7,7 @@
  *
  * requires running eibnetmux
  *     eibnetmux - eibnet/ip multiplexer
+ * or a KNX IP router or interface reached with bluehome_knxip.c (--routing, --tunnel)
  */
 
 #ifdef HAVE_CONFIG_H
@@ -14,23 +15,35 @@
 #endif
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <signal.h>
 #include <libgen.h>
 #include <getopt.h>
 #include <errno.h>
 #include <time.h>
 #include <math.h>
+#include <limits.h>
 #include <termios.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include <curl/curl.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
-#include <MQTTClient.h>
+#include <MQTTAsync.h>
 
 #ifndef WITH_LOCALHEADERS
 #include <eibnetmux/enmx_lib.h>
@@ -38,125 +51,926 @@
 #include <../src/client_lib/c/enmx_lib.h>
 #endif
 
+#include "bluehome_eib.h"
+
 /*
- * EIB constants
- */
-#define EIB_CTRL_LENGTHTABLE                    0x00
-#define EIB_CTRL_LENGTHBYTE                     0x80
-#define EIB_CTRL_DATA                           0x00
-#define EIB_CTRL_POLL                           0x40
-#define EIB_CTRL_REPEAT                         0x00
-#define EIB_CTRL_NOREPEAT                       0x20
-#define EIB_CTRL_ACK                            0x00
-#define EIB_CTRL_NONACK                         0x10
-#define EIB_CTRL_PRIO_LOW                       0x0c
-#define EIB_CTRL_PRIO_HIGH                      0x04
-#define EIB_CTRL_PRIO_ALARM                     0x08
-#define EIB_CTRL_PRIO_SYSTEM                    0x00
-#define EIB_NETWORK_HOPCOUNT                    0x70
-#define EIB_DAF_GROUP                           0x80
-#define EIB_DAF_PHYSICAL                        0x00
-#define EIB_LL_NETWORK                          0x70
-#define T_GROUPDATA_REQ                         0x00
-#define A_READ_VALUE_REQ                        0x0000
-#define A_WRITE_VALUE_REQ                       0x0080
-#define A_RESPONSE_VALUE_REQ                    0x0040
-
-/**
- * cEMI Message Codes
- **/
-#define L_BUSMON_IND            0x2B
-#define L_RAW_IND               0x2D
-#define L_RAW_REQ               0x10
-#define L_RAW_CON               0x2F
-#define L_DATA_REQ              0x11
-#define L_DATA_CON              0x2E
-#define L_DATA_IND              0x29
-#define L_POLL_DATA_REQ         0x13
-#define L_POLL_DATA_CON         0x25
-#define M_PROP_READ_REQ         0xFC
-#define M_PROP_READ_CON         0xFB
-#define M_PROP_WRITE_REQ        0xF6
-#define M_PROP_WRITE_CON        0xF5
-#define M_PROP_INFO_IND         0xF7
-#define M_RESET_REQ             0xF1
-#define M_RESET_IND             0xF0
-
-/*
- * EIB Global variables
- */
-ENMX_HANDLE     sock_con = 0;
-unsigned char   conn_state = 0;
+ * Command queue
+ *
+ * msgarrvd() converts an inbound command to its KNX representation and queues it
+ * on the bus line of the device, the command executor thread of the line writes it
+ * to the bus over one long lived connection which is reopened when a write fails.
+ *
+ * A line has a queue per KNX priority and the executor always takes the most urgent
+ * command. A command for a group address that is still queued replaces the queued
+ * value, a scene sent twice is written once. Writes are paced by a token bucket that
+ * fills with WRITEBUDGET percent of the TP1 bit rate, so long scenes leave room for
+ * the other devices on the line. On lines that report L_Data.con every write waits
+ * in the confirmation table until the receive thread sees its confirmation, it is
+ * queued again when none arrives within CONFIRMTIMEOUT ms.
+ */
+#define COMMAND_QUEUESIZE       64          // per priority
+#define COMMAND_MAXBACKOFF      30
+#define COMMAND_PRIORITIES      4           // system, alarm, high, low
+#define COMMAND_BUDGET          50          // percent of the line available for writes
+#define CONFIRM_SLOTS           16          // writes waiting for their L_Data.con
+#define CONFIRM_TIMEOUT         3000
+#define CONFIRM_RETRIES         1
+#define CEMI_CTRL_ERROR         0x01        // L_Data.con: the frame was not sent
+
+typedef struct command {
+        uint16_t        knxaddress;
+        uint16_t        len;
+        unsigned char   data[16];
+        uint8_t         priority;       // EIB_CTRL_PRIO_* bits
+        uint8_t         attempts;       // writes of this value done
+        uint8_t         read;           // a group read from poll=, no value
+        uint64_t        received;       // monotonic nanoseconds, for -b
+} command;
+
+typedef struct commandring {
+        struct command  *items;
+        int             head;
+        int             count;
+} commandring;
+
+typedef struct commandqueue {
+        struct commandring rings[COMMAND_PRIORITIES];   // most urgent first
+        int             size;           // of every ring
+        int             count;          // of all rings
+        unsigned long   coalesced;      // commands that replaced a queued value
+        double          tokens;         // bit times the executor may still write
+        uint64_t        filled;         // monotonic ns the bucket was last filled
+        pthread_mutex_t lock;
+        pthread_cond_t  notempty;
+} commandqueue;
+
+typedef struct confirmwait {
+        struct command  cmd;
+        uint64_t        sent;           // monotonic ns, 0 for a free slot
+} confirmwait;
+
+typedef struct confirmtable {
+        struct confirmwait slots[CONFIRM_SLOTS];
+        atomic_int      waiting;        // slots in use, the receive thread only locks when not 0
+        pthread_mutex_t lock;
+} confirmtable;
 
 /*
  * EIB local function declarations
+ * knx_physical() and knx_group() write into a buffer of KNX_ADDRSIZE bytes
  */
+#define KNX_ADDRSIZE            16
+
 static void     Usage( char *progname );
-static char     *knx_physical( uint16_t phy_addr );
-static char     *knx_group( uint16_t grp_addr );
+static char     *knx_physical( uint16_t phy_addr, char *textual );
+static char     *knx_group( uint16_t grp_addr, char *textual );
 
 /*
  * Global MQTT client
  */
-MQTTClient client;
-MQTTClient_connectOptions conn_opts;
+MQTTAsync client;
+MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
+
+/*
+ * MQTT in-flight window
+ *
+ * publishes are sent without waiting for the broker, at most maxinflight of them
+ * are unconfirmed at any time. The window is released by the success and failure
+ * callbacks and reset on every (re)connect, as completions of the old session may
+ * never arrive. With a spool every slot keeps a copy of its message, messages that
+ * failed or were still unconfirmed at a reset are handed back to the publish thread
+ * which spools them again.
+ */
+#define MQTT_MAXINFLIGHT        1
+
+typedef struct inflight {
+        uint64_t        received;           // monotonic time the telegram was received from the bus
+        int             busy;
+        char            *message;           // topic and payload, only kept with a spool
+        size_t          size;
+        int             topiclen;           // including the terminating zero
+        int             len;
+        struct inflight *next;
+} inflight;
+
+typedef struct unsent {
+        struct unsent   *next;
+        int             topiclen;
+        int             len;
+        char            data[];             // topic, zero, payload
+} unsent;
+
+typedef struct mqttwindow {
+        int             inflight;
+        int             connected;          // 0 connecting, 1 connected, -1 initial connect failed
+        int             keep;               // slots keep their message to be spooled again
+        struct inflight *slots;             // maxinflight slots, passed as callback context
+        struct inflight *free;
+        struct unsent   *unsent;            // messages to spool again, oldest first
+        struct unsent   **unsenttail;
+        atomic_int      returned;           // messages waiting in unsent
+        pthread_mutex_t lock;
+        pthread_cond_t  changed;
+} mqttwindow;
+
+struct mqttwindow       window = { 0, 0, 0, NULL, NULL, NULL, &window.unsent, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/*
+ * Benchmark statistics, only collected with -b
+ *
+ * latencies are kept in log-linear histograms: 16 buckets per power of two
+ */
+#define LATENCY_SUBBITS         4
+#define LATENCY_BUCKETS         (64 << LATENCY_SUBBITS)
+
+typedef struct latency {
+        uint64_t        count;
+        uint64_t        max;
+        uint64_t        buckets[LATENCY_BUCKETS];
+} latency;
+
+typedef struct benchstats {
+        struct latency  publish;            // bus receive to MQTT delivery confirmation
+        struct latency  command;            // msgarrvd() to written on the bus
+        uint64_t        start;
+        uint64_t        end;
+        atomic_ulong    frames;
+        atomic_ulong    published;
+        atomic_ulong    commands;
+        atomic_ulong    monitorcpu;         // nanoseconds of thread CPU time
+        atomic_ulong    commandcpu;
+} benchstats;
+
+int                     bench = 0;
+struct benchstats       benchmark;
+
+/*
+ * Runtime metrics
+ *
+ * every counter block is written by one thread only, with a relaxed load and store
+ * instead of a locked read-modify-write, so counting does not slow the bus and
+ * publish loops. The metrics thread reads the blocks when /metrics is scraped and
+ * the publisher when a stats message is due. Counters of the MQTT callbacks are
+ * rare and use real atomic increments.
+ */
+typedef struct rxmetrics {
+        atomic_ulong    frames[256];        // per cEMI message code
+        atomic_ulong    matched;            // frames with a configured device
+        atomic_ulong    unmatched;
+        atomic_ulong    confirmed;          // writes matched with their L_Data.con
+        atomic_ulong    confirmnanos;       // sum of the confirmation latencies
+} rxmetrics;
+
+typedef struct txmetrics {
+        atomic_ulong    commands;           // commands written to the bus
+        atomic_ulong    failed;
+        atomic_ulong    retried;            // written again for lack of a confirmation
+        atomic_ulong    unconfirmed;        // given up without a confirmation
+        atomic_ulong    readsdropped;       // group reads of an eibnetmux line dropped, see groupreads
+        atomic_ulong    unanswered;         // group reads of an eibnetmux line without a response
+} txmetrics;
+
+typedef struct publishmetrics {
+        atomic_ulong    attempted;          // messages handed to the MQTT client
+        atomic_ulong    refused;            // not accepted by the MQTT client
+        atomic_ulong    retried;            // spooled messages sent again
+        atomic_ulong    spooled;
+        atomic_ulong    spooldropped;
+        atomic_ulong    spoolpending;       // gauge
+        atomic_ulong    polls;              // group reads queued for poll=
+        atomic_ulong    pollsskipped;       // not needed, the device reported recently
+        atomic_ulong    historyqueries;
+        atomic_ulong    bytes;              // topic and payload bytes handed to the MQTT client
+        atomic_ulong    aliased;            // sent with a topic alias instead of the topic
+} publishmetrics;
+
+typedef struct mqttmetrics {
+        atomic_ulong    connects;
+        atomic_ulong    connectionlost;
+        atomic_ulong    deliveryfailed;
+} mqttmetrics;
+
+struct publishmetrics   publishstats;
+struct mqttmetrics      mqttstats;
+
+static inline void metric_add( atomic_ulong *counter, unsigned long n ) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void metric_set( atomic_ulong *gauge, unsigned long value ) {
+    atomic_store_explicit(gauge, value, memory_order_relaxed);
+}
+
+static inline unsigned long metric_get( atomic_ulong *counter ) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+char                    *subscription = "iot-2/type/HomeGateway/id/HomePi3/cmd/+/fmt/+";
+
+int                     total = -1;
+int                     spaces = 1;
+
+/*
+ * Logger
+ *
+ * messages are formatted by the calling thread into a shared buffer, a writer
+ * thread swaps it for a second buffer and writes the batch with one write(2).
+ * Messages above the log level are never formatted. When the writer falls behind
+ * and the buffer is full, messages are dropped and counted instead of blocking the
+ * bus threads. A log file is rotated when it exceeds LOGSIZE bytes.
+ */
+#define LEVEL_ERROR             0
+#define LEVEL_INFO              1
+#define LEVEL_TRACE             2
+
+#define LOG_BUFSIZE             (256 * 1024)
+#define LOG_LINESIZE            1024
+#define LOG_BATCHMS             200             // longest time a message waits for the writer
+
+typedef struct logstate {
+        int             level;
+        int             fd;
+        char            *path;                  // NULL when logging to the screen
+        off_t           size;                   // bytes in the current log file
+        off_t           maxsize;                // rotate beyond this size, 0 never
+        int             keep;                   // rotated files kept as path.1 .. path.keep
+        char            *front;                 // buffer messages are appended to
+        char            *back;                  // buffer being written
+        size_t          used;
+        unsigned long   dropped;
+        int             started;
+        int             stop;
+        pthread_t       writer;
+        pthread_mutex_t lock;
+        pthread_cond_t  wakeup;
+} logstate;
+
+static char             logbuffers[2][LOG_BUFSIZE];
+struct logstate         logger = { LEVEL_TRACE, 1, NULL, 0, 0, 0, logbuffers[0], logbuffers[1], 0, 0, 0, 0,
+                                   0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+#define log_enabled(lvl)        (logger.level >= (lvl))
+#define log_error(...)          log_write( __VA_ARGS__ )
+#define log_info(...)           do { if (log_enabled(LEVEL_INFO)) log_write( __VA_ARGS__ ); } while (0)
+#define log_trace(...)          do { if (log_enabled(LEVEL_TRACE)) log_write( __VA_ARGS__ ); } while (0)
+
+/*
+ * Format one message and append it to the log buffer
+ */
+static void log_write( const char *fmt, ... ) {
+    char            line[LOG_LINESIZE];
+    va_list         args;
+    int             len;
+
+    va_start(args, fmt);
+    len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (len <= 0)
+        return;
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+
+    pthread_mutex_lock(&logger.lock);
+    if (logger.used + len > LOG_BUFSIZE) {
+        logger.dropped++;
+    } else {
+        memcpy(logger.front + logger.used, line, len);
+        // wake the writer for the first message of a batch and when half full
+        if (logger.used == 0 || (logger.used < LOG_BUFSIZE / 2 && logger.used + len >= LOG_BUFSIZE / 2))
+            pthread_cond_signal(&logger.wakeup);
+        logger.used += len;
+    }
+    pthread_mutex_unlock(&logger.lock);
+}
+
+/*
+ * Write a whole buffer, only called by the writer or when there is no writer
+ */
+static void log_flushbuffer( const char *buf, size_t len ) {
+    ssize_t         rc;
+
+    while (len > 0) {
+        rc = write(logger.fd, buf, len);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buf += rc;
+        len -= rc;
+        logger.size += rc;
+    }
+}
+
+/*
+ * Move log to log.1, log.1 to log.2 ... and start a new log file
+ */
+static void log_rotate( void ) {
+    char            from[1024];
+    char            to[1024];
+    int             idx;
+    int             fd;
+
+    for (idx = logger.keep - 1; idx >= 1; idx--) {
+        snprintf(from, sizeof(from), "%s.%d", logger.path, idx);
+        snprintf(to, sizeof(to), "%s.%d", logger.path, idx + 1);
+        rename(from, to);
+    }
+    if (logger.keep > 0) {
+        snprintf(to, sizeof(to), "%s.1", logger.path);
+        rename(logger.path, to);
+    }
+    fd = open(logger.path, O_WRONLY | O_CREAT | O_APPEND | (logger.keep > 0 ? 0 : O_TRUNC), 0644);
+    if (fd < 0)
+        return;                         // keep writing to the old file
+    close(logger.fd);
+    logger.fd = fd;
+    logger.size = 0;
+}
+
+/*
+ * Log writer thread
+ */
+static void *log_writer( void *arg ) {
+    struct timespec ts;
+    char            *batch;
+    size_t          len;
+    unsigned long   dropped;
+    int             stop;
+    char            note[128];
+
+    pthread_mutex_lock(&logger.lock);
+    for (;;) {
+        while (logger.used == 0 && logger.dropped == 0 && !logger.stop)
+            pthread_cond_wait(&logger.wakeup, &logger.lock);
+        // let a batch build up unless the buffer is filling
+        if (!logger.stop && logger.used < LOG_BUFSIZE / 2) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += LOG_BATCHMS * 1000000L;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&logger.wakeup, &logger.lock, &ts);
+        }
+        batch = logger.front;
+        len = logger.used;
+        logger.front = logger.back;
+        logger.back = batch;
+        logger.used = 0;
+        dropped = logger.dropped;
+        logger.dropped = 0;
+        stop = logger.stop;
+        pthread_mutex_unlock(&logger.lock);
+
+        if (dropped) {
+            snprintf(note, sizeof(note), "Log writer fell behind, %lu messages dropped\n", dropped);
+            log_flushbuffer(note, strlen(note));
+        }
+        log_flushbuffer(batch, len);
+        if (logger.path != NULL && logger.maxsize > 0 && logger.size >= logger.maxsize)
+            log_rotate();
+
+        pthread_mutex_lock(&logger.lock);
+        if (stop)
+            break;
+    }
+    pthread_mutex_unlock(&logger.lock);
+    return NULL;
+}
+
+/*
+ * Start a thread with SIGINT and SIGTERM blocked, so Shutdown() runs on the main
+ * thread and never interrupts a thread holding the log lock
+ */
+static int thread_start( pthread_t *thread, void *(*start)( void * ), void *arg ) {
+    sigset_t        block;
+    sigset_t        saved;
+    int             rc;
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &saved);
+    rc = pthread_create(thread, NULL, start, arg);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return rc;
+}
+
+/*
+ * Direct the log to a file (NULL for the screen) and start the writer
+ */
+static void log_open( const char *path ) {
+    struct stat     st;
+    int             fd;
+
+    if (path != NULL) {
+        if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+            log_error("Can not write to logfile %s\n", path );
+        } else {
+            logger.fd = fd;
+            logger.path = strdup(path);
+            if (fstat(fd, &st) == 0)
+                logger.size = st.st_size;
+        }
+    }
+    if (thread_start(&logger.writer, log_writer, NULL) == 0)
+        logger.started = 1;
+}
+
+/*
+ * Log level from its name, -1 when unknown
+ */
+static int log_parselevel( const char *name ) {
+    if (strcasecmp(name, "error") == 0)
+        return LEVEL_ERROR;
+    if (strcasecmp(name, "info") == 0)
+        return LEVEL_INFO;
+    if (strcasecmp(name, "trace") == 0)
+        return LEVEL_TRACE;
+    return -1;
+}
+
+/*
+ * Set the rotation limits read from the configuration file
+ */
+static void log_rotation( off_t maxsize, int keep ) {
+    pthread_mutex_lock(&logger.lock);
+    logger.maxsize = maxsize;
+    logger.keep = keep;
+    pthread_mutex_unlock(&logger.lock);
+}
+
+/*
+ * Write what is still buffered and stop the writer, registered with atexit()
+ */
+static void log_close( void ) {
+    if (!logger.started) {
+        log_flushbuffer(logger.front, logger.used);
+        logger.used = 0;
+        return;
+    }
+    pthread_mutex_lock(&logger.lock);
+    logger.stop = 1;
+    pthread_cond_signal(&logger.wakeup);
+    pthread_mutex_unlock(&logger.lock);
+    pthread_join(logger.writer, NULL);
+    logger.started = 0;
+    // messages logged while the writer was stopping
+    log_flushbuffer(logger.front, logger.used);
+    logger.used = 0;
+}
+
+
+/*
+ * Decoder dispatch table, indexed by EIS type
+ * EIS_AUTO selects the EIS type from the frame length as the gateway always did
+ */
+#define EIS_AUTO                0
+#define EIS_MAX                 15
+#define EIS_SIGNED8             16      // EIS 14, 10 and 11 with a signed value (DPT 6, 8 and 13)
+#define EIS_SIGNED16            17
+#define EIS_SIGNED32            18
+#define EIS_TYPES               19
 
-int                     quiet = 0;
-FILE                    *logfile;
+typedef void (*eisdecoder)( int eis, CEMIFRAME *cemiframe, struct value *val );
+
+typedef struct eistype {
+        eisdecoder      decode;
+        int             valuetype;
+} eistype;
+
+/*
+ * Device table
+ *
+ * Built by read_configfile() and again on SIGHUP, or mapped from the database made
+ * by --ets-import. The strings of all devices are packed in one arena and referenced
+ * by offset. The bus path looks devices up by
+ * using the raw 16 bit destination address of the cEMI frame as a direct index,
+ * the command path uses an open addressing hash on the device name.
+ */
+#define DEVICE_NONE             -1
+#define DEVICE_GROUPSLOTS       65536
+
+/*
+ * Publish filter of a device, set with the cov, deadband=, minint= and heartbeat=
+ * DEVICE options. Times are in milliseconds, 0 is off.
+ */
+#define FILTER_COV              0x01        // publish only when the value changed
+#define FILTER_PERCENT          0x02        // deadband is a percentage of the last value
+
+typedef struct devicefilter {
+  uint8_t  flags;
+  float    deadband;                // minimal change to publish, implies FILTER_COV
+  uint32_t minint;                  // minimal interval between publishes
+  uint32_t heartbeat;               // republish the latest value after this much silence
+} devicefilter;
 
 /*
- * EIB request frame
+ * Per device publish state, only used by the publish thread
  */
-typedef struct __attribute__((packed)) {
-        uint8_t  code;
-        uint8_t  zero;
-        uint8_t  ctrl;
-        uint8_t  ntwrk;
-        uint16_t saddr;
-        uint16_t daddr;
-        uint8_t  length;
-        uint8_t  tpci;
-        uint8_t  apci;
-        uint8_t  data[16];
-} CEMIFRAME;
+typedef struct devicestate {
+  struct value last;                // last published value
+  struct value latest;              // last received value, published by the heartbeat
+  int          pending;             // latest was held back by minint, published when it expires
+  uint64_t     published;           // monotonic ns of the last publish, 0 never
+  uint64_t     seen;                // monotonic ns of the last value from the bus, 0 never
+  uint64_t     polldue;             // tick of the next group read
+  int32_t      pollnext;            // next device in the same timer wheel slot
+} devicestate;
 
 typedef struct device {
-  char knx[16];
-  char name[64];
-  char event[64];
-  char type[64];
-  struct device * next;
+  uint32_t knx;                     // offsets of the strings in the arena
+  uint32_t name;
+  uint32_t event;
+  uint32_t type;
+  uint32_t topic;                   // MQTT topic, built when the device is added
+  uint32_t entry;                   // start of the device's entry in a batch payload
+  uint16_t daddr;                   // group address as found in cemiframe->daddr
+  uint8_t  eis;                     // EIS type of the values, EIS_AUTO when not configured
+  int8_t   line;                    // bus line of the commands, -1 where the address was seen
+  uint8_t  priority;                // EIB_CTRL_PRIO_* of the commands
+  uint32_t poll;                    // ms between group reads, 0 never
+  struct devicefilter filter;
 } device;
 
+typedef struct devicetable {
+  char          *arena;
+  uint32_t      arenalen;
+  uint32_t      arenasize;
+  struct device *devices;
+  int           count;
+  int           size;
+  int32_t       *bygroup;           // DEVICE_GROUPSLOTS entries, indexed by daddr
+  int32_t       *byname;            // namemask + 1 entries
+  uint32_t      namemask;
+  struct devicestate *state;        // count entries
+  int32_t       *heartbeats;        // devices with a heartbeat or a minimal interval
+  int           heartbeatcount;
+  uint32_t      generation;         // tells tables apart, telegrams carry it with the device index
+  void          *map;               // device database the table was mapped from, NULL when built
+  size_t        mapsize;
+} devicetable;
+
+#define DEVSTR(table, offset)   ((table)->arena + (offset))
+
+/*
+ * Device table reload
+ *
+ * SIGHUP reads the DEVICE lines of the configuration file again. The reload thread
+ * builds the new table and publishes it with one atomic pointer store, lookups take
+ * no lock. A thread using the table marks the grace period it entered in its own
+ * slot and clears it when done; the old table is freed once no slot shows an older
+ * period. The publish thread moves the publish state of the devices to the new table
+ * first, so cov, deadband and heartbeat carry on over a reload.
+ */
+#define RCU_READERS             16          // receive threads, publisher and MQTT callbacks
+
+typedef struct rcureader {
+        _Atomic uint64_t        period;     // grace period of the read section, 0 outside
+        char                    pad[56];
+} rcureader;
+
+typedef struct rcudomain {
+        _Atomic uint64_t        period;
+        atomic_int              count;
+        struct rcureader        readers[RCU_READERS];
+} rcudomain;
+
+struct rcudomain        rcu = { 1 };
+static __thread struct rcureader *rcuself;
+
 typedef struct config {
    char address[1024];
    char clientid[255];
    char username[255];
    char password[255];
-   char eibd_ip[16];
    char solar_ip[255];
+   uint16_t knxaddress;
    int qos;
    long timeout;
-   struct device * devicelist;
+   int commandqueue;
+   int telegramring;
+   int maxinflight;
+   int batch;
+   char spooldir[1024];
+   long spoolsize;
+   long spoolsegment;
+   int spoolrate;
+   long batchwindow;
+   char batchtopic[1024];
+   int loglevel;
+   long logsize;
+   int logfiles;
+   char metrics[255];
+   int statsinterval;
+   int busload;
+   int busloadtop;
+   int writebudget;
+   int confirmtimeout;
+   int confirmretries;
+   long history;
+   int format;
+   int mqttversion;
+   char feed[1024];
+   int feedslots;
+   char devicedb[1024];
+   char * configfile;
+   struct devicetable * _Atomic devices;
 } config;
 
 struct config           configuration;
+static struct devicetable * _Atomic adopted;    // table the publish thread moved to, see devicetable_adopt()
+
+/*
+ * Enter a read section of the device table, the first call of a thread takes a slot
+ */
+static inline void rcu_read_lock( void ) {
+    int             slot;
+
+    if (rcuself == NULL) {
+        if ((slot = atomic_fetch_add(&rcu.count, 1)) >= RCU_READERS) {
+            log_error("Too many threads use the device table\n");
+            exit( -9 );
+        }
+        rcuself = &rcu.readers[slot];
+    }
+    atomic_store_explicit(&rcuself->period, atomic_load_explicit(&rcu.period, memory_order_relaxed), memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+static inline void rcu_read_unlock( void ) {
+    atomic_store_explicit(&rcuself->period, 0, memory_order_release);
+}
+
+/*
+ * Wait until every read section that may have seen the previous table ended
+ */
+static void rcu_synchronize( void ) {
+    struct timespec pause = { 0, 1000000 };
+    uint64_t        period;
+    uint64_t        seen;
+    int             count;
+    int             idx;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    period = atomic_fetch_add(&rcu.period, 1) + 1;
+    count = atomic_load(&rcu.count);
+    for (idx = 0; idx < count && idx < RCU_READERS; idx++) {
+        while ((seen = atomic_load_explicit(&rcu.readers[idx].period, memory_order_acquire)) != 0 && seen < period)
+            nanosleep(&pause, NULL);
+    }
+}
+
+/*
+ * Current device table, only valid inside a read section
+ */
+static inline struct devicetable *devicetable_get( void ) {
+    return atomic_load_explicit(&configuration.devices, memory_order_acquire);
+}
+
+/*
+ * Telegram ring
+ *
+ * single producer / single consumer ring between the receive thread of a bus line
+ * and the publish thread. The receive thread never blocks on it: when the ring is
+ * full the telegram is dropped and counted. The publisher only sleeps when the rings
+ * of all lines are empty, every ring rings the same bell to wake it up.
+ */
+#define TELEGRAM_RINGSIZE       4096
+
+typedef struct telegram {
+        CEMIFRAME       frame;
+        uint16_t        len;
+        int32_t         device;     // index in the device table or DEVICE_NONE
+        uint32_t        generation; // of the device table the index is for
+        uint32_t        seq;
+        struct timeval  tv;
+        uint64_t        received;   // monotonic nanoseconds
+} telegram;
+
+typedef struct telegramring {
+        _Atomic uint32_t        head;       // written by the receive thread only
+        char                    pad1[60];
+        _Atomic uint32_t        tail;       // written by the publish thread only
+        char                    pad2[60];
+        uint32_t                mask;
+        struct telegram         *slots;
+        atomic_ulong            overflow;
+} telegramring;
+
+typedef struct publisherbell {
+        atomic_int              waiting;    // the publisher is about to sleep
+        pthread_mutex_t         lock;
+        pthread_cond_t          wakeup;
+} publisherbell;
+
+struct publisherbell    bell = { 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+atomic_int              receiver_done;
+
+/*
+ * Bus load analytics
+ *
+ * kept by the publish thread for every line from the L_Data frames it takes from
+ * the ring. The time a frame holds a TP1 line is estimated from its length: 13 bit
+ * times per character, the idle time before it and the acknowledge after it. The
+ * utilization is a sliding window of per second buckets. Sources and group addresses
+ * are counted with Space-Saving in a fixed number of slots, the busiest addresses of
+ * every BUSLOAD interval are found without a counter per address; an address that
+ * took over a slot carries the count it replaced as error.
+ */
+#define BUSLOAD_SECONDS         60          // sliding window of the utilization
+#define BUSLOAD_SLOTS           64          // addresses tracked per kind
+#define BUSLOAD_TOP             10          // addresses reported per kind
+#define TP1_BITRATE             9600
+#define TP1_CHARBITS            13          // start, 8 data, parity, stop and 2 bits pause
+#define TP1_FRAMEBITS           (50 + 15 + TP1_CHARBITS)   // idle before, pause and acknowledge after
+#define TP1_OVERHEAD            8           // characters besides the TPDU data: header, length, tpci, checksum
+
+/*
+ * Bit times a frame with this cEMI length occupies a TP1 line
+ */
+static inline uint32_t tp1_bits( int length ) {
+    return TP1_FRAMEBITS + TP1_CHARBITS * (TP1_OVERHEAD + length);
+}
+
+typedef struct topk {
+        uint16_t        addr[BUSLOAD_SLOTS];    // network order, scanned first
+        uint32_t        count[BUSLOAD_SLOTS];
+        uint32_t        error[BUSLOAD_SLOTS];
+        int             used;
+} topk;
+
+typedef struct busload {
+        uint32_t        bits[BUSLOAD_SECONDS];  // bit times per second
+        uint64_t        second;                 // monotonic second of the newest bucket
+        uint32_t        windowbits;             // sum of bits[]
+        uint32_t        peakbits;               // busiest second of the interval
+        uint32_t        frames;                 // of the interval
+        uint32_t        repeated;
+        uint32_t        priority[4];            // by the EIB_CTRL_PRIO_* bits
+        struct topk     sources;
+        struct topk     groups;
+        atomic_ulong    utilization;            // per mille over the window, for /metrics
+} busload;
+
+/*
+ * Bus lines
+ *
+ * one per eibnetmux server or KNX IP router or interface, set with BUS= lines or the
+ * command line. Every line has its own receive thread and telegram ring feeding the
+ * one publisher, and its own command queue and executor. A command goes to the line
+ * of the device, or the line its group address was last seen on, or else all lines.
+ */
+#define BUS_MAX                 8
+#define BUS_BURST               64          // telegrams the publisher takes from one ring at a time
+#define BUS_EIBNETMUX           0           // KNXIP_ROUTING and KNXIP_TUNNELLING are KNX IP lines
+#define BUS_REPLAY              -1
+
+/*
+ * Group reads of an eibnetmux line
+ *
+ * enmx_read() sends a group read and then waits for the response or the eibnetmux
+ * timeout, the library has no call that only sends it. The command executor hands
+ * these reads to a reader thread of the line with its own connection, so a device
+ * that does not answer holds up the reads queued behind it but never the writes.
+ * The response is published by the receive thread like any other telegram. A read
+ * for an address that is still waiting, or beyond GROUPREAD_QUEUE, is dropped; the
+ * device is polled again in its next interval.
+ */
+#define GROUPREAD_QUEUE         64
+
+typedef struct groupreads {
+        pthread_mutex_t         lock;
+        pthread_cond_t          wakeup;
+        uint16_t                pending[GROUPREAD_QUEUE];   // knxaddress, ring of count from head
+        int                     head;
+        int                     count;
+} groupreads;
+
+typedef struct busline {
+        char                    name[32];
+        char                    target[255];
+        int                     mode;
+        ENMX_HANDLE             sock_con;
+        ENMX_HANDLE             write_con;
+        ENMX_HANDLE             read_con;   // of the group reader
+        struct groupreads       reads;
+        struct knxip            knx;
+        struct telegramring     ring;
+        struct commandqueue     commands;
+        struct confirmtable     confirms;
+        unsigned long           reported;   // ring overflow already logged
+        pthread_t               receiver;
+        pthread_t               executor;
+        pthread_t               reader;
+        struct busload          load;       // written by the publish thread
+        struct rxmetrics        rx;         // written by the receive thread
+        char                    pad[64];
+        struct txmetrics        tx;         // written by the command executor
+} busline;
+
+typedef struct busset {
+        struct busline          lines[BUS_MAX];
+        int                     count;
+        _Atomic uint8_t         seen[DEVICE_GROUPSLOTS];    // 1 + line a group address was last seen on
+        atomic_int              received;   // telegrams of all lines, for -c
+        int                     running;    // receive threads
+        pthread_mutex_t         lock;
+        pthread_cond_t          stopped;
+} busset;
+
+struct busset           buses = { .lock = PTHREAD_MUTEX_INITIALIZER, .stopped = PTHREAD_COND_INITIALIZER };
+
+typedef struct capturefile {
+        int             fd;
+        unsigned char   *map;               // mapped chunk
+        off_t           mapoffset;          // file offset of the mapped chunk
+        size_t          used;               // bytes used in the mapped chunk
+        unsigned long   records;
+} capturefile;
+
+struct capturefile      capture = { -1, NULL, 0, 0, 0 };
+pthread_mutex_t         capturelock = PTHREAD_MUTEX_INITIALIZER;     // receive threads of all lines
+char                    *replayfile = NULL;
+int                     replayfast = 0;
+
+static void             capture_close( struct capturefile *cf );
+static void             state_request( int32_t daddr );
+static const char       *history_request( int32_t daddr, const char *range );
+static void             history_add( uint16_t daddr, uint64_t time, double value );
+
+/*
+ * Add a bus line, target is hostname[:port] of an eibnetmux server, routing[=address[:port]]
+ * or tunnel=address[:port]
+ */
+static int bus_add( const char *name, const char *target ) {
+    struct busline  *line;
+
+    if (buses.count == BUS_MAX) {
+        log_error("More than %d bus lines, %s skipped\n", BUS_MAX, name);
+        return -1;
+    }
+    line = &buses.lines[buses.count];
+    memset(line, 0, sizeof(*line));
+    snprintf(line->name, sizeof(line->name), "%s", name);
+    line->sock_con = -1;
+    line->write_con = -1;
+    line->read_con = -1;
+    line->knx.fd = -1;
+    if (strcmp(target, "routing") == 0) {
+        line->mode = KNXIP_ROUTING;
+        snprintf(line->target, sizeof(line->target), "%s", KNXIP_MULTICAST);
+    } else if (strncmp(target, "routing=", 8) == 0) {
+        line->mode = KNXIP_ROUTING;
+        snprintf(line->target, sizeof(line->target), "%s", target + 8);
+    } else if (strncmp(target, "tunnel=", 7) == 0) {
+        line->mode = KNXIP_TUNNELLING;
+        snprintf(line->target, sizeof(line->target), "%s", target + 7);
+    } else {
+        line->mode = BUS_EIBNETMUX;
+        snprintf(line->target, sizeof(line->target), "%s", target);
+    }
+    return buses.count++;
+}
+
+/*
+ * Index of the bus line with this name, -1 when there is none
+ */
+static int bus_find( const char *name ) {
+    int             idx;
+
+    for (idx = 0; idx < buses.count; idx++)
+        if (strcmp(buses.lines[idx].name, name) == 0)
+            return idx;
+    return -1;
+}
 
 /*
 * Print out when using invalid options
 */
 static void Usage( char *progname ) {
-    fprintf(logfile, "Usage: %s [options] [hostname[:port]]\n"
+    fprintf(stdout, "Usage: %s [options] [hostname[:port]]\n"
                      "where:\n"
                      "  hostname[:port]                      defines eibnetmux server with default port of 4390\n"
+                     "                                       more lines are set with BUS= in the configfile\n"
                      "\n"
                      "options:\n"
                      "  -u user                              name of user                           default: -\n"
                      "  -c count                             stop after count number of requests    default: endless\n"
                      "  -f filename                          configfile                             default: bluehome.conf\n"
                      "  -l filename                          logfile                                default: on screen\n"
-                     "  -q                                   no verbose output (default: no)\n"
-                     "\n", basename( progname ));
+                     "  -q                                   log level info, no telegram trace      default: trace\n"
+                     "  -w, --capture filename               append raw telegrams to capture file   default: -\n"
+                     "  -r, --replay filename                replay capture file instead of eibnetmux\n"
+                     "  --fast                               replay as fast as possible (default: original speed)\n"
+                     "  -b, --bench                          report throughput, latency and cpu use on exit\n"
+                     "  --routing[=address[:port]]           receive from KNX IP routers instead of eibnetmux, default: %s\n"
+                     "  --tunnel address[:port]              tunnel to a KNX IP interface instead of eibnetmux\n"
+                     "  --ets-import filename                write the ETS group address export (csv or xml) and\n"
+                     "                                       the DEVICE lines to DEVICEDB and exit\n"
+                     "\n", basename( progname ), KNXIP_MULTICAST);
 }
 
 /*
@@ -215,7 +1029,7 @@ char *hexdump( void *string, int len, int spaces ) {
         else
             buf = realloc( buf, buflen );
         if( buf == NULL ) {
-            fprintf(logfile, "Out of memory: %s\n", strerror( errno ));
+            log_error("Out of memory: %s\n", strerror( errno ));
             exit( -9 );
         }
     }
@@ -243,214 +1057,5408 @@ char *hexdump( void *string, int len, int spaces ) {
  */
 
 void Shutdown( int arg ) {
-    fprintf(logfile, "Signal received - shutting down\n" );
+    MQTTAsync_disconnectOptions disc_opts = MQTTAsync_disconnectOptions_initializer;
+    struct busline  *line;
+    int             idx;
 
-    // close monitoring connection
-    if( conn_state != 0 ) {
-        fprintf(logfile, "Disconnecting from eibnetmux\n" );
-        enmx_close( sock_con );
+    log_info("Signal received - shutting down\n" );
+
+    for( idx = 0; idx < buses.count; idx++ ) {
+        line = &buses.lines[idx];
+        // close monitoring connection
+        if( line->sock_con >= 0 ) {
+            log_info("Disconnecting from eibnetmux %s\n", line->target );
+            enmx_close( line->sock_con );
+        }
+        if( line->write_con >= 0 ) {
+            enmx_close( line->write_con );
+        }
+        if( line->read_con >= 0 ) {
+            enmx_close( line->read_con );
+        }
+        if( line->mode == KNXIP_ROUTING || line->mode == KNXIP_TUNNELLING ) {
+            log_info("Disconnecting from %s\n", line->target );
+            knxip_close( &line->knx );
+        }
     }
+    capture_close( &capture );
 
     // Disconnecting MQTT clients
-    MQTTClient_disconnect(client, 10000);
- 	  MQTTClient_destroy(&client);
-    fclose (logfile);
+    disc_opts.timeout = 10000;
+    MQTTAsync_disconnect(client, &disc_opts);
+ 	  MQTTAsync_destroy(&client);
     exit( 0 );
 }
 
-int read_configfile(char * filename, struct config * configuration) {
- FILE *file;
- char line[255];
- struct device * lastdevice;
-
- if (filename == NULL)
-    filename = strdup("bluehome.conf");
+/*
+ * Decoders, each one converts the frame exactly once
+ */
+static void decode_integer( int eis, CEMIFRAME *cemiframe, struct value *val ) {
+    uint32_t        raw[5] = { 0 };
 
- file = fopen (filename, "r");
+    enmx_frame2value( eis, cemiframe, raw );
+    val->v.i = raw[0];
+}
 
- if (file == NULL) {
-   fprintf(logfile, "Can not open configuration file %s\n",filename );
-   exit(-1);
- }
- while(fgets(line, sizeof(line), file) != NULL) {
-  if (line[0] != '#') {   // skip commented line
-     char * token = strtok(line,"=");
-     if (strcmp(token,"ADDRESS") == 0)
-        strcpy(configuration->address,strtok(NULL,"\n"));
+/*
+ * The signed types are decoded as their EIS counter and sign extended from its width
+ */
+static void decode_signed( int eis, CEMIFRAME *cemiframe, struct value *val ) {
+    uint32_t        raw[5] = { 0 };
 
-     if (strcmp(token,"CLIENTID") == 0)
-        strcpy(configuration->clientid,strtok(NULL,"\n"));
-     if (strcmp(token,"QOS") == 0)
-        configuration->qos = atoi(strtok(NULL,"\n"));
-     if (strcmp(token,"TIMEOUT") == 0)
-        configuration->timeout = strtol(strtok(NULL,"\n"),NULL,0);
-     if (strcmp(token,"USERNAME") == 0)
-        strcpy(configuration->username,strtok(NULL,"\n"));
-     if (strcmp(token,"PASSWORD") == 0)
-        strcpy(configuration->password,strtok(NULL,"\n"));
-    if (strcmp(token,"SOLAR_IP") == 0)
-       strcpy(configuration->solar_ip,strtok(NULL,"\n"));
-     if (strcmp(token,"DEVICE") == 0) {
-        struct device * newdevice = (device *) malloc(sizeof(device));
-        newdevice->next = configuration->devicelist;
-        configuration->devicelist = newdevice;
-        strcpy(newdevice->knx,strtok(NULL," "));
-        strcpy(newdevice->name,strtok(NULL," "));
-        strcpy(newdevice->event,strtok(NULL," "));
-        strcpy(newdevice->type,strtok(NULL,"\n"));
-     }
-    }
- }
- if (! quiet) {
-    lastdevice = configuration->devicelist;
-    while (lastdevice) {
-      fprintf(logfile, "On devicelist is %s %s\n",lastdevice->knx,lastdevice->name);
-      lastdevice=lastdevice->next;
+    switch (eis) {
+        case EIS_SIGNED8:
+            enmx_frame2value( 14, cemiframe, raw );
+            val->v.i = (uint32_t)(int32_t)(int8_t)raw[0];
+            break;
+        case EIS_SIGNED16:
+            enmx_frame2value( 10, cemiframe, raw );
+            val->v.i = (uint32_t)(int32_t)(int16_t)raw[0];
+            break;
+        default:
+            enmx_frame2value( 11, cemiframe, raw );
+            val->v.i = raw[0];
     }
- }
- fclose(file);
 }
 
-/*
-    Client subscription to messages, for every message received these functions are called
-*/
-
-volatile MQTTClient_deliveryToken deliveredtoken;
+static void decode_real( int eis, CEMIFRAME *cemiframe, struct value *val ) {
+    double          raw[3] = { 0 };
 
-void delivered(void *context, MQTTClient_deliveryToken dt) {
-  if (! quiet)
-	  fprintf(logfile, "Message with token value %d delivery confirmed\n", dt);
-	deliveredtoken = dt;
+    enmx_frame2value( eis, cemiframe, raw );
+    val->v.f = raw[0];
 }
 
-int msgarrvd(void *context, char *topicName, int topicLen, MQTTClient_message *message) {
-	 int             i;
-	 char            *payloadptr;
-   char            payload[1024];
-   struct          device *actual;
-   uint16_t        knxaddress = 0;
-   uint16_t        eis;
-   unsigned char   *data;
-   unsigned char   *p_val = NULL;
-   int             len;
-   char            value_byte;
-   unsigned char   value_char;
-   int             value_integer;
-   uint32_t        value_int32;
-   float           value_float;
-   char            *string = NULL;
-   int             enmx_version;
-   ENMX_HANDLE     sock_con2 = 0;
-
-   strncpy(payload,message->payload,message->payloadlen);
-
-	 fprintf(logfile, "Received topic: %s\n", topicName);
-	 fprintf(logfile, "Received message: %s\n", payload);
-
-   char devicetype[64];
-   char devicename[64];
-   char deviceaction[64];
-   char devicevalue[64];
-   char * token = strtok(payload,":"); // strip everything before first ':''
-   token = strtok(NULL,"\"");
-   strcpy(devicetype,strtok(NULL,"\""));
-   token = strtok(NULL,"\"");
-   strcpy(devicename,strtok(NULL,"\""));
-   token = strtok(NULL,"\"");
-   strcpy(deviceaction,strtok(NULL,"\""));
-   token = strtok(NULL,"\"");
-   strcpy(devicevalue,strtok(NULL,"\""));
-//   fprintf(logfile, "device type:%s name:%s type:%s value:%s\n", devicetype,devicename,deviceaction,devicevalue);
-
-   actual = configuration.devicelist;
-   while ((strcmp(actual->name,devicename) != 0) && (actual->next)){
-       actual = actual->next;
-   }
-//   fprintf(logfile, "actual = %s\n",actual->name);
-
-   if (strcmp(actual->name, devicename) == 0) {
-      knxaddress = enmx_getaddress(actual->knx);
-//      fprintf(logfile, "KNX = %s\n",actual->knx);
-
-      if (strcmp(deviceaction,"BYTE") == 0)   { eis=1;  value_byte = atoi(devicevalue);    p_val = (unsigned char *)&value_byte; }
-      if (strcmp(deviceaction,"INT") == 0)    { eis=10; value_integer = atoi(devicevalue); p_val = (unsigned char *)&value_integer; }
-      if (strcmp(deviceaction,"INT32") == 0)  { eis=11; value_int32 = atol(devicevalue);   p_val = (unsigned char *)&value_int32; }
-      if (strcmp(deviceaction,"FLOAT") == 0)  { eis=9;  value_float = atof(devicevalue);   p_val = (unsigned char *)&value_float; }
-      if (strcmp(deviceaction,"CHAR") == 0)   { eis=13; value_char = devicevalue[0];       p_val = (unsigned char *)&value_char; }
-      if (strcmp(deviceaction,"STRING") == 0) { eis=15; string = devicevalue;              p_val = (unsigned char *)string; }
-
-      sock_con2 = enmx_open(configuration.eibd_ip, "BlueHouse" );
-      if( (data = malloc( enmx_EISsizeKNX[eis] )) == NULL ) {
-          fprintf(logfile, "Out of memory\n" );
-          exit( -4 );
-      }
-      if( enmx_value2eis( eis, (void *)p_val, data ) != 0 ) {
-          fprintf(logfile, "Error in value conversion\n" );
-          exit( -5 );
-      }
+static void decode_string( int eis, CEMIFRAME *cemiframe, struct value *val ) {
+    char            raw[32] = { 0 };
 
-      len = (eis != 15) ? enmx_EISsizeKNX[eis] : strlen( string );
+    enmx_frame2value( eis, cemiframe, raw );
+    strncpy( val->v.s, raw, sizeof(val->v.s) - 1 );
+    val->v.s[sizeof(val->v.s) - 1] = '\0';
+}
 
-      if( enmx_write( sock_con2, knxaddress, len, data ) != 0 ) {
-          fprintf(logfile, "Unable to send command: %s\n", enmx_errormessage( sock_con ));
-      //    exit( -7 );
-      }
-      free(data);
-      enmx_close( sock_con2 );
-   }
+static const struct eistype eis_types[EIS_TYPES] = {
+    [1]  = { decode_integer, VALUE_BOOL },      // switching
+    [2]  = { decode_integer, VALUE_INT },       // dimming
+    [3]  = { decode_integer, VALUE_TIME },      // time
+    [4]  = { decode_integer, VALUE_DATE },      // date
+    [5]  = { decode_real,    VALUE_FLOAT },     // 2 byte float
+    [6]  = { decode_integer, VALUE_PERCENT },   // relative value 0..255
+    [7]  = { decode_integer, VALUE_INT },       // drive control
+    [8]  = { decode_integer, VALUE_INT },       // priority
+    [9]  = { decode_real,    VALUE_FLOAT },     // 4 byte float
+    [10] = { decode_integer, VALUE_INT },       // 16 bit counter
+    [11] = { decode_integer, VALUE_INT },       // 32 bit counter
+    [13] = { decode_integer, VALUE_CHAR },      // ascii character
+    [14] = { decode_integer, VALUE_INT },       // 8 bit counter
+    [15] = { decode_string,  VALUE_STRING },    // string
+    [EIS_SIGNED8]  = { decode_signed, VALUE_SINT },
+    [EIS_SIGNED16] = { decode_signed, VALUE_SINT },
+    [EIS_SIGNED32] = { decode_signed, VALUE_SINT },
+};
 
-	 MQTTClient_freeMessage(&message);
-	 MQTTClient_free(topicName);
-   fflush(logfile);
-	 return 1;
+/*
+ * EIS type used for devices without a configured type, based on the frame length
+ */
+static inline int eis_bylength( int length ) {
+    switch (length) {
+        case 1:     return 1;
+        case 2:     return 6;
+        case 3:     return 5;
+        case 4:     return 3;
+        case 5:     return EIS_SIGNED32;
+        default:    return 15;
+    }
+}
+
+/*
+ * Decode the value of a write or response frame
+ * returns the EIS type used
+ */
+static int decode_value( int eis, CEMIFRAME *cemiframe, struct value *val ) {
+    if (eis == EIS_AUTO)
+        eis = eis_bylength(cemiframe->length);
+    val->type = eis_types[eis].valuetype;
+    eis_types[eis].decode(eis, cemiframe, val);
+    return eis;
+}
+
+/*
+ * Format an unsigned integer without printf, returns the length
+ */
+static int format_uint( uint32_t n, char *buffer, size_t size ) {
+    char            digits[10];
+    int             len = 0;
+    int             idx;
+
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+    if ((size_t)len >= size) {
+        if (size > 0)
+            buffer[0] = '\0';
+        return 0;
+    }
+    for (idx = 0; idx < len; idx++)
+        buffer[idx] = digits[len - 1 - idx];
+    buffer[len] = '\0';
+    return len;
+}
+
+/*
+ * Format a decoded value as text, returns the length
+ */
+static int value_format( const struct value *val, char *buffer, size_t size ) {
+    struct tm       date;
+    time_t          t;
+
+    switch (val->type) {
+        case VALUE_BOOL:
+            return format_uint(val->v.i != 0, buffer, size);
+        case VALUE_PERCENT:
+            return snprintf(buffer, size, "%u%%", val->v.i * 100 / 255);
+        case VALUE_FLOAT:
+            return snprintf(buffer, size, "%.2f", val->v.f);
+        case VALUE_TIME:
+            return snprintf(buffer, size, "%02u:%02u:%02u", val->v.i / 3600, (val->v.i % 3600) / 60, val->v.i % 60);
+        case VALUE_DATE:
+            t = val->v.i;
+            if (localtime_r(&t, &date) == NULL)
+                return snprintf(buffer, size, "inval date");
+            return snprintf(buffer, size, "%04d/%02d/%02d", date.tm_year + 1900, date.tm_mon + 1, date.tm_mday);
+        case VALUE_CHAR:
+            return snprintf(buffer, size, "%c", (val->v.i >= 0x20 && val->v.i < 0x7f) ? (char)val->v.i : '?');
+        case VALUE_STRING:
+            return snprintf(buffer, size, "%s", val->v.s);
+        case VALUE_INT:
+            return format_uint(val->v.i, buffer, size);
+        case VALUE_SINT:
+            if ((int32_t)val->v.i >= 0 || size < 2)
+                return format_uint(val->v.i, buffer, size);
+            if (format_uint(-(int64_t)(int32_t)val->v.i, buffer + 1, size - 1) == 0) {
+                buffer[0] = '\0';
+                return 0;
+            }
+            buffer[0] = '-';
+            return 1 + strlen(buffer + 1);
+        default:
+            buffer[0] = '\0';
+            return 0;
+    }
+}
+
+/*
+ * Format a decoded value for a JSON string, quotes, backslashes and control
+ * characters of text values are escaped, returns the length
+ */
+static int value_json( const struct value *val, char *buffer, size_t size ) {
+    static const char   hex[] = "0123456789abcdef";
+    char                text[64];
+    unsigned char       c;
+    size_t              len = 0;
+    int                 idx;
+
+    if (val->type != VALUE_STRING && val->type != VALUE_CHAR)
+        return value_format( val, buffer, size );
+    value_format( val, text, sizeof(text) );
+    for (idx = 0; text[idx] != '\0'; idx++) {
+        c = text[idx];
+        if (c == '"' || c == '\\') {
+            if (len + 2 >= size)
+                break;
+            buffer[len++] = '\\';
+            buffer[len++] = c;
+        } else if (c < 0x20) {
+            if (len + 6 >= size)
+                break;
+            memcpy(buffer + len, "\\u00", 4);
+            buffer[len + 4] = hex[c >> 4];
+            buffer[len + 5] = hex[c & 0x0f];
+            len += 6;
+        } else {
+            if (len + 1 >= size)
+                break;
+            buffer[len++] = c;
+        }
+    }
+    if (size > 0)
+        buffer[len] = '\0';
+    return len;
+}
+
+/*
+ * CBOR encoding
+ *
+ * FORMAT=cbor publishes device values as CBOR (RFC 8949) on fmt/cbor topics, the
+ * payload {"d":{"value":<value>,"time":<epoch ms>}} carries the value in its own
+ * type: booleans, signed and unsigned integers (percent, seconds since midnight
+ * and epoch seconds for times and dates), floats and text.
+ */
+#define FORMAT_JSON             0
+#define FORMAT_CBOR             1
+
+static const char *payloadformats[] = { "json", "cbor" };
+
+#define CBOR_UINT               0x00
+#define CBOR_NEGINT             0x20
+#define CBOR_TEXT               0x60
+#define CBOR_ARRAY              0x80
+#define CBOR_MAP                0xa0
+#define CBOR_FALSE              0xf4
+#define CBOR_TRUE               0xf5
+#define CBOR_NULL               0xf6
+#define CBOR_FLOAT32            0xfa
+#define CBOR_FLOAT64            0xfb
+#define CBOR_INDEFINITE         0x1f
+#define CBOR_BREAK              0xff
+#define CBOR_KEY(p, lit)        cbor_text((p), (lit), sizeof(lit) - 1)
+
+static inline unsigned char *cbor_head( unsigned char *p, int major, uint64_t n ) {
+    int             bytes;
+
+    if (n < 24) {
+        *p++ = major | n;
+        return p;
+    }
+    bytes = (n <= 0xff) ? 1 : (n <= 0xffff) ? 2 : (n <= 0xffffffff) ? 4 : 8;
+    *p++ = major | ((bytes == 1) ? 24 : (bytes == 2) ? 25 : (bytes == 4) ? 26 : 27);
+    while (bytes-- > 0)
+        *p++ = n >> (bytes * 8);
+    return p;
+}
+
+static inline unsigned char *cbor_text( unsigned char *p, const char *text, size_t len ) {
+    p = cbor_head(p, CBOR_TEXT, len);
+    memcpy(p, text, len);
+    return p + len;
+}
+
+/*
+ * Encode a value in its own type, a float that single precision holds exactly
+ * takes 4 bytes instead of 8
+ */
+static unsigned char *cbor_value( unsigned char *p, const struct value *val ) {
+    uint64_t        bits;
+    uint32_t        bits32;
+    float           single;
+    char            c;
+    int             bytes;
+
+    switch (val->type) {
+        case VALUE_BOOL:
+            *p++ = val->v.i ? CBOR_TRUE : CBOR_FALSE;
+            return p;
+        case VALUE_PERCENT:
+            return cbor_head(p, CBOR_UINT, val->v.i * 100 / 255);
+        case VALUE_FLOAT:
+            single = val->v.f;
+            if ((double)single == val->v.f) {
+                memcpy(&bits32, &single, sizeof(bits32));
+                bits = bits32;
+                bytes = 4;
+                *p++ = CBOR_FLOAT32;
+            } else {
+                memcpy(&bits, &val->v.f, sizeof(bits));
+                bytes = 8;
+                *p++ = CBOR_FLOAT64;
+            }
+            while (bytes-- > 0)
+                *p++ = bits >> (bytes * 8);
+            return p;
+        case VALUE_CHAR:
+            c = (val->v.i >= 0x20 && val->v.i < 0x7f) ? (char)val->v.i : '?';
+            return cbor_text(p, &c, 1);
+        case VALUE_STRING:
+            return cbor_text(p, val->v.s, strnlen(val->v.s, sizeof(val->v.s)));
+        case VALUE_NONE:
+            *p++ = CBOR_NULL;
+            return p;
+        case VALUE_SINT:
+            // a negative n is encoded as -1 - n
+            if ((int32_t)val->v.i < 0)
+                return cbor_head(p, CBOR_NEGINT, (uint64_t)(-1 - (int64_t)(int32_t)val->v.i));
+            return cbor_head(p, CBOR_UINT, val->v.i);
+        default:
+            return cbor_head(p, CBOR_UINT, val->v.i);
+    }
+}
+
+/*
+ * Map a configured datapoint type to its EIS type
+ * accepts "eis=N" and "dpt=" with the KNX notations 9.001, DPT9.001, DPT-9 and DPST-9-1
+ * returns -1 for unsupported types
+ */
+static int datapoint_eis( const char *option ) {
+    int             main = 0;
+    int             sub = -1;
+    const char      *p;
+
+    if (strncmp(option, "eis=", 4) == 0) {
+        main = atoi(option + 4);
+        return (main >= 1 && main <= EIS_MAX && eis_types[main].decode != NULL) ? main : -1;
+    }
+    if (strncmp(option, "dpt=", 4) != 0)
+        return -1;
+    p = option + 4;
+    while (*p && (*p < '0' || *p > '9'))
+        p++;
+    if (sscanf(p, "%d", &main) != 1)
+        return -1;
+    while (*p >= '0' && *p <= '9')
+        p++;
+    if (*p == '.' || *p == '-')
+        sscanf(p + 1, "%d", &sub);
+
+    switch (main) {
+        case 1:     return 1;
+        case 3:     return 2;
+        case 4:     return 13;
+        case 5:     return (sub == 1) ? 6 : 14;
+        case 6:     return EIS_SIGNED8;
+        case 7:     return 10;
+        case 8:     return EIS_SIGNED16;
+        case 9:     return 5;
+        case 10:    return 3;
+        case 11:    return 4;
+        case 12:    return 11;
+        case 13:    return EIS_SIGNED32;
+        case 14:    return 9;
+        case 16:    return 15;
+        default:    return -1;
+    }
+}
+
+/*
+ * Parse a group address in 3 level (main/middle/sub) or 2 level (main/sub) notation
+ * returns the address in host byte order or -1 when the string is not a group address
+ */
+static int knx_parsegroup( const char *string ) {
+    unsigned int    top, sub, group;
+    char            end;
+
+    if (sscanf(string, "%u/%u/%u%c", &top, &sub, &group, &end) == 3) {
+        if (top > 31 || sub > 7 || group > 255)
+            return -1;
+        return (top << 11) | (sub << 8) | group;
+    }
+    if (sscanf(string, "%u/%u%c", &top, &group, &end) == 2) {
+        if (top > 31 || group > 2047)
+            return -1;
+        return (top << 11) | group;
+    }
+    return -1;
+}
+
+/*
+ * EIB_CTRL_PRIO_* bits of system, alarm, high or low, -1 when unknown
+ */
+static int knx_parsepriority( const char *string ) {
+    if (strcmp(string, "system") == 0)
+        return EIB_CTRL_PRIO_SYSTEM;
+    if (strcmp(string, "alarm") == 0)
+        return EIB_CTRL_PRIO_ALARM;
+    if (strcmp(string, "high") == 0)
+        return EIB_CTRL_PRIO_HIGH;
+    if (strcmp(string, "low") == 0)
+        return EIB_CTRL_PRIO_LOW;
+    return -1;
+}
+
+/*
+ * FNV-1a hash used for the device name index
+ */
+static uint32_t name_hash( const char *name ) {
+    uint32_t        hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Allocate an empty device table
+ */
+static struct devicetable *devicetable_create( void ) {
+    static uint32_t     generations;
+    struct devicetable  *table;
+
+    table = calloc(1, sizeof(struct devicetable));
+    if (table == NULL) {
+        log_error("Out of memory: %s\n", strerror( errno ));
+        exit( -9 );
+    }
+    table->generation = ++generations;
+    return table;
+}
+
+/*
+ * Whether a part of the table lies in the device database it was mapped from
+ */
+static inline int devicetable_mapped( const struct devicetable *table, const void *part ) {
+    return table->map != NULL && (const char *)part >= (const char *)table->map
+           && (const char *)part < (const char *)table->map + table->mapsize;
+}
+
+/*
+ * Copy a string into the arena of the table, returns its offset
+ */
+static uint32_t devicetable_addstring( struct devicetable *table, const char *string ) {
+    uint32_t        offset;
+    size_t          len = strlen(string) + 1;
+    char            *arena;
+
+    // a mapped arena is copied before it grows
+    if (devicetable_mapped(table, table->arena)) {
+        if ((arena = malloc(table->arenasize)) == NULL) {
+            log_error("Out of memory: %s\n", strerror( errno ));
+            exit( -9 );
+        }
+        table->arena = memcpy(arena, table->arena, table->arenalen);
+    }
+    if (table->arenalen + len > table->arenasize) {
+        table->arenasize = table->arenasize ? table->arenasize * 2 : 4096;
+        while (table->arenalen + len > table->arenasize)
+            table->arenasize *= 2;
+        table->arena = realloc(table->arena, table->arenasize);
+        if (table->arena == NULL) {
+            log_error("Out of memory: %s\n", strerror( errno ));
+            exit( -9 );
+        }
+    }
+    offset = table->arenalen;
+    memcpy(table->arena + offset, string, len);
+    table->arenalen += len;
+    return offset;
+}
+
+/*
+ * Append a device to the table, the indexes and topics are built by devicetable_index()
+ */
+static int devicetable_add( struct devicetable *table, const char *knx, const char *name, const char *event, const char *type, int eis,
+                            int line, int priority, uint32_t poll, const struct devicefilter *filter ) {
+    struct device   *newdevice;
+    int             grp;
+
+    if ((grp = knx_parsegroup(knx)) < 0) {
+        log_error("Invalid group address %s for device %s\n", knx, name);
+        return -1;
+    }
+    if (table->count == table->size) {
+        table->size = table->size ? table->size * 2 : 64;
+        table->devices = realloc(table->devices, table->size * sizeof(struct device));
+        if (table->devices == NULL) {
+            log_error("Out of memory: %s\n", strerror( errno ));
+            exit( -9 );
+        }
+    }
+    newdevice = &table->devices[table->count++];
+    newdevice->knx = devicetable_addstring(table, knx);
+    newdevice->name = devicetable_addstring(table, name);
+    newdevice->event = devicetable_addstring(table, event);
+    newdevice->type = devicetable_addstring(table, type);
+    newdevice->daddr = htons((uint16_t)grp);
+    newdevice->eis = eis;
+    newdevice->line = line;
+    newdevice->priority = priority;
+    newdevice->poll = poll;
+    newdevice->filter = *filter;
+    return 0;
+}
+
+/*
+ * Build the MQTT topic and batch entry of a device once the whole file is read,
+ * they depend on FORMAT wherever it is in the file. The CBOR entry is a map header
+ * and text strings, it has no zero byte and is kept in the arena as a string.
+ */
+static void device_strings( struct devicetable *table, struct device *dev ) {
+    char            topic[1024];
+    char            event[255];
+    char            name[255];
+    char            type[255];
+    unsigned char   *p;
+
+    snprintf(event, sizeof(event), "%s", DEVSTR(table, dev->event));
+    snprintf(name, sizeof(name), "%s", DEVSTR(table, dev->name));
+    snprintf(type, sizeof(type), "%s", DEVSTR(table, dev->type));
+    snprintf(topic, sizeof(topic), "iot-2/type/%s/id/%s/evt/%s/fmt/%s", event, name, type, payloadformats[configuration.format]);
+    dev->topic = devicetable_addstring(table, topic);
+    if (configuration.format == FORMAT_CBOR) {
+        p = cbor_head((unsigned char *)topic, CBOR_MAP, 5);
+        p = cbor_text(CBOR_KEY(p, "type"), event, strlen(event));
+        p = cbor_text(CBOR_KEY(p, "id"), name, strlen(name));
+        p = cbor_text(CBOR_KEY(p, "evt"), type, strlen(type));
+        p = CBOR_KEY(p, "value");
+        *p = '\0';
+    } else {
+        snprintf(topic, sizeof(topic), "{\"type\":\"%s\",\"id\":\"%s\",\"evt\":\"%s\",\"value\":\"", event, name, type);
+    }
+    dev->entry = devicetable_addstring(table, topic);
+}
+
+/*
+ * Allocate the value state of the devices and list those with a heartbeat or a
+ * minimal interval
+ */
+static void devicetable_state( struct devicetable *table ) {
+    int             idx;
+
+    table->state = calloc(table->count + 1, sizeof(struct devicestate));
+    table->heartbeats = malloc((table->count + 1) * sizeof(int32_t));
+    if (table->state == NULL || table->heartbeats == NULL) {
+        log_error("Out of memory: %s\n", strerror( errno ));
+        exit( -9 );
+    }
+    table->heartbeatcount = 0;
+    for (idx = 0; idx < table->count; idx++)
+        if (table->devices[idx].filter.heartbeat > 0 || table->devices[idx].filter.minint > 0)
+            table->heartbeats[table->heartbeatcount++] = idx;
+}
+
+/*
+ * Build the group address and name indexes
+ * when an address or name is configured twice the last DEVICE line wins
+ */
+static void devicetable_index( struct devicetable *table ) {
+    uint32_t        slots = 16;
+    uint32_t        slot;
+    int             idx;
+
+    while (slots < (uint32_t)table->count * 2)
+        slots *= 2;
+    table->namemask = slots - 1;
+    table->bygroup = malloc(DEVICE_GROUPSLOTS * sizeof(int32_t));
+    table->byname = malloc(slots * sizeof(int32_t));
+    if (table->bygroup == NULL || table->byname == NULL) {
+        log_error("Out of memory: %s\n", strerror( errno ));
+        exit( -9 );
+    }
+    memset(table->bygroup, 0xff, DEVICE_GROUPSLOTS * sizeof(int32_t));
+    memset(table->byname, 0xff, slots * sizeof(int32_t));
+
+    for (idx = 0; idx < table->count; idx++) {
+        struct device *dev = &table->devices[idx];
+
+        table->bygroup[dev->daddr] = idx;
+        slot = name_hash(DEVSTR(table, dev->name)) & table->namemask;
+        while (table->byname[slot] != DEVICE_NONE &&
+               strcmp(DEVSTR(table, table->devices[table->byname[slot]].name), DEVSTR(table, dev->name)) != 0)
+            slot = (slot + 1) & table->namemask;
+        table->byname[slot] = idx;
+        device_strings(table, dev);
+    }
+    devicetable_state(table);
+}
+
+static void devicetable_free( struct devicetable *table ) {
+    if (! devicetable_mapped(table, table->arena))
+        free(table->arena);
+    if (! devicetable_mapped(table, table->devices))
+        free(table->devices);
+    if (! devicetable_mapped(table, table->bygroup))
+        free(table->bygroup);
+    if (! devicetable_mapped(table, table->byname))
+        free(table->byname);
+    free(table->state);
+    free(table->heartbeats);
+    if (table->map != NULL)
+        munmap(table->map, table->mapsize);
+    free(table);
+}
+
+/*
+ * Find a device on its raw group address (network byte order as in the cEMI frame)
+ */
+static inline struct device *device_bygroup( struct devicetable *table, uint16_t daddr ) {
+    int32_t         idx = table->bygroup[daddr];
+
+    return (idx == DEVICE_NONE) ? NULL : &table->devices[idx];
+}
+
+/*
+ * Find a device on its name
+ */
+static struct device *device_byname( struct devicetable *table, const char *name ) {
+    uint32_t        slot = name_hash(name) & table->namemask;
+    int32_t         idx;
+
+    while ((idx = table->byname[slot]) != DEVICE_NONE) {
+        if (strcmp(DEVSTR(table, table->devices[idx].name), name) == 0)
+            return &table->devices[idx];
+        slot = (slot + 1) & table->namemask;
+    }
+    return NULL;
+}
+
+/*
+ * Parse the seconds of a DEVICE option into milliseconds, returns -1 when the
+ * value is not a number, has trailing characters, is negative or too large
+ */
+static int option_seconds( const char *value, uint32_t *ms ) {
+    char            *end;
+    double          seconds;
+
+    errno = 0;
+    seconds = strtod(value, &end);
+    if (end == value || *end != '\0' || errno != 0 || !(seconds >= 0.0 && seconds * 1000 <= UINT32_MAX))
+        return -1;
+    *ms = seconds * 1000;
+    return 0;
+}
+
+/*
+ * Add the device of a DEVICE line, the rest of the line is taken with strtok()
+ * returns the number of problems found, they are logged
+ */
+static int device_parse( struct devicetable *table ) {
+    char                *knx = strtok(NULL," ");
+    char                *name = strtok(NULL," ");
+    char                *event = strtok(NULL," ");
+    char                *type = strtok(NULL," \n");
+    char                *option;
+    char                *end;
+    int                 eis = EIS_AUTO;
+    int                 line = -1;
+    int                 priority = EIB_CTRL_PRIO_LOW;
+    uint32_t            poll = 0;
+    int                 problems = 0;
+    struct devicefilter filter = { 0, 0.0, 0, 0 };
+
+    while ((option = strtok(NULL," \n")) != NULL) {
+        if (strncmp(option,"dpt=",4) == 0 || strncmp(option,"eis=",4) == 0) {
+            if ((eis = datapoint_eis(option)) < 0) {
+                log_error("Unsupported datapoint type %s for device %s, using frame length\n", option, name);
+                eis = EIS_AUTO;
+                problems++;
+            }
+        } else if (strcmp(option,"cov") == 0) {
+            filter.flags |= FILTER_COV;
+        } else if (strncmp(option,"deadband=",9) == 0) {
+            errno = 0;
+            filter.deadband = strtof(option + 9, &end);
+            filter.flags |= FILTER_COV;
+            if (*end == '%') {
+                filter.flags |= FILTER_PERCENT;
+                end++;
+            }
+            if (end == option + 9 || *end != '\0' || errno != 0 || !(filter.deadband >= 0.0f)) {
+                log_error("Invalid %s for device %s\n", option, name);
+                filter.deadband = 0.0f;
+                problems++;
+            }
+        } else if (strncmp(option,"minint=",7) == 0) {
+            if (option_seconds(option + 7, &filter.minint) != 0) {
+                log_error("Invalid %s for device %s\n", option, name);
+                problems++;
+            }
+        } else if (strncmp(option,"heartbeat=",10) == 0) {
+            if (option_seconds(option + 10, &filter.heartbeat) != 0) {
+                log_error("Invalid %s for device %s\n", option, name);
+                problems++;
+            }
+        } else if (strncmp(option,"poll=",5) == 0) {
+            if (option_seconds(option + 5, &poll) != 0) {
+                log_error("Invalid %s for device %s\n", option, name);
+                problems++;
+            }
+        } else if (strncmp(option,"priority=",9) == 0) {
+            if ((priority = knx_parsepriority(option + 9)) < 0) {
+                log_error("Unknown priority %s for device %s\n", option + 9, name);
+                priority = EIB_CTRL_PRIO_LOW;
+                problems++;
+            }
+        } else if (strncmp(option,"line=",5) == 0) {
+            if ((line = bus_find(option + 5)) < 0) {
+                log_error("Unknown bus line %s for device %s, BUS lines go before DEVICE lines\n", option + 5, name);
+                problems++;
+            }
+        } else {
+            log_error("Unknown option %s for device %s\n", option, name);
+            problems++;
+        }
+    }
+    if (type == NULL) {
+        log_error("Incomplete DEVICE line skipped\n");
+        problems++;
+    } else if (devicetable_add(table, knx, name, event, type, eis, line, priority, poll, &filter) != 0) {
+        problems++;
+    }
+    return problems;
+}
+
+int read_configfile(char * filename, struct config * configuration) {
+ FILE *file;
+ char line[255];
+ struct devicetable * table;
+ int idx;
+
+ if (filename == NULL)
+    filename = strdup("bluehome.conf");
+
+ file = fopen (filename, "r");
+
+ if (file == NULL) {
+   log_error("Can not open configuration file %s\n",filename );
+   exit(-1);
+ }
+ table = devicetable_create();
+ while(fgets(line, sizeof(line), file) != NULL) {
+  if (line[0] != '#') {   // skip commented line
+     char * token = strtok(line,"=");
+     if (strcmp(token,"ADDRESS") == 0)
+        strcpy(configuration->address,strtok(NULL,"\n"));
+
+     if (strcmp(token,"CLIENTID") == 0)
+        strcpy(configuration->clientid,strtok(NULL,"\n"));
+     if (strcmp(token,"QOS") == 0)
+        configuration->qos = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"TIMEOUT") == 0)
+        configuration->timeout = strtol(strtok(NULL,"\n"),NULL,0);
+     if (strcmp(token,"COMMANDQUEUE") == 0)
+        configuration->commandqueue = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"TELEGRAMRING") == 0)
+        configuration->telegramring = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"SPOOLDIR") == 0)
+        strcpy(configuration->spooldir,strtok(NULL,"\n"));
+     if (strcmp(token,"SPOOLSIZE") == 0)
+        configuration->spoolsize = strtol(strtok(NULL,"\n"),NULL,0);
+     if (strcmp(token,"SPOOLSEGMENT") == 0)
+        configuration->spoolsegment = strtol(strtok(NULL,"\n"),NULL,0);
+     if (strcmp(token,"SPOOLRATE") == 0)
+        configuration->spoolrate = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"BATCH") == 0)
+        configuration->batch = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"BATCHWINDOW") == 0)
+        configuration->batchwindow = strtol(strtok(NULL,"\n"),NULL,0);
+     if (strcmp(token,"BATCHTOPIC") == 0)
+        strcpy(configuration->batchtopic,strtok(NULL,"\n"));
+     if (strcmp(token,"MAXINFLIGHT") == 0)
+        configuration->maxinflight = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"LOGLEVEL") == 0) {
+        char * level = strtok(NULL," \n");
+        if (level == NULL || (configuration->loglevel = log_parselevel(level)) < 0)
+           log_error("Unknown log level %s\n", level ? level : "");
+     }
+     if (strcmp(token,"METRICS") == 0)
+        strcpy(configuration->metrics,strtok(NULL," \n"));
+     if (strcmp(token,"STATSINTERVAL") == 0)
+        configuration->statsinterval = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"BUSLOAD") == 0)
+        configuration->busload = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"BUSLOADTOP") == 0)
+        configuration->busloadtop = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"WRITEBUDGET") == 0)
+        configuration->writebudget = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"CONFIRMTIMEOUT") == 0)
+        configuration->confirmtimeout = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"CONFIRMRETRIES") == 0)
+        configuration->confirmretries = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"FORMAT") == 0) {
+        char * format = strtok(NULL," \n");
+        if (format != NULL && strcmp(format, payloadformats[FORMAT_CBOR]) == 0)
+           configuration->format = FORMAT_CBOR;
+        else if (format == NULL || strcmp(format, payloadformats[FORMAT_JSON]) != 0)
+           log_error("Unknown payload format %s\n", format ? format : "");
+     }
+     if (strcmp(token,"MQTTVERSION") == 0)
+        configuration->mqttversion = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"FEED") == 0)
+        strcpy(configuration->feed,strtok(NULL," \n"));
+     if (strcmp(token,"FEEDSLOTS") == 0)
+        configuration->feedslots = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"DEVICEDB") == 0)
+        strcpy(configuration->devicedb,strtok(NULL," \n"));
+     if (strcmp(token,"HISTORY") == 0)
+        configuration->history = strtol(strtok(NULL,"\n"),NULL,0);
+     if (strcmp(token,"LOGSIZE") == 0)
+        configuration->logsize = strtol(strtok(NULL,"\n"),NULL,0);
+     if (strcmp(token,"LOGFILES") == 0)
+        configuration->logfiles = atoi(strtok(NULL,"\n"));
+     if (strcmp(token,"USERNAME") == 0)
+        strcpy(configuration->username,strtok(NULL,"\n"));
+     if (strcmp(token,"PASSWORD") == 0)
+        strcpy(configuration->password,strtok(NULL,"\n"));
+     if (strcmp(token,"KNXADDRESS") == 0) {
+        unsigned int area, line, device;
+        char * address = strtok(NULL," \n");
+        if (address != NULL && sscanf(address, "%u.%u.%u", &area, &line, &device) == 3 && area < 16 && line < 16 && device < 256)
+           configuration->knxaddress = htons((area << 12) | (line << 8) | device);
+        else
+           log_error("Invalid KNX address %s\n", address ? address : "");
+     }
+     if (strcmp(token,"BUS") == 0) {
+        char * name = strtok(NULL," ");
+        char * target = strtok(NULL," \n");
+        if (target == NULL)
+           log_error("Incomplete BUS line skipped\n");
+        else
+           bus_add(name, target);
+     }
+    if (strcmp(token,"SOLAR_IP") == 0)
+       strcpy(configuration->solar_ip,strtok(NULL,"\n"));
+     if (strcmp(token,"DEVICE") == 0)
+        device_parse(table);
+    }
+ }
+ devicetable_index(table);
+ configuration->devices = table;
+ configuration->configfile = filename;
+ if (log_enabled(LEVEL_TRACE)) {
+    for (idx = table->count - 1; idx >= 0; idx--)
+      log_trace("On devicelist is %s %s\n",DEVSTR(table, table->devices[idx].knx),DEVSTR(table, table->devices[idx].name));
+ }
+ fclose(file);
+ return 0;
+}
+
+/*
+ * Read the DEVICE lines of the configuration file into a new table, NULL when the
+ * file can not be read or has a problem. Other settings need a restart.
+ */
+static struct devicetable *devicetable_load( const char *filename ) {
+    struct devicetable  *table;
+    FILE                *file;
+    char                line[255];
+    char                *token;
+    char                *name;
+    int                 problems = 0;
+    int                 lineno = 0;
+    int                 found;
+
+    if ((file = fopen(filename, "r")) == NULL) {
+        log_error("Can not open configuration file %s: %s\n", filename, strerror( errno ));
+        return NULL;
+    }
+    table = devicetable_create();
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lineno++;
+        if (line[0] == '#' || (token = strtok(line, "=")) == NULL)
+            continue;
+        if (strcmp(token, "DEVICE") == 0) {
+            // a malformed option rejects the file like an unknown one
+            if ((found = device_parse(table)) > 0)
+                log_error("DEVICE line %d of %s is invalid\n", lineno, filename);
+            problems += found;
+        } else if (strcmp(token, "BUS") == 0 && (name = strtok(NULL, " \n")) != NULL && bus_find(name) < 0)
+            log_info("BUS line %s is only added at startup\n", name);
+    }
+    fclose(file);
+    if (problems > 0) {
+        log_error("%d problems in %s\n", problems, filename);
+        devicetable_free(table);
+        return NULL;
+    }
+    devicetable_index(table);
+    return table;
+}
+
+/*
+ * Device database
+ *
+ * --ets-import reads the group addresses of an ETS export (CSV or XML), puts the
+ * DEVICE lines of the configuration file on top and writes the table to DEVICEDB:
+ * the devices, string arena and both indexes as the gateway uses them. At startup
+ * and on SIGHUP that file is mapped instead of parsed, which takes the same time for
+ * ten or ten thousand group addresses. The file belongs to the build that wrote it,
+ * another version or device layout is refused and the DEVICE lines are used.
+ */
+#define DEVICEDB_MAGIC          "BHDEVDB "
+#define DEVICEDB_VERSION        1
+#define DEVICEDB_ALIGN(len)     (((len) + 7) & ~7)
+#define ETS_FIELDS              16
+
+typedef struct devicedbheader {
+        char            magic[8];
+        uint32_t        version;
+        uint32_t        devicesize;         // sizeof(struct device)
+        uint32_t        count;
+        uint32_t        namemask;
+        uint32_t        arenalen;
+        uint32_t        format;             // FORMAT the topics and batch entries were built for
+        uint64_t        devices;            // file offsets
+        uint64_t        bygroup;
+        uint64_t        byname;
+        uint64_t        arena;
+        uint64_t        created;            // wall clock seconds
+        uint64_t        sourcetime;         // modification time of the export
+        uint64_t        configtime;         // modification time of the configuration file
+        char            source[256];        // the export
+} devicedbheader;
+
+/*
+ * An import in progress: the table, the group addresses and names it has and the
+ * group range names of a CSV export, which come before their addresses
+ */
+typedef struct etsimport {
+        struct devicetable *table;
+        uint8_t         taken[DEVICE_GROUPSLOTS / 8];
+        uint32_t        *names;             // arena offset of a name + 1, 0 for a free slot
+        uint32_t        namemask;
+        char            main[32][64];
+        char            middle[32][8][64];
+        int             imported;           // group addresses in the export
+        int             decoded;            // with a datapoint type the gateway decodes
+        int             kept;               // devices of DEVICE lines
+} etsimport;
+
+/*
+ * ETS names may hold anything, what separates topic levels, is a wildcard or needs
+ * escaping in JSON becomes '_'
+ */
+static void ets_name( char *name, size_t size, const char *string, const char *fallback ) {
+    size_t          len = 0;
+
+    while (string != NULL && *string == ' ')
+        string++;
+    if (string == NULL || *string == '\0')
+        string = fallback;
+    for (; *string != '\0' && len + 1 < size; string++)
+        name[len++] = (strchr(" /+#\"\\", *string) != NULL || (unsigned char)*string < 0x20) ? '_' : *string;
+    while (len > 0 && name[len - 1] == '_')
+        len--;
+    name[len] = '\0';
+}
+
+/*
+ * Slot of a name in the names of the import, free when the name is not taken yet
+ */
+static uint32_t *ets_nameslot( struct etsimport *imp, const char *name ) {
+    uint32_t        slot = name_hash(name) & imp->namemask;
+
+    while (imp->names[slot] != 0 && strcmp(DEVSTR(imp->table, imp->names[slot] - 1), name) != 0)
+        slot = (slot + 1) & imp->namemask;
+    return &imp->names[slot];
+}
+
+/*
+ * Keep the names at most half full before one more is added
+ */
+static void ets_namegrow( struct etsimport *imp ) {
+    uint32_t        *old = imp->names;
+    uint32_t        oldmask = imp->namemask;
+    uint32_t        slot;
+
+    if (old != NULL && (uint32_t)imp->table->count * 2 < oldmask)
+        return;
+    imp->namemask = (old != NULL) ? oldmask * 2 + 1 : 1023;
+    if ((imp->names = calloc(imp->namemask + 1, sizeof(uint32_t))) == NULL) {
+        log_error("Out of memory: %s\n", strerror( errno ));
+        exit( -9 );
+    }
+    if (old == NULL)
+        return;
+    for (slot = 0; slot <= oldmask; slot++)
+        if (old[slot] != 0)
+            *ets_nameslot(imp, DEVSTR(imp->table, old[slot] - 1)) = old[slot];
+    free(old);
+}
+
+/*
+ * Add a group address of the export unless a DEVICE line or an earlier entry has it.
+ * The main group range is the event type, the middle group range the event. A name
+ * that is taken gets the group address appended.
+ */
+static void ets_add( struct etsimport *imp, const char *address, const char *name, const char *main, const char *middle,
+                     const char *dpt ) {
+    static const struct devicefilter nofilter = { 0, 0.0, 0, 0 };
+    char            knx[16];
+    char            devname[128];
+    char            event[64];
+    char            type[64];
+    char            option[64];
+    uint32_t        *slot;
+    unsigned int    raw;
+    char            end;
+    int             grp;
+    int             eis = EIS_AUTO;
+
+    // the XML of some ETS versions has the address as a number
+    if ((grp = knx_parsegroup(address)) < 0) {
+        if (sscanf(address, "%u%c", &raw, &end) != 1 || raw > 0xffff) {
+            log_error("Invalid group address %s of %s skipped\n", address, name);
+            return;
+        }
+        grp = raw;
+    }
+    imp->imported++;
+    if (imp->taken[grp >> 3] & (1 << (grp & 7)))
+        return;
+    snprintf(knx, sizeof(knx), "%d/%d/%d", grp >> 11, (grp >> 8) & 0x07, grp & 0xff);
+    ets_name(event, sizeof(event), main, "ETS");
+    ets_name(type, sizeof(type), middle, "Value");
+    snprintf(option, sizeof(option), "GA_%d_%d_%d", grp >> 11, (grp >> 8) & 0x07, grp & 0xff);
+    ets_name(devname, sizeof(devname) - 16, name, option);
+    ets_namegrow(imp);
+    slot = ets_nameslot(imp, devname);
+    if (*slot != 0) {
+        snprintf(devname + strlen(devname), 16, "_%d_%d_%d", grp >> 11, (grp >> 8) & 0x07, grp & 0xff);
+        if (*(slot = ets_nameslot(imp, devname)) != 0) {
+            log_error("Name %s of group address %s taken, skipped\n", devname, knx);
+            return;
+        }
+    }
+    if (dpt != NULL && *dpt != '\0') {
+        snprintf(option, sizeof(option), "dpt=%s", dpt);
+        if ((eis = datapoint_eis(option)) < 0)
+            eis = EIS_AUTO;
+        else
+            imp->decoded++;
+    }
+    if (devicetable_add(imp->table, knx, devname, event, type, eis, -1, EIB_CTRL_PRIO_LOW, 0, &nofilter) != 0)
+        return;
+    imp->taken[grp >> 3] |= 1 << (grp & 7);
+    *slot = imp->table->devices[imp->table->count - 1].name + 1;
+}
+
+/*
+ * Split the next CSV record in place, quotes are removed and doubled quotes undone.
+ * Returns the number of fields, -1 at the end of the buffer.
+ */
+static int ets_csvrecord( char **cursor, char separator, char **fields ) {
+    char            *p = *cursor;
+    char            *start;
+    char            *out;
+    char            c;
+    int             count = 0;
+
+    if (*p == '\0')
+        return -1;
+    for (;;) {
+        start = out = p;
+        if (*p == '"') {
+            for (p++; *p != '\0'; ) {
+                if (*p == '"' && p[1] != '"') {
+                    p++;
+                    break;
+                }
+                if (*p == '"')
+                    p++;
+                *out++ = *p++;
+            }
+        }
+        while (*p != '\0' && *p != separator && *p != '\r' && *p != '\n')
+            *out++ = *p++;
+        c = *p;
+        *out = '\0';
+        if (count < ETS_FIELDS)
+            fields[count++] = start;
+        if (c != separator)
+            break;
+        p++;
+    }
+    // the terminator may have been overwritten, c still has it
+    if (c == '\r')
+        c = *++p;
+    if (c == '\n')
+        p++;
+    *cursor = p;
+    return count;
+}
+
+/*
+ * CSV export of ETS with header, 3/1 (a name and address column, group ranges have
+ * addresses like 1/-/-) or 1/1 (names and numbers of main, middle and sub group).
+ * The separator is the one the header has most of.
+ */
+static int ets_csv( struct etsimport *imp, char *buffer, const char *filename ) {
+    char            *fields[ETS_FIELDS];
+    char            *cursor = buffer;
+    char            *p;
+    char            address[32];
+    char            separator = ',';
+    int             counts[3] = { 0, 0, 0 };
+    int             addresscol = -1;
+    int             namecol = 0;
+    int             dptcol = -1;
+    int             levels;
+    int             count;
+    int             col;
+    int             top;
+    int             sub;
+    int             group;
+
+    for (p = buffer; *p != '\0' && *p != '\n'; p++)
+        counts[0] += (*p == ',');
+    for (p = buffer; *p != '\0' && *p != '\n'; p++)
+        counts[1] += (*p == ';');
+    for (p = buffer; *p != '\0' && *p != '\n'; p++)
+        counts[2] += (*p == '\t');
+    if (counts[1] > counts[0] && counts[1] >= counts[2])
+        separator = ';';
+    else if (counts[2] > counts[0] && counts[2] > counts[1])
+        separator = '\t';
+
+    count = ets_csvrecord(&cursor, separator, fields);
+    for (col = 0; col < count; col++) {
+        if (strcasecmp(fields[col], "Address") == 0)
+            addresscol = col;
+        else if (strcasecmp(fields[col], "Group name") == 0)
+            namecol = col;
+        else if (strcasecmp(fields[col], "DatapointType") == 0)
+            dptcol = col;
+    }
+    if (addresscol < 0 && (count < 6 || strcasecmp(fields[0], "Main") != 0)) {
+        log_error("%s is no ETS group address export, export as CSV 3/1 or 1/1 with header\n", filename);
+        return -1;
+    }
+    while ((count = ets_csvrecord(&cursor, separator, fields)) >= 0) {
+        if (addresscol < 0) {
+            // 1/1: ranges are the rows without a sub group
+            if (count < 6 || fields[5][0] == '\0')
+                continue;
+            snprintf(address, sizeof(address), "%s/%s/%s", fields[3], fields[4], fields[5]);
+            ets_add(imp, address, fields[2], fields[0], fields[1], (dptcol >= 0 && dptcol < count) ? fields[dptcol] : NULL);
+            continue;
+        }
+        if (count <= addresscol || count <= namecol)
+            continue;
+        // 3 level 1/2/3, 2 level 1/234 or free 1234, the range rows end in /-
+        levels = sscanf(fields[addresscol], "%d/%d/%d", &top, &sub, &group);
+        if (levels > 1 && (top < 0 || top > 31))
+            levels = 0;
+        if ((levels == 3 || (levels == 2 && strchr(fields[addresscol], '-') != NULL)) && (sub < 0 || sub > 7))
+            levels = 0;
+        if (strchr(fields[addresscol], '-') != NULL) {
+            if (levels == 1 && top >= 0 && top <= 31)
+                snprintf(imp->main[top], sizeof(imp->main[top]), "%s", fields[namecol]);
+            else if (levels == 2)
+                snprintf(imp->middle[top][sub], sizeof(imp->middle[top][sub]), "%s", fields[namecol]);
+            else
+                log_error("Invalid group range %s of %s skipped\n", fields[addresscol], fields[namecol]);
+        } else if (levels > 0) {
+            // ets_add() checks the address and logs the ones it skips
+            ets_add(imp, fields[addresscol], fields[namecol], (levels > 1) ? imp->main[top] : NULL,
+                    (levels == 3) ? imp->middle[top][sub] : NULL, (dptcol >= 0 && dptcol < count) ? fields[dptcol] : NULL);
+        } else if (fields[addresscol][0] != '\0') {
+            log_error("Invalid group address %s of %s skipped\n", fields[addresscol], fields[namecol]);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Value of an attribute of the XML tag from tag to end, entities decoded.
+ * Returns 0 when the tag has no such attribute.
+ */
+static int ets_xmlattr( const char *tag, const char *end, const char *attr, char *value, size_t size ) {
+    static const char * const entities[][2] = {
+        { "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" }, { "&quot;", "\"" }, { "&apos;", "'" }
+    };
+    size_t          attrlen = strlen(attr);
+    size_t          len = 0;
+    const char      *p;
+    const char      *semi;
+    unsigned int    code;
+    int             idx;
+
+    value[0] = '\0';
+    for (p = tag; p + attrlen + 2 < end; p++)
+        if ((*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') && strncmp(p + 1, attr, attrlen) == 0
+                && p[attrlen + 1] == '=' && p[attrlen + 2] == '"')
+            break;
+    if (p + attrlen + 2 >= end)
+        return 0;
+    for (p += attrlen + 3; p < end && *p != '"' && len + 1 < size; ) {
+        if (*p != '&') {
+            value[len++] = *p++;
+            continue;
+        }
+        for (idx = 0; idx < 5 && strncmp(p, entities[idx][0], strlen(entities[idx][0])) != 0; idx++)
+            ;
+        if (idx < 5) {
+            value[len++] = entities[idx][1][0];
+            p += strlen(entities[idx][0]);
+        } else if ((semi = strchr(p, ';')) != NULL && semi < end
+                   && (sscanf(p, "&#x%x;", &code) == 1 || sscanf(p, "&#%u;", &code) == 1)) {
+            // names are ASCII in topics, other characters would need UTF-8 here
+            value[len++] = (code >= 0x20 && code < 0x7f) ? (char)code : '_';
+            p = semi + 1;
+        } else {
+            value[len++] = *p++;
+        }
+    }
+    value[len] = '\0';
+    return 1;
+}
+
+/*
+ * XML export of ETS: GroupAddress elements nested in up to three GroupRange elements
+ */
+static int ets_xml( struct etsimport *imp, char *buffer ) {
+    char            range[2][64] = { "", "" };
+    char            name[256];
+    char            address[32];
+    char            dpt[64];
+    char            *p = buffer;
+    char            *end;
+    int             depth = 0;
+
+    while ((p = strchr(p, '<')) != NULL && (end = strchr(p, '>')) != NULL) {
+        if (strncmp(p, "<GroupRange", 11) == 0 && strchr(" \t\r\n/>", p[11]) != NULL) {
+            if (depth < 2)
+                ets_xmlattr(p, end, "Name", range[depth], sizeof(range[depth]));
+            if (end[-1] != '/')
+                depth++;
+        } else if (strncmp(p, "</GroupRange", 12) == 0) {
+            if (depth > 0)
+                depth--;
+        } else if (strncmp(p, "<GroupAddress", 13) == 0 && strchr(" \t\r\n/>", p[13]) != NULL) {
+            ets_xmlattr(p, end, "Name", name, sizeof(name));
+            ets_xmlattr(p, end, "DPTs", dpt, sizeof(dpt));
+            if (ets_xmlattr(p, end, "Address", address, sizeof(address)))
+                ets_add(imp, address, name, (depth > 0) ? range[0] : NULL, (depth > 1) ? range[1] : NULL, dpt);
+        }
+        p = end + 1;
+    }
+    return 0;
+}
+
+/*
+ * Write the indexed table to filename, through a temporary file so a running
+ * gateway never maps half a database
+ */
+static int devicedb_write( struct devicetable *table, const char *filename, const char *source ) {
+    static const char       zeros[8];
+    struct devicedbheader   hdr;
+    struct stat             st;
+    char                    tmpname[1100];
+    FILE                    *file;
+    size_t                  devicelen = (size_t)table->count * sizeof(struct device);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, DEVICEDB_MAGIC, 8);
+    hdr.version = DEVICEDB_VERSION;
+    hdr.devicesize = sizeof(struct device);
+    hdr.count = table->count;
+    hdr.namemask = table->namemask;
+    hdr.arenalen = table->arenalen;
+    hdr.format = configuration.format;
+    hdr.devices = DEVICEDB_ALIGN(sizeof(hdr));
+    hdr.bygroup = hdr.devices + DEVICEDB_ALIGN(devicelen);
+    hdr.byname = hdr.bygroup + DEVICE_GROUPSLOTS * sizeof(int32_t);
+    hdr.arena = hdr.byname + (table->namemask + 1) * sizeof(int32_t);
+    hdr.created = time(NULL);
+    if (stat(source, &st) == 0)
+        hdr.sourcetime = st.st_mtime;
+    if (configuration.configfile != NULL && stat(configuration.configfile, &st) == 0)
+        hdr.configtime = st.st_mtime;
+    snprintf(hdr.source, sizeof(hdr.source), "%s", source);
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+    if ((file = fopen(tmpname, "w")) == NULL) {
+        log_error("Can not write device database %s: %s\n", tmpname, strerror( errno ));
+        return -1;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, file);
+    fwrite(zeros, hdr.devices - sizeof(hdr), 1, file);
+    fwrite(table->devices, devicelen, 1, file);
+    fwrite(zeros, DEVICEDB_ALIGN(devicelen) - devicelen, 1, file);
+    fwrite(table->bygroup, sizeof(int32_t), DEVICE_GROUPSLOTS, file);
+    fwrite(table->byname, sizeof(int32_t), table->namemask + 1, file);
+    fwrite(table->arena, table->arenalen, 1, file);
+    if (ferror(file) || fclose(file) != 0 || rename(tmpname, filename) != 0) {
+        log_error("Can not write device database %s: %s\n", filename, strerror( errno ));
+        unlink(tmpname);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Build the device database filename from the ETS export and the devices of the
+ * configuration file, which win over the export for the same group address
+ */
+static int devicedb_import( const char *export, struct devicetable *devices, const char *filename ) {
+    struct etsimport        *imp;
+    struct stat             st;
+    struct device           *dev;
+    char                    *buffer;
+    char                    *start;
+    FILE                    *file;
+    int                     grp;
+    int                     idx;
+    int                     rc;
+
+    if ((file = fopen(export, "r")) == NULL || fstat(fileno(file), &st) != 0) {
+        log_error("Can not open ETS export %s: %s\n", export, strerror( errno ));
+        return -1;
+    }
+    if ((buffer = malloc(st.st_size + 1)) == NULL || (imp = calloc(1, sizeof(struct etsimport))) == NULL) {
+        log_error("Out of memory: %s\n", strerror( errno ));
+        exit( -9 );
+    }
+    buffer[fread(buffer, 1, st.st_size, file)] = '\0';
+    fclose(file);
+    start = buffer;
+    if ((unsigned char)start[0] == 0xff || (unsigned char)start[0] == 0xfe) {
+        log_error("ETS export %s is UTF-16, export it with UTF-8 encoding\n", export);
+        free(buffer);
+        free(imp);
+        return -1;
+    }
+    if (strncmp(start, "\xef\xbb\xbf", 3) == 0)
+        start += 3;
+
+    imp->table = devicetable_create();
+    for (idx = 0; idx < devices->count; idx++) {
+        dev = &devices->devices[idx];
+        ets_namegrow(imp);
+        devicetable_add(imp->table, DEVSTR(devices, dev->knx), DEVSTR(devices, dev->name), DEVSTR(devices, dev->event),
+                        DEVSTR(devices, dev->type), dev->eis, dev->line, dev->priority, dev->poll, &dev->filter);
+        *ets_nameslot(imp, DEVSTR(devices, dev->name)) = imp->table->devices[imp->table->count - 1].name + 1;
+        grp = ntohs(dev->daddr);
+        imp->taken[grp >> 3] |= 1 << (grp & 7);
+        imp->kept++;
+    }
+    while (*start == ' ' || *start == '\t' || *start == '\r' || *start == '\n')
+        start++;
+    rc = (*start == '<') ? ets_xml(imp, start) : ets_csv(imp, start, export);
+    if (rc == 0) {
+        devicetable_index(imp->table);
+        rc = devicedb_write(imp->table, filename, export);
+    }
+    if (rc == 0)
+        log_info("%d group addresses in %s, %d devices written to %s: %d from DEVICE lines, %d with a known datapoint type\n",
+                 imp->imported, export, imp->table->count, filename, imp->kept, imp->decoded);
+    devicetable_free(imp->table);
+    free(imp->names);
+    free(imp);
+    free(buffer);
+    return rc;
+}
+
+/*
+ * Check what the gateway takes from a mapped device database: the sections lie
+ * in the file, every index and string offset is within the table and the arena
+ * ends in a zero. Returns what is wrong, NULL when the file can be used.
+ */
+static const char *devicedb_check( const struct devicedbheader *hdr, uint64_t size ) {
+    const struct device     *devices;
+    const int32_t           *bygroup;
+    const int32_t           *byname;
+    const char              *arena;
+    uint64_t                slots = (uint64_t)hdr->namemask + 1;
+    uint64_t                used = 0;
+    uint64_t                slot;
+    int                     idx;
+
+    if (memcmp(hdr->magic, DEVICEDB_MAGIC, 8) != 0 || hdr->version != DEVICEDB_VERSION || hdr->devicesize != sizeof(struct device))
+        return "no device database of this version";
+    if ((slots & (slots - 1)) != 0 || slots < 2 * (uint64_t)hdr->count || hdr->count > INT_MAX || hdr->arenalen == 0
+            || memchr(hdr->source, '\0', sizeof(hdr->source)) == NULL)
+        return "inconsistent header";
+    if (hdr->devices % 8 != 0 || hdr->bygroup % 4 != 0 || hdr->byname % 4 != 0
+            || hdr->devices > size || (uint64_t)hdr->count * sizeof(struct device) > size - hdr->devices
+            || hdr->bygroup > size || DEVICE_GROUPSLOTS * sizeof(int32_t) > size - hdr->bygroup
+            || hdr->byname > size || slots * sizeof(int32_t) > size - hdr->byname
+            || hdr->arena > size || hdr->arenalen > size - hdr->arena)
+        return "truncated";
+    devices = (const struct device *)((const char *)hdr + hdr->devices);
+    bygroup = (const int32_t *)((const char *)hdr + hdr->bygroup);
+    byname = (const int32_t *)((const char *)hdr + hdr->byname);
+    arena = (const char *)hdr + hdr->arena;
+    if (arena[hdr->arenalen - 1] != '\0')
+        return "string arena not terminated";
+    for (idx = 0; idx < (int)hdr->count; idx++) {
+        const struct device *dev = &devices[idx];
+
+        if (dev->knx >= hdr->arenalen || dev->name >= hdr->arenalen || dev->event >= hdr->arenalen
+                || dev->type >= hdr->arenalen || dev->topic >= hdr->arenalen || dev->entry >= hdr->arenalen)
+            return "string offset out of range";
+        if (dev->eis >= EIS_TYPES || (dev->eis != EIS_AUTO && eis_types[dev->eis].decode == NULL)
+                || dev->line < -1 || dev->line >= buses.count)
+            return "device out of range";
+    }
+    for (slot = 0; slot < DEVICE_GROUPSLOTS; slot++)
+        if (bygroup[slot] != DEVICE_NONE && (bygroup[slot] < 0 || bygroup[slot] >= (int32_t)hdr->count))
+            return "group address index out of range";
+    // name lookups probe until a free slot, one must be left
+    for (slot = 0; slot < slots; slot++) {
+        if (byname[slot] == DEVICE_NONE)
+            continue;
+        if (byname[slot] < 0 || byname[slot] >= (int32_t)hdr->count || ++used > hdr->count)
+            return "name index out of range";
+    }
+    return NULL;
+}
+
+/*
+ * Map the device database as device table, NULL when it can not be used. The map
+ * is read-only unless the topics are built again because FORMAT changed since the
+ * import.
+ */
+static struct devicetable *devicedb_map( const char *filename ) {
+    struct devicedbheader   *hdr;
+    struct devicetable      *table;
+    struct stat             st;
+    const char              *problem;
+    void                    *map;
+    int                     fd;
+    int                     idx;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        log_error("Can not open device database %s: %s\n", filename, strerror( errno ));
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct devicedbheader)
+            || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        log_error("Can not map device database %s\n", filename);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    hdr = map;
+    if ((problem = devicedb_check(hdr, st.st_size)) != NULL) {
+        log_error("Device database %s rejected, %s, run --ets-import again\n", filename, problem);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    // private pages, the file itself is never written
+    if (hdr->format != (uint32_t)configuration.format && mprotect(map, st.st_size, PROT_READ | PROT_WRITE) != 0) {
+        log_error("Can not map device database %s: %s\n", filename, strerror( errno ));
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    table = devicetable_create();
+    table->map = map;
+    table->mapsize = st.st_size;
+    table->devices = (struct device *)((char *)map + hdr->devices);
+    table->count = table->size = hdr->count;
+    table->bygroup = (int32_t *)((char *)map + hdr->bygroup);
+    table->byname = (int32_t *)((char *)map + hdr->byname);
+    table->namemask = hdr->namemask;
+    table->arena = (char *)map + hdr->arena;
+    table->arenalen = table->arenasize = hdr->arenalen;
+    if (hdr->format != (uint32_t)configuration.format)
+        for (idx = 0; idx < table->count; idx++)
+            device_strings(table, &table->devices[idx]);
+    devicetable_state(table);
+
+    if (stat(hdr->source, &st) == 0 && (uint64_t)st.st_mtime > hdr->sourcetime)
+        log_error("ETS export %s changed after %s was made, run --ets-import again\n", hdr->source, filename);
+    if (configuration.configfile != NULL && stat(configuration.configfile, &st) == 0 && (uint64_t)st.st_mtime > hdr->configtime)
+        log_error("%s changed after %s was made, its DEVICE and BUS lines are only used by --ets-import\n",
+                  configuration.configfile, filename);
+    return table;
+}
+
+/*
+ * Monotonic clock in nanoseconds
+ */
+static inline uint64_t monotonic_ns( void ) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * CPU time used by the calling thread in nanoseconds
+ */
+static inline uint64_t threadcpu_ns( void ) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Add a sample to a latency histogram, each histogram has a single writer thread
+ */
+static void latency_record( struct latency *lat, uint64_t ns ) {
+    int             msb;
+    int             idx;
+
+    if (ns < (1 << LATENCY_SUBBITS)) {
+        idx = ns;
+    } else {
+        msb = 63 - __builtin_clzll(ns);
+        idx = ((msb - LATENCY_SUBBITS + 1) << LATENCY_SUBBITS) + ((ns >> (msb - LATENCY_SUBBITS)) & ((1 << LATENCY_SUBBITS) - 1));
+    }
+    lat->buckets[idx]++;
+    lat->count++;
+    if (ns > lat->max)
+        lat->max = ns;
+}
+
+/*
+ * Upper bound of a histogram bucket in nanoseconds
+ */
+static uint64_t latency_bucketvalue( int idx ) {
+    int             shift;
+
+    if (idx < (1 << LATENCY_SUBBITS))
+        return idx;
+    shift = (idx >> LATENCY_SUBBITS) - 1;
+    return ((uint64_t)((1 << LATENCY_SUBBITS) + (idx & ((1 << LATENCY_SUBBITS) - 1))) << shift) + ((1ULL << shift) - 1);
+}
+
+/*
+ * Latency below which the given fraction of the samples fall
+ */
+static uint64_t latency_percentile( const struct latency *lat, double fraction ) {
+    uint64_t        wanted = (uint64_t)ceil(lat->count * fraction);
+    uint64_t        seen = 0;
+    int             idx;
+
+    for (idx = 0; idx < LATENCY_BUCKETS; idx++) {
+        seen += lat->buckets[idx];
+        if (seen >= wanted && seen > 0) {
+            uint64_t value = latency_bucketvalue(idx);
+            return (value < lat->max) ? value : lat->max;
+        }
+    }
+    return lat->max;
+}
+
+/*
+ * Print the benchmark results, called when the gateway stops
+ */
+static void bench_report( void ) {
+    double          seconds = (benchmark.end - benchmark.start) / 1e9;
+    unsigned long   frames = atomic_load(&benchmark.frames);
+    unsigned long   commands = atomic_load(&benchmark.commands);
+
+    if (seconds <= 0)
+        seconds = 1e-9;
+    log_info("Benchmark monitor path: %lu frames in %.3f s, %.0f frames/s, %lu published\n",
+            frames, seconds, frames / seconds, atomic_load(&benchmark.published));
+    log_info("Benchmark monitor path: latency p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+            latency_percentile(&benchmark.publish, 0.50) / 1e3, latency_percentile(&benchmark.publish, 0.99) / 1e3,
+            latency_percentile(&benchmark.publish, 0.999) / 1e3, benchmark.publish.max / 1e3);
+    log_info("Benchmark monitor path: cpu %.2f us per frame\n",
+            frames ? atomic_load(&benchmark.monitorcpu) / 1e3 / frames : 0.0);
+    log_info("Benchmark command path: %lu commands, latency p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+            commands, latency_percentile(&benchmark.command, 0.50) / 1e3, latency_percentile(&benchmark.command, 0.99) / 1e3,
+            latency_percentile(&benchmark.command, 0.999) / 1e3, benchmark.command.max / 1e3);
+    log_info("Benchmark command path: cpu %.2f us per command\n",
+            commands ? atomic_load(&benchmark.commandcpu) / 1e3 / commands : 0.0);
+}
+
+/*
+ * Allocate the bounded command queue
+ */
+static void commandqueue_init( struct commandqueue *queue, int size ) {
+    pthread_condattr_t  attr;
+    int                 prio;
+
+    for (prio = 0; prio < COMMAND_PRIORITIES; prio++) {
+        queue->rings[prio].items = malloc(size * sizeof(struct command));
+        if (queue->rings[prio].items == NULL) {
+            log_error("Out of memory: %s\n", strerror( errno ));
+            exit( -9 );
+        }
+        queue->rings[prio].head = 0;
+        queue->rings[prio].count = 0;
+    }
+    queue->size = size;
+    queue->count = 0;
+    queue->coalesced = 0;
+    queue->tokens = 0;
+    queue->filled = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue->notempty, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/*
+ * Ring of a priority, system first and low last
+ */
+static inline struct commandring *commandqueue_ring( struct commandqueue *queue, int priority ) {
+    static const uint8_t    urgency[4] = { 0, 2, 1, 3 };   // system, high, alarm, low
+
+    return &queue->rings[urgency[(priority & EIB_CTRL_PRIO_LOW) >> 2]];
+}
+
+/*
+ * Queued command for a group address, NULL when there is none
+ */
+static struct command *commandqueue_find( struct commandqueue *queue, uint16_t knxaddress, int read ) {
+    struct commandring  *ring;
+    struct command      *item;
+    int                 prio;
+    int                 idx;
+
+    for (prio = 0; prio < COMMAND_PRIORITIES; prio++) {
+        ring = &queue->rings[prio];
+        for (idx = 0; idx < ring->count; idx++) {
+            item = &ring->items[(ring->head + idx) % queue->size];
+            if (item->knxaddress == knxaddress && item->read == read)
+                return item;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Queue a command, never blocks: returns -1 when the queue of its priority is full.
+ * A new value for a queued group address replaces the queued value, a retry of an
+ * older value is dropped then, as is a read of an address with a read queued.
+ */
+static int commandqueue_put( struct commandqueue *queue, const struct command *cmd ) {
+    struct commandring  *ring;
+    struct command      *queued;
+    int                 rc = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if ((queued = commandqueue_find(queue, cmd->knxaddress, cmd->read)) != NULL) {
+        if (cmd->attempts == 0 && ! cmd->read) {
+            *queued = *cmd;
+            queue->coalesced++;
+        }
+        rc = 0;
+    } else if ((ring = commandqueue_ring(queue, cmd->priority))->count < queue->size) {
+        ring->items[(ring->head + ring->count) % queue->size] = *cmd;
+        ring->count++;
+        queue->count++;
+        pthread_cond_signal(&queue->notempty);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return rc;
+}
+
+/*
+ * Wait until the executor has taken all queued commands, at most one second
+ */
+static void commandqueue_drain( struct commandqueue *queue ) {
+    int             tries;
+
+    for (tries = 0; tries < 100; tries++) {
+        pthread_mutex_lock(&queue->lock);
+        if (queue->count == 0) {
+            pthread_mutex_unlock(&queue->lock);
+            return;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        usleep(10000);
+    }
+}
+
+/*
+ * Bit times a write of the command occupies the line
+ */
+static inline uint32_t command_bits( const struct command *cmd ) {
+    return tp1_bits(cmd->len == 1 ? 1 : cmd->len + 1);
+}
+
+/*
+ * Take the most urgent command the write budget allows, waits at most until the
+ * monotonic time deadline: returns -1 when it passed without a command
+ */
+static int commandqueue_get( struct commandqueue *queue, struct command *cmd, uint64_t deadline ) {
+    double              rate = configuration.writebudget * TP1_BITRATE / 100.0 / 1e9;  // bit times per ns
+    double              depth = configuration.writebudget * TP1_BITRATE / 100.0;       // one second of budget
+    struct commandring  *ring = NULL;
+    struct timespec     ts;
+    uint64_t            until;
+    uint64_t            now;
+    uint32_t            bits;
+    int                 prio;
+
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        now = monotonic_ns();
+        until = deadline;
+        for (prio = 0; prio < COMMAND_PRIORITIES && queue->rings[prio].count == 0; prio++)
+            ;
+        if (prio < COMMAND_PRIORITIES) {
+            ring = &queue->rings[prio];
+            if (configuration.writebudget <= 0)
+                break;
+            queue->tokens += (now - queue->filled) * rate;
+            if (queue->tokens > depth)
+                queue->tokens = depth;
+            queue->filled = now;
+            bits = command_bits(&ring->items[ring->head]);
+            if (queue->tokens >= bits) {
+                queue->tokens -= bits;
+                break;
+            }
+            // a more urgent command arriving meanwhile is taken first
+            if (now + (bits - queue->tokens) / rate < until)
+                until = now + (bits - queue->tokens) / rate + 1;
+        }
+        if (now >= deadline) {
+            pthread_mutex_unlock(&queue->lock);
+            return -1;
+        }
+        ts.tv_sec = until / 1000000000;
+        ts.tv_nsec = until % 1000000000;
+        pthread_cond_timedwait(&queue->notempty, &queue->lock, &ts);
+    }
+    *cmd = ring->items[ring->head];
+    ring->head = (ring->head + 1) % queue->size;
+    ring->count--;
+    queue->count--;
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+/*
+ * Lines that report L_Data.con for the frames the gateway sends
+ */
+static inline int confirm_tracked( const struct busline *line ) {
+    return configuration.confirmtimeout > 0 && (line->mode == BUS_EIBNETMUX || line->mode == KNXIP_TUNNELLING);
+}
+
+/*
+ * Remember a written command until its confirmation, the oldest write is given up
+ * when the table is full
+ */
+static void confirm_wait( struct busline *line, const struct command *cmd, uint64_t now ) {
+    struct confirmtable *table = &line->confirms;
+    int                 oldest = 0;
+    int                 idx;
+
+    pthread_mutex_lock(&table->lock);
+    for (idx = 0; idx < CONFIRM_SLOTS && table->slots[idx].sent != 0; idx++)
+        if (table->slots[idx].sent < table->slots[oldest].sent)
+            oldest = idx;
+    if (idx == CONFIRM_SLOTS) {
+        metric_add(&line->tx.unconfirmed, 1);
+        idx = oldest;
+    } else {
+        atomic_fetch_add(&table->waiting, 1);
+    }
+    table->slots[idx].cmd = *cmd;
+    table->slots[idx].sent = now;
+    pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Match an L_Data.con from the receive thread with the oldest write to its group
+ * address. A negative confirmation makes the write due for a retry at once.
+ */
+static void confirm_frame( struct busline *line, const CEMIFRAME *frame ) {
+    struct confirmtable *table = &line->confirms;
+    struct confirmwait  *match = NULL;
+    uint64_t            now = monotonic_ns();
+    int                 idx;
+
+    pthread_mutex_lock(&table->lock);
+    for (idx = 0; idx < CONFIRM_SLOTS; idx++) {
+        struct confirmwait *slot = &table->slots[idx];
+
+        if (slot->sent > 1 && htons(slot->cmd.knxaddress) == frame->daddr && (match == NULL || slot->sent < match->sent))
+            match = slot;
+    }
+    if (match != NULL && (frame->ctrl & CEMI_CTRL_ERROR)) {
+        match->sent = 1;
+        pthread_cond_signal(&line->commands.notempty);
+    } else if (match != NULL) {
+        metric_add(&line->rx.confirmed, 1);
+        metric_add(&line->rx.confirmnanos, now - match->sent);
+        match->sent = 0;
+        atomic_fetch_sub(&table->waiting, 1);
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Queue the writes that were not confirmed in time again, or give them up after
+ * CONFIRMRETRIES. Returns the monotonic time the next one is due.
+ */
+static uint64_t confirm_expire( struct busline *line, uint64_t now ) {
+    struct confirmtable *table = &line->confirms;
+    struct confirmwait  *slot;
+    uint64_t            timeout = configuration.confirmtimeout * 1000000ULL;
+    uint64_t            next = now + timeout;
+    char                address[KNX_ADDRSIZE];
+    int                 idx;
+
+    if (atomic_load(&table->waiting) == 0)
+        return next;
+    pthread_mutex_lock(&table->lock);
+    for (idx = 0; idx < CONFIRM_SLOTS; idx++) {
+        slot = &table->slots[idx];
+        if (slot->sent == 0)
+            continue;
+        if (now - slot->sent < timeout && slot->sent != 1) {
+            if (slot->sent + timeout < next)
+                next = slot->sent + timeout;
+            continue;
+        }
+        if (slot->cmd.attempts <= configuration.confirmretries && commandqueue_put(&line->commands, &slot->cmd) == 0) {
+            metric_add(&line->tx.retried, 1);
+        } else {
+            log_error("Write to %s on line %s not confirmed\n", knx_group(htons(slot->cmd.knxaddress), address), line->name);
+            metric_add(&line->tx.unconfirmed, 1);
+        }
+        slot->sent = 0;
+        atomic_fetch_sub(&table->waiting, 1);
+    }
+    pthread_mutex_unlock(&table->lock);
+    return next;
+}
+
+/*
+ * Hand a group read of an eibnetmux line to its reader, returns at once
+ */
+static int groupread_queue( struct busline *line, uint16_t knxaddress ) {
+    struct groupreads       *reads = &line->reads;
+    char                    address[KNX_ADDRSIZE];
+    int                     idx;
+
+    pthread_mutex_lock(&reads->lock);
+    for (idx = 0; idx < reads->count; idx++)
+        if (reads->pending[(reads->head + idx) % GROUPREAD_QUEUE] == knxaddress)
+            break;
+    if (idx < reads->count || reads->count == GROUPREAD_QUEUE) {
+        pthread_mutex_unlock(&reads->lock);
+        log_trace("Read of %s on line %s dropped, %d reads waiting\n", knx_group( htons(knxaddress), address ), line->name, reads->count);
+        metric_add(&line->tx.readsdropped, 1);
+        return 0;
+    }
+    reads->pending[(reads->head + reads->count) % GROUPREAD_QUEUE] = knxaddress;
+    reads->count++;
+    pthread_cond_signal(&reads->wakeup);
+    pthread_mutex_unlock(&reads->lock);
+    return 0;
+}
+
+/*
+ * Group reader thread of an eibnetmux line, one read at a time on its own connection.
+ * The address stays queued while it is read so a poll of it meanwhile is dropped.
+ */
+static void *groupread_thread( void *arg ) {
+    struct busline          *line = arg;
+    struct groupreads       *reads = &line->reads;
+    unsigned char           *value;
+    uint16_t                knxaddress;
+    uint16_t                length;
+    char                    address[KNX_ADDRSIZE];
+    int                     backoff = 1;
+
+    for (;;) {
+        pthread_mutex_lock(&reads->lock);
+        while (reads->count == 0)
+            pthread_cond_wait(&reads->wakeup, &reads->lock);
+        knxaddress = reads->pending[reads->head];
+        pthread_mutex_unlock(&reads->lock);
+
+        if (line->read_con < 0 && (line->read_con = enmx_open(line->target, "BlueHouse" )) < 0) {
+            log_error("Connect to eibnetmux %s for reading failed (%d): %s\n", line->target, line->read_con,
+                      enmx_errormessage( line->read_con ));
+            sleep(backoff);
+            if (backoff < COMMAND_MAXBACKOFF)
+                backoff *= 2;
+            continue;
+        }
+        backoff = 1;
+        // the response is also seen by the receive thread and published from there
+        if ((value = enmx_read( line->read_con, knxaddress, &length )) != NULL) {
+            free(value);
+        } else if (enmx_geterror( line->read_con ) == ENMX_E_TIMEOUT) {
+            log_trace("No response to read of %s on line %s\n", knx_group( htons(knxaddress), address ), line->name);
+            metric_add(&line->tx.unanswered, 1);
+        } else {
+            log_error("Unable to read %s on line %s: %s\n", knx_group( htons(knxaddress), address ), line->name,
+                      enmx_errormessage( line->read_con ));
+            metric_add(&line->tx.failed, 1);
+            enmx_close( line->read_con );
+            line->read_con = -1;
+        }
+        pthread_mutex_lock(&reads->lock);
+        reads->head = (reads->head + 1) % GROUPREAD_QUEUE;
+        reads->count--;
+        pthread_mutex_unlock(&reads->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Write one command to the bus line, (re)opening the eibnetmux write connection when
+ * needed, retries with an increasing delay as long as eibnetmux can not be reached.
+ * Group reads of eibnetmux lines go to the group reader of the line.
+ */
+static int command_write( struct busline *line, struct command *cmd ) {
+    int             backoff = 1;
+
+    if (line->mode == BUS_REPLAY) {
+        log_trace("Replaying, command for %04x not written\n", cmd->knxaddress);
+        return 0;
+    }
+    if (line->mode != BUS_EIBNETMUX) {
+        if (cmd->read ? knxip_groupread(&line->knx, htons(cmd->knxaddress), cmd->priority) == 0
+                      : knxip_groupwrite(&line->knx, htons(cmd->knxaddress), cmd->data, cmd->len, cmd->priority) == 0)
+            return 0;
+        log_error("Unable to send command on line %s: %s\n", line->name, line->knx.error);
+        return -1;
+    }
+    if (cmd->read)
+        return groupread_queue(line, cmd->knxaddress);
+    for (;;) {
+        if (line->write_con < 0) {
+            line->write_con = enmx_open(line->target, "BlueHouse" );
+            if (line->write_con < 0) {
+                log_error("Connect to eibnetmux %s for writing failed (%d): %s\n", line->target, line->write_con,
+                          enmx_errormessage( line->write_con ));
+                sleep(backoff);
+                if (backoff < COMMAND_MAXBACKOFF)
+                    backoff *= 2;
+                continue;
+            }
+        }
+        if (enmx_write( line->write_con, cmd->knxaddress, cmd->len, cmd->data ) == 0)
+            return 0;
+        log_error("Unable to send command on line %s: %s\n", line->name, enmx_errormessage( line->write_con ));
+        enmx_close( line->write_con );
+        line->write_con = -1;
+        if (backoff > 1)
+            return -1;      // already failed on a fresh connection, drop the command
+        backoff = 2;
+    }
+}
+
+/*
+ * Command executor thread, one per bus line
+ */
+static void *command_executor( void *arg ) {
+    struct busline  *line = arg;
+    struct command  cmd;
+    uint64_t        deadline;
+    uint64_t        cpu;
+    int             tracked = confirm_tracked(line);
+
+    for (;;) {
+        deadline = tracked ? confirm_expire(line, monotonic_ns()) : monotonic_ns() + 1000000000ULL;
+        if (commandqueue_get(&line->commands, &cmd, deadline) != 0)
+            continue;
+        cpu = bench ? threadcpu_ns() : 0;
+        cmd.attempts++;
+        if (command_write(line, &cmd) == 0) {
+            metric_add(&line->tx.commands, 1);
+            // a group reader waits for the response itself, its reads are not sent yet
+            if (tracked && ! (cmd.read && line->mode == BUS_EIBNETMUX))
+                confirm_wait(line, &cmd, monotonic_ns());
+        } else {
+            metric_add(&line->tx.failed, 1);
+        }
+        if (bench) {
+            latency_record(&benchmark.command, monotonic_ns() - cmd.received);
+            atomic_fetch_add(&benchmark.commands, 1);
+            atomic_fetch_add(&benchmark.commandcpu, threadcpu_ns() - cpu);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Queue a command on the line of the device, all lines when its group address was
+ * not seen yet
+ */
+static void bus_command( const struct devicetable *table, const struct device *actual, const struct command *cmd ) {
+    int             first = actual->line;
+    int             last;
+    int             idx;
+
+    if (first < 0)
+        first = atomic_load_explicit(&buses.seen[actual->daddr], memory_order_relaxed) - 1;
+    last = first;
+    if (first < 0) {
+        first = 0;
+        last = buses.count - 1;
+    }
+    for (idx = first; idx <= last; idx++)
+        if (commandqueue_put(&buses.lines[idx].commands, cmd) != 0)
+            log_error("Command queue of line %s full, command for %s dropped\n", buses.lines[idx].name,
+                      DEVSTR(table, actual->name));
+}
+
+/*
+ * Inbound command parser
+ *
+ * reads {"d":{"<type>":"<name>","<action>":<value>}} in one pass over the payload of
+ * the MQTT message, strings are unescaped and terminated in place, the value may be
+ * a string or a number. Returns NULL or the reason the command is rejected.
+ */
+#define COMMAND_NUMBERSIZE      32
+
+typedef struct commandfields {
+        char            *type;
+        char            *name;
+        char            *action;
+        char            *value;
+        char            number[COMMAND_NUMBERSIZE];     // unquoted value
+} commandfields;
+
+atomic_ulong            commandrejects;
+
+typedef struct jsoncursor {
+        char            *pos;
+        char            *end;
+} jsoncursor;
+
+static inline void json_skipspace( struct jsoncursor *js ) {
+    while (js->pos < js->end && (*js->pos == ' ' || *js->pos == '\t' || *js->pos == '\n' || *js->pos == '\r'))
+        js->pos++;
+}
+
+static inline int json_expect( struct jsoncursor *js, char c ) {
+    json_skipspace(js);
+    if (js->pos == js->end || *js->pos != c)
+        return -1;
+    js->pos++;
+    return 0;
+}
+
+static int json_hex( const char *p ) {
+    int             value = 0;
+    int             idx;
+
+    for (idx = 0; idx < 4; idx++) {
+        value <<= 4;
+        if (p[idx] >= '0' && p[idx] <= '9')         value |= p[idx] - '0';
+        else if (p[idx] >= 'a' && p[idx] <= 'f')    value |= p[idx] - 'a' + 10;
+        else if (p[idx] >= 'A' && p[idx] <= 'F')    value |= p[idx] - 'A' + 10;
+        else return -1;
+    }
+    return value;
+}
+
+/*
+ * String at the cursor, unescaped and terminated in place. The output never gets
+ * longer than the input, the terminator takes the place of the closing quote.
+ */
+static char *json_string( struct jsoncursor *js ) {
+    char            *start;
+    char            *out;
+    int             code;
+    int             low;
+
+    if (json_expect(js, '"') != 0)
+        return NULL;
+    start = out = js->pos;
+    while (js->pos < js->end && *js->pos != '"') {
+        if ((unsigned char)*js->pos < 0x20)
+            return NULL;
+        if (*js->pos != '\\') {
+            *out++ = *js->pos++;
+            continue;
+        }
+        if (++js->pos == js->end)
+            return NULL;
+        switch (*js->pos++) {
+            case '"':   *out++ = '"';   break;
+            case '\\':  *out++ = '\\';  break;
+            case '/':   *out++ = '/';   break;
+            case 'b':   *out++ = '\b';  break;
+            case 'f':   *out++ = '\f';  break;
+            case 'n':   *out++ = '\n';  break;
+            case 'r':   *out++ = '\r';  break;
+            case 't':   *out++ = '\t';  break;
+            case 'u':
+                if (js->end - js->pos < 4 || (code = json_hex(js->pos)) < 0)
+                    return NULL;
+                js->pos += 4;
+                if (code >= 0xd800 && code < 0xdc00) {
+                    // surrogate pair
+                    if (js->end - js->pos < 6 || js->pos[0] != '\\' || js->pos[1] != 'u' ||
+                        (low = json_hex(js->pos + 2)) < 0xdc00 || low >= 0xe000)
+                        return NULL;
+                    js->pos += 6;
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                }
+                if (code == 0)
+                    return NULL;
+                if (code < 0x80) {
+                    *out++ = code;
+                } else if (code < 0x800) {
+                    *out++ = 0xc0 | (code >> 6);
+                    *out++ = 0x80 | (code & 0x3f);
+                } else if (code < 0x10000) {
+                    *out++ = 0xe0 | (code >> 12);
+                    *out++ = 0x80 | ((code >> 6) & 0x3f);
+                    *out++ = 0x80 | (code & 0x3f);
+                } else {
+                    *out++ = 0xf0 | (code >> 18);
+                    *out++ = 0x80 | ((code >> 12) & 0x3f);
+                    *out++ = 0x80 | ((code >> 6) & 0x3f);
+                    *out++ = 0x80 | (code & 0x3f);
+                }
+                break;
+            default:
+                return NULL;
+        }
+    }
+    if (js->pos == js->end)
+        return NULL;
+    js->pos++;
+    *out = '\0';
+    return start;
+}
+
+/*
+ * Number at the cursor, copied to buf as it is
+ */
+static char *json_number( struct jsoncursor *js, char *buf, size_t size ) {
+    char            *start;
+    char            *end;
+    size_t          len;
+
+    json_skipspace(js);
+    start = js->pos;
+    while (js->pos < js->end && (strchr("+-.eE", *js->pos) != NULL || (*js->pos >= '0' && *js->pos <= '9')))
+        js->pos++;
+    len = js->pos - start;
+    if (len == 0 || len >= size)
+        return NULL;
+    memcpy(buf, start, len);
+    buf[len] = '\0';
+    strtod(buf, &end);
+    return (*end == '\0') ? buf : NULL;
+}
+
+static const char *command_parse( char *payload, int len, struct commandfields *fields ) {
+    struct jsoncursor js = { payload, payload + len };
+    char            *key;
+
+    if (json_expect(&js, '{') != 0 || (key = json_string(&js)) == NULL || strcmp(key, "d") != 0 ||
+        json_expect(&js, ':') != 0 || json_expect(&js, '{') != 0)
+        return "no d object";
+    if ((fields->type = json_string(&js)) == NULL || json_expect(&js, ':') != 0 ||
+        (fields->name = json_string(&js)) == NULL)
+        return "no device";
+    if (json_expect(&js, ',') != 0 || (fields->action = json_string(&js)) == NULL || json_expect(&js, ':') != 0)
+        return "no action";
+    json_skipspace(&js);
+    if (js.pos < js.end && *js.pos == '"')
+        fields->value = json_string(&js);
+    else
+        fields->value = json_number(&js, fields->number, sizeof(fields->number));
+    if (fields->value == NULL)
+        return "invalid value";
+    if (json_expect(&js, '}') != 0 || json_expect(&js, '}') != 0)
+        return "command not closed";
+    json_skipspace(&js);
+    if (js.pos != js.end)
+        return "unexpected data after the command";
+    return NULL;
+}
+
+/*
+ * Decimal integer command value, rejects anything but a number within the range.
+ * 64 bit so INT32 takes INT32_MIN..UINT32_MAX where long has 32 bits.
+ */
+static int command_integer( const char *value, long long min, long long max, long long *result ) {
+    char            *end;
+
+    errno = 0;
+    *result = strtoll(value, &end, 10);
+    return (end == value || *end != '\0' || errno != 0 || *result < min || *result > max) ? -1 : 0;
+}
+
+/*
+    Client subscription to messages, for every message received these functions are called
+*/
+
+/*
+ * Allocate the slots of the in-flight window, with keep set they hold a copy of
+ * their message
+ */
+static void window_init( int size, int keep ) {
+    window.slots = calloc(size, sizeof(struct inflight));
+    if (window.slots == NULL) {
+        log_error("Out of memory: %s\n", strerror( errno ));
+        exit( -9 );
+    }
+    window.keep = keep;
+}
+
+/*
+ * Hand the message of a busy slot back for spooling, called with the window locked
+ */
+static void window_return( struct inflight *slot ) {
+    struct unsent   *msg;
+
+    if (!window.keep || slot->message == NULL)
+        return;
+    if ((msg = malloc(sizeof(struct unsent) + slot->topiclen + slot->len)) == NULL) {
+        log_error("Out of memory, unconfirmed message lost: %s\n", strerror( errno ));
+        return;
+    }
+    msg->next = NULL;
+    msg->topiclen = slot->topiclen;
+    msg->len = slot->len;
+    memcpy(msg->data, slot->message, slot->topiclen + slot->len);
+    *window.unsenttail = msg;
+    window.unsenttail = &msg->next;
+    atomic_fetch_add(&window.returned, 1);
+}
+
+/*
+ * Forget all unconfirmed messages, called with the window locked
+ * with a spool they are handed back to be sent again
+ */
+static void window_reset( void ) {
+    int             idx;
+
+    window.inflight = 0;
+    window.free = NULL;
+    for (idx = configuration.maxinflight - 1; idx >= 0; idx--) {
+        if (window.slots[idx].busy)
+            window_return(&window.slots[idx]);
+        window.slots[idx].busy = 0;
+        window.slots[idx].next = window.free;
+        window.free = &window.slots[idx];
+    }
+}
+
+/*
+ * Release one slot of the in-flight window, with failed set its message is handed
+ * back to be spooled again
+ * a slot already released by a window reset is ignored
+ */
+static void window_release( struct inflight *slot, int failed ) {
+    pthread_mutex_lock(&window.lock);
+    if (slot != NULL && slot->busy) {
+        if (failed)
+            window_return(slot);
+        slot->busy = 0;
+        slot->next = window.free;
+        window.free = slot;
+        window.inflight--;
+    }
+    pthread_cond_signal(&window.changed);
+    pthread_mutex_unlock(&window.lock);
+}
+
+/*
+ * Wait for a free slot in the in-flight window and take it for a message
+ * when no completion arrives within the configured timeout the window is assumed lost and reset
+ */
+static struct inflight *window_acquire( const char *topic, const char *payload, int len ) {
+    struct inflight *slot;
+    struct timespec ts;
+    size_t          topiclen = strlen(topic) + 1;
+    char            *message;
+
+    pthread_mutex_lock(&window.lock);
+    while (window.free == NULL) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += configuration.timeout / 1000;
+        ts.tv_nsec += (configuration.timeout % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        if (pthread_cond_timedwait(&window.changed, &window.lock, &ts) == ETIMEDOUT) {
+            log_error("No MQTT delivery confirmation within %ld ms, resetting in-flight window\n", configuration.timeout);
+            window_reset();
+        }
+    }
+    slot = window.free;
+    window.free = slot->next;
+    slot->busy = 1;
+    window.inflight++;
+    // copied under the lock, a reset by the callbacks may return the slot right away
+    if (window.keep) {
+        if (slot->size < topiclen + len && (message = realloc(slot->message, topiclen + len)) != NULL) {
+            slot->message = message;
+            slot->size = topiclen + len;
+        }
+        if (slot->size >= topiclen + len) {
+            memcpy(slot->message, topic, topiclen);
+            memcpy(slot->message + topiclen, payload, len);
+            slot->topiclen = topiclen;
+            slot->len = len;
+        } else {
+            log_error("Out of memory, message will not be spooled again: %s\n", strerror( errno ));
+            free(slot->message);
+            slot->message = NULL;
+            slot->size = 0;
+        }
+    }
+    pthread_mutex_unlock(&window.lock);
+    return slot;
+}
+
+/*
+ * Take the messages handed back by the callbacks, oldest first
+ */
+static struct unsent *window_unsent( void ) {
+    struct unsent   *list;
+
+    if (atomic_load(&window.returned) == 0)
+        return NULL;
+    pthread_mutex_lock(&window.lock);
+    list = window.unsent;
+    window.unsent = NULL;
+    window.unsenttail = &window.unsent;
+    atomic_store(&window.returned, 0);
+    pthread_mutex_unlock(&window.lock);
+    return list;
+}
+
+/*
+ * Whether the client is connected to the broker
+ */
+static int mqtt_connected( void ) {
+    int             connected;
+
+    pthread_mutex_lock(&window.lock);
+    connected = window.connected > 0;
+    pthread_mutex_unlock(&window.lock);
+    return connected;
+}
+
+/*
+ * Wait until all published messages are confirmed or the configured timeout expires
+ */
+static void window_drain( void ) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += configuration.timeout / 1000;
+    pthread_mutex_lock(&window.lock);
+    while (window.inflight > 0)
+        if (pthread_cond_timedwait(&window.changed, &window.lock, &ts) == ETIMEDOUT)
+            break;
+    pthread_mutex_unlock(&window.lock);
+}
+
+/*
+ * MQTT 5 topic aliases
+ *
+ * with MQTTVERSION=5 a topic goes out in full once per connection together with an
+ * alias number, later messages to it carry the alias and an empty topic. The broker
+ * sets the number of aliases in its CONNACK, topics beyond it are always sent in
+ * full. Aliases start over on every (re)connect. Only the publish thread uses the
+ * table, the callbacks change the counters.
+ */
+#define ALIAS_MAX               1024
+
+typedef struct topicalias {
+        char            *topic;             // NULL for a free slot
+        uint16_t        alias;
+} topicalias;
+
+typedef struct aliastable {
+        atomic_uint     connects;           // bumped on every connect
+        atomic_int      maximum;            // topic alias maximum of the broker
+        unsigned int    cleared;            // connects when the table was emptied
+        int             count;
+        struct topicalias entries[ALIAS_MAX * 2];
+} aliastable;
+
+static struct aliastable aliases;
+
+/*
+ * Alias of a topic, 0 when there is none. known is set when the broker already has
+ * the alias on this connection, otherwise the topic has to go with it.
+ */
+static int topic_alias( const char *topic, int *known ) {
+    unsigned int    connects = atomic_load(&aliases.connects);
+    int             maximum = atomic_load(&aliases.maximum);
+    uint32_t        slot;
+    int             idx;
+
+    if (connects != aliases.cleared) {
+        for (idx = 0; idx < ALIAS_MAX * 2; idx++)
+            free(aliases.entries[idx].topic);
+        memset(aliases.entries, 0, sizeof(aliases.entries));
+        aliases.count = 0;
+        aliases.cleared = connects;
+    }
+    slot = name_hash(topic) & (ALIAS_MAX * 2 - 1);
+    while (aliases.entries[slot].topic != NULL) {
+        if (strcmp(aliases.entries[slot].topic, topic) == 0) {
+            *known = 1;
+            return aliases.entries[slot].alias;
+        }
+        slot = (slot + 1) & (ALIAS_MAX * 2 - 1);
+    }
+    if (aliases.count >= maximum || aliases.count >= ALIAS_MAX || (aliases.entries[slot].topic = strdup(topic)) == NULL)
+        return 0;
+    aliases.entries[slot].alias = ++aliases.count;
+    *known = 0;
+    return aliases.count;
+}
+
+/*
+ * Take back the alias just given to a topic, the message that set it was not sent
+ */
+static void topic_unalias( const char *topic ) {
+    uint32_t        slot = name_hash(topic) & (ALIAS_MAX * 2 - 1);
+
+    while (aliases.entries[slot].topic != NULL && strcmp(aliases.entries[slot].topic, topic) != 0)
+        slot = (slot + 1) & (ALIAS_MAX * 2 - 1);
+    if (aliases.entries[slot].topic != NULL) {
+        free(aliases.entries[slot].topic);
+        aliases.entries[slot].topic = NULL;
+        aliases.count--;
+    }
+}
+
+static void delivery_confirmed( struct inflight *slot, MQTTAsync_token token ) {
+  log_trace("Message with token value %d delivery confirmed\n", token);
+  if (bench && slot->busy && slot->received != 0) {
+      latency_record(&benchmark.publish, monotonic_ns() - slot->received);
+      atomic_fetch_add(&benchmark.published, 1);
+  }
+  window_release(slot, 0);
+}
+
+void delivered(void *context, MQTTAsync_successData *response) {
+  delivery_confirmed(context, response->token);
+}
+
+void delivered5(void *context, MQTTAsync_successData5 *response) {
+  delivery_confirmed(context, response->token);
+}
+
+void deliveryfailed(void *context, MQTTAsync_failureData *response) {
+  atomic_fetch_add(&mqttstats.deliveryfailed, 1);
+  log_error("Message with token value %d delivery failed, return code %d\n", response->token, response->code);
+  window_release(context, 1);
+}
+
+void deliveryfailed5(void *context, MQTTAsync_failureData5 *response) {
+  atomic_fetch_add(&mqttstats.deliveryfailed, 1);
+  log_error("Message with token value %d delivery failed, return code %d, reason %d\n", response->token, response->code,
+            response->reasonCode);
+  window_release(context, 1);
+}
+
+int msgarrvd(void *context, char *topicName, int topicLen, MQTTAsync_message *message) {
+   struct          devicetable *table;
+   struct          device *actual;
+   struct command  cmd;
+   struct commandfields fields;
+   const char      *error;
+   int             eis = 0;
+   unsigned char   *p_val = NULL;
+   char            value_byte;
+   unsigned char   value_char;
+   int             value_integer;
+   uint32_t        value_int32;
+   float           value_float;
+   long long       number;
+   char            *end;
+   uint64_t        cpu = bench ? threadcpu_ns() : 0;
+
+   memset(&cmd, 0, sizeof(cmd));
+   cmd.received = bench ? monotonic_ns() : 0;
+	 log_info("Received topic: %s\n", topicName);
+	 log_info("Received message: %.*s\n", message->payloadlen, (char *)message->payload);
+
+   // the payload is parsed in place, it is freed below
+   if ((error = command_parse(message->payload, message->payloadlen, &fields)) != NULL) {
+      log_error("Malformed command rejected: %s, %lu rejected\n", error, atomic_fetch_add(&commandrejects, 1) + 1);
+      goto done;
+   }
+//   log_trace("device type:%s name:%s type:%s value:%s\n", fields.type,fields.name,fields.action,fields.value);
+
+   // the table may be replaced by a reload meanwhile, it stays valid until rcu_read_unlock()
+   rcu_read_lock();
+   table = devicetable_get();
+   actual = device_byname(table, fields.name);
+
+   // STATE answers from the last value cache without touching the bus, * for all devices
+   if (strcmp(fields.action,"STATE") == 0) {
+      if (strcmp(fields.name,"*") == 0)
+          state_request(DEVICE_NONE);
+      else if (actual != NULL)
+          state_request(actual->daddr);
+      actual = NULL;
+   }
+
+   // HISTORY answers from the values kept by the publish thread
+   if (strcmp(fields.action,"HISTORY") == 0) {
+      if (actual != NULL && (error = history_request(actual->daddr, fields.value)) != NULL)
+          log_error("History of %s rejected: %s, %lu rejected\n", fields.name, error, atomic_fetch_add(&commandrejects, 1) + 1);
+      actual = NULL;
+   }
+
+   if (actual != NULL) {
+      cmd.knxaddress = enmx_getaddress(DEVSTR(table, actual->knx));
+      cmd.priority = actual->priority;
+      cmd.attempts = 0;
+
+      if (strcmp(fields.action,"BYTE") == 0) {
+          eis = 1;
+          if (command_integer(fields.value, -128, 255, &number) == 0) { value_byte = number; p_val = (unsigned char *)&value_byte; }
+      } else if (strcmp(fields.action,"INT") == 0) {
+          eis = 10;
+          if (command_integer(fields.value, -32768, 65535, &number) == 0) { value_integer = number; p_val = (unsigned char *)&value_integer; }
+      } else if (strcmp(fields.action,"INT32") == 0) {
+          eis = 11;
+          if (command_integer(fields.value, INT32_MIN, (long long)UINT32_MAX, &number) == 0) { value_int32 = number; p_val = (unsigned char *)&value_int32; }
+      } else if (strcmp(fields.action,"FLOAT") == 0) {
+          eis = 9;
+          value_float = strtof(fields.value, &end);
+          if (end != fields.value && *end == '\0') p_val = (unsigned char *)&value_float;
+      } else if (strcmp(fields.action,"CHAR") == 0) {
+          eis = 13;
+          value_char = fields.value[0];
+          p_val = (unsigned char *)&value_char;
+      } else if (strcmp(fields.action,"STRING") == 0) {
+          eis = 15;
+          p_val = (unsigned char *)fields.value;
+      }
+
+      if (eis == 0) {
+          log_error("Unknown command action %s, %lu rejected\n", fields.action, atomic_fetch_add(&commandrejects, 1) + 1);
+      } else if (p_val == NULL) {
+          log_error("Invalid value %s for %s, %lu rejected\n", fields.value, fields.action, atomic_fetch_add(&commandrejects, 1) + 1);
+      } else if (enmx_EISsizeKNX[eis] > sizeof(cmd.data) || enmx_value2eis( eis, (void *)p_val, cmd.data ) != 0) {
+          log_error("Error in value conversion\n" );
+      } else {
+          cmd.len = (eis != 15) ? enmx_EISsizeKNX[eis] : strnlen( fields.value, enmx_EISsizeKNX[eis] );
+          bus_command(table, actual, &cmd);
+      }
+   }
+   rcu_read_unlock();
+
+done:
+	 MQTTAsync_freeMessage(&message);
+	 MQTTAsync_free(topicName);
+   if (bench)
+       atomic_fetch_add(&benchmark.commandcpu, threadcpu_ns() - cpu);
+	 return 1;
+}
+
+void connlost(void *context, char *cause) {
+   atomic_fetch_add(&mqttstats.connectionlost, 1);
+	 log_info("\nConnection lost\n");
+	 log_info("     cause: %s\n", cause);
+   pthread_mutex_lock(&window.lock);
+   window.connected = 0;
+   pthread_mutex_unlock(&window.lock);
+}
+
+/*
+ * Called on the first connect and on every automatic reconnect
+ * the session is clean so the command subscription has to be renewed
+ */
+void connected(void *context, char *cause) {
+   log_info("Connected to MQTT %s\n", configuration.address);
+   atomic_fetch_add(&mqttstats.connects, 1);
+   atomic_fetch_add(&aliases.connects, 1);
+   MQTTAsync_subscribe(client, subscription, 0, NULL);
+
+   pthread_mutex_lock(&window.lock);
+   window.connected = 1;
+   window_reset();
+   pthread_cond_broadcast(&window.changed);
+   pthread_mutex_unlock(&window.lock);
+
+   // republish what the broker missed while the connection was down
+   state_request(DEVICE_NONE);
+}
+
+void connectfailed(void *context, MQTTAsync_failureData *response) {
+   log_error("Failed to connect to MQTT, return code %d\n", response ? response->code : 0);
+
+   pthread_mutex_lock(&window.lock);
+   window.connected = -1;
+   pthread_cond_broadcast(&window.changed);
+   pthread_mutex_unlock(&window.lock);
+}
+
+/*
+ * MQTT 5 connect outcome, the CONNACK tells how many topic aliases the broker takes
+ */
+void connectsucceeded5(void *context, MQTTAsync_successData5 *response) {
+   int maximum = MQTTProperties_getNumericValue(&response->properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM);
+
+   atomic_store(&aliases.maximum, (maximum > 0) ? maximum : 0);
+   log_info("MQTT 5 session, %d topic aliases\n", (maximum > 0) ? maximum : 0);
+}
+
+void connectfailed5(void *context, MQTTAsync_failureData5 *response) {
+   log_error("Failed to connect to MQTT, return code %d, reason %d\n", response ? response->code : 0,
+             response ? response->reasonCode : 0);
+
+   pthread_mutex_lock(&window.lock);
+   window.connected = -1;
+   pthread_cond_broadcast(&window.changed);
+   pthread_mutex_unlock(&window.lock);
+}
+
+/*
+ * Allocate the telegram ring, the size is rounded up to a power of two
+ */
+static void telegramring_init( struct telegramring *ring, int size ) {
+    uint32_t        slots = 16;
+
+    while (slots < (uint32_t)size)
+        slots *= 2;
+    ring->slots = calloc(slots, sizeof(struct telegram));
+    if (ring->slots == NULL) {
+        log_error("Out of memory: %s\n", strerror( errno ));
+        exit( -9 );
+    }
+    ring->mask = slots - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->overflow, 0);
+}
+
+/*
+ * Producer: slot for the next telegram or NULL when the ring is full
+ */
+static inline struct telegram *telegramring_reserve( struct telegramring *ring ) {
+    uint32_t        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t        tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail > ring->mask)
+        return NULL;
+    return &ring->slots[head & ring->mask];
+}
+
+/*
+ * Wake up the publisher when it is sleeping on empty rings
+ */
+static void publisher_wakeup( void ) {
+    pthread_mutex_lock(&bell.lock);
+    pthread_cond_signal(&bell.wakeup);
+    pthread_mutex_unlock(&bell.lock);
+}
+
+/*
+ * Producer: make the reserved slot visible to the consumer
+ */
+static inline void telegramring_commit( struct telegramring *ring ) {
+    uint32_t        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&bell.waiting, memory_order_relaxed))
+        publisher_wakeup();
+}
+
+/*
+ * Consumer: oldest telegram in the ring or NULL when the ring is empty
+ */
+static inline struct telegram *telegramring_peek( struct telegramring *ring ) {
+    uint32_t        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail)
+        return NULL;
+    return &ring->slots[tail & ring->mask];
+}
+
+/*
+ * Consumer: give the slot returned by telegramring_peek() back to the producer
+ */
+static inline void telegramring_release( struct telegramring *ring ) {
+    uint32_t        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/*
+ * Last value cache
+ *
+ * the last value written to or answered by every group address, with its time and
+ * sender. Entries live in pages of 256 group addresses allocated on first use. The
+ * publish thread is the only writer, the sequence count of an entry is odd while it
+ * is written so other threads can read without a lock.
+ */
+#define LASTVALUE_PAGES         256
+
+typedef struct lastvalue {
+        atomic_uint     seq;
+        uint16_t        source;             // physical address of the sender, as in the frame
+        uint8_t         eis;
+        uint8_t         valid;
+        uint64_t        time;               // wall clock milliseconds
+        struct value    val;
+} lastvalue;
+
+static struct lastvalue *_Atomic lastvalues[LASTVALUE_PAGES];
+
+/*
+ * Store the value of a group telegram, publish thread only
+ */
+static void lastvalue_update( uint16_t daddr, uint16_t saddr, int eis, const struct value *val, const struct timeval *tv ) {
+    uint16_t            grp = ntohs(daddr);
+    struct lastvalue    *page = atomic_load_explicit(&lastvalues[grp >> 8], memory_order_relaxed);
+    struct lastvalue    *entry;
+    unsigned int        seq;
+
+    if (page == NULL) {
+        if ((page = calloc(256, sizeof(struct lastvalue))) == NULL)
+            return;
+        atomic_store_explicit(&lastvalues[grp >> 8], page, memory_order_release);
+    }
+    entry = &page[grp & 0xff];
+    seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+    atomic_store_explicit(&entry->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    entry->source = saddr;
+    entry->eis = eis;
+    entry->valid = 1;
+    entry->time = (uint64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000;
+    entry->val = *val;
+    atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+}
+
+/*
+ * Copy the cached value of a group address (network byte order), 0 when nothing
+ * was seen on it
+ */
+static int lastvalue_get( uint16_t daddr, struct lastvalue *copy ) {
+    uint16_t            grp = ntohs(daddr);
+    struct lastvalue    *page = atomic_load_explicit(&lastvalues[grp >> 8], memory_order_acquire);
+    struct lastvalue    *entry;
+    unsigned int        seq;
+
+    if (page == NULL)
+        return 0;
+    entry = &page[grp & 0xff];
+    do {
+        while ((seq = atomic_load_explicit(&entry->seq, memory_order_acquire)) & 1)
+            ;
+        copy->source = entry->source;
+        copy->eis = entry->eis;
+        copy->valid = entry->valid;
+        copy->time = entry->time;
+        copy->val = entry->val;
+        atomic_thread_fence(memory_order_acquire);
+    } while (atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq);
+    return copy->valid;
+}
+
+/*
+ * State requests
+ *
+ * the STATE command and a reconnect ask the publish thread to publish cached values,
+ * so MQTT callbacks never wait for the in-flight window.
+ */
+#define STATE_MAXREQUESTS       64
+
+typedef struct statequeue {
+        atomic_int      pending;
+        int             all;
+        int             count;
+        int32_t         devices[STATE_MAXREQUESTS];     // group addresses, the table may change meanwhile
+        pthread_mutex_t lock;
+} statequeue;
+
+struct statequeue       staterequests = { 0, 0, 0, { 0 }, PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Ask for the cached value of the device on group address daddr, DEVICE_NONE for all devices
+ */
+static void state_request( int32_t daddr ) {
+    pthread_mutex_lock(&staterequests.lock);
+    if (daddr == DEVICE_NONE || staterequests.count == STATE_MAXREQUESTS)
+        staterequests.all = 1;
+    else
+        staterequests.devices[staterequests.count++] = daddr;
+    atomic_store(&staterequests.pending, 1);
+    pthread_mutex_unlock(&staterequests.lock);
+    publisher_wakeup();
+}
+
+/*
+ * History queries
+ *
+ * HISTORY commands are answered by the publish thread which owns the histories,
+ * see history_request()
+ */
+#define HISTORY_MAXREQUESTS     16
+
+typedef struct historyrequest {
+        int32_t         daddr;
+        uint64_t        from;               // wall clock ms, inclusive
+        uint64_t        to;
+        uint64_t        step;               // rollup interval in ms, 0 for the values
+} historyrequest;
+
+typedef struct historyqueue {
+        atomic_int      pending;
+        int             count;
+        struct historyrequest requests[HISTORY_MAXREQUESTS];
+        pthread_mutex_t lock;
+} historyqueue;
+
+struct historyqueue     historyrequests = { 0, 0, { { 0 } }, PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Consumer: sleep until a receive thread commits a telegram or ms milliseconds passed
+ */
+static void publisher_wait( long ms ) {
+    struct telegramring *ring;
+    struct timespec     ts;
+    int                 idx;
+    int                 empty = 1;
+
+    pthread_mutex_lock(&bell.lock);
+    atomic_store(&bell.waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    for (idx = 0; idx < buses.count && empty; idx++) {
+        ring = &buses.lines[idx].ring;
+        empty = atomic_load(&ring->head) == atomic_load(&ring->tail);
+    }
+    if (empty && ! atomic_load(&receiver_done) && ! atomic_load(&staterequests.pending)
+            && ! atomic_load(&historyrequests.pending)) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += ms / 1000;
+        ts.tv_nsec += (ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&bell.wakeup, &bell.lock, &ts);
+    }
+    atomic_store(&bell.waiting, 0);
+    pthread_mutex_unlock(&bell.lock);
+}
+
+/*
+ * Payload serialization
+ *
+ * the payload is {"d":{"value":"<value>","date":"<date>","time":"<time>"}}, the part
+ * after the value only changes once a second and is kept ready in a time cache.
+ */
+#define PAYLOAD_PREFIX          "{\"d\":{\"value\":\""
+#define PAYLOAD_PUT(p, lit)     (memcpy((p), (lit), sizeof(lit) - 1), (p) + sizeof(lit) - 1)
+
+typedef struct timecache {
+        time_t          sec;                // second the cache was built for, -1 when empty
+        struct tm       tm;
+        char            suffix[64];         // ","date":"yyyy/mm/dd","time":"hh:mm:ss"}}
+        int             suffixlen;
+} timecache;
+
+/*
+ * Write n as two digits
+ */
+static inline char *put_2digits( char *p, int n ) {
+    p[0] = '0' + n / 10;
+    p[1] = '0' + n % 10;
+    return p + 2;
+}
+
+/*
+ * Refresh the cache when the second changed, returns the broken down time
+ */
+static const struct tm *timecache_get( struct timecache *cache, time_t sec ) {
+    char            *p;
+
+    if (sec == cache->sec)
+        return &cache->tm;
+    localtime_r(&sec, &cache->tm);
+    cache->sec = sec;
+    p = PAYLOAD_PUT(cache->suffix, "\",\"date\":\"");
+    p = put_2digits(p, (cache->tm.tm_year + 1900) / 100);
+    p = put_2digits(p, (cache->tm.tm_year + 1900) % 100);
+    *p++ = '/';
+    p = put_2digits(p, cache->tm.tm_mon + 1);
+    *p++ = '/';
+    p = put_2digits(p, cache->tm.tm_mday);
+    p = PAYLOAD_PUT(p, "\",\"time\":\"");
+    p = put_2digits(p, cache->tm.tm_hour);
+    *p++ = ':';
+    p = put_2digits(p, cache->tm.tm_min);
+    *p++ = ':';
+    p = put_2digits(p, cache->tm.tm_sec);
+    p = PAYLOAD_PUT(p, "\"}}");
+    cache->suffixlen = p - cache->suffix;
+    return &cache->tm;
+}
+
+/*
+ * Numeric value for the deadband comparison
+ */
+static double value_number( const struct value *val ) {
+    if (val->type == VALUE_SINT)
+        return (double)(int32_t)val->v.i;
+    return (val->type == VALUE_FLOAT) ? val->v.f : (double)val->v.i;
+}
+
+static uint64_t heartbeatscan;                  // monotonic ns of the next device_heartbeats() scan
+
+/*
+ * Whether a value differs enough from the last published one
+ */
+static int device_changed( const struct device *dev, const struct devicestate *state, const struct value *val ) {
+    double          change;
+    double          band;
+
+    if (dev->filter.flags & FILTER_COV) {
+        if (val->type != state->last.type)
+            return 1;
+        if (val->type == VALUE_STRING)
+            return strcmp(val->v.s, state->last.v.s) != 0;
+        change = fabs(value_number(val) - value_number(&state->last));
+        band = dev->filter.deadband;
+        if (dev->filter.flags & FILTER_PERCENT)
+            band = fabs(value_number(&state->last)) * band / 100.0;
+        return (band > 0.0) ? change >= band : change != 0.0;
+    }
+    return 1;
+}
+
+/*
+ * Decide whether a new value of a device is published, only the publish thread
+ * uses the device state. A value held back by minint is published by
+ * device_heartbeats() when the interval expires, unless a later one undoes it.
+ */
+static int device_filter( const struct device *dev, struct devicestate *state, const struct value *val, uint64_t now ) {
+    uint64_t        elapsed = (now - state->published) / 1000000;
+    uint64_t        due;
+
+    state->latest = *val;
+    if (state->published == 0)
+        return 1;
+    if (dev->filter.heartbeat > 0 && elapsed >= dev->filter.heartbeat)
+        return 1;
+    if (dev->filter.minint > 0 && elapsed < dev->filter.minint) {
+        state->pending = device_changed(dev, state, val);
+        due = state->published + (uint64_t)dev->filter.minint * 1000000;
+        if (state->pending && due < heartbeatscan)
+            heartbeatscan = due;
+        return 0;
+    }
+    return device_changed(dev, state, val);
+}
+
+/*
+ * Send one message and account for it in the in-flight window
+ */
+static int publish_send( const char *topic, char *payload, int len, uint64_t received ) {
+    MQTTAsync_message       pubmsg = MQTTAsync_message_initializer;
+    MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+    MQTTProperty            property;
+    struct inflight         *slot;
+    const char              *sent = topic;
+    int                     alias = 0;
+    int                     known = 0;
+    int                     rc;
+
+    log_trace("Published topic: %s\n", topic);
+    if (configuration.format == FORMAT_JSON)
+        log_trace("Published payload: %.*s\n", len, payload);
+    pubmsg.payload = payload;
+    pubmsg.payloadlen = len;
+    pubmsg.qos = configuration.qos;
+    pubmsg.retained = 0;
+
+    if (configuration.mqttversion == MQTTVERSION_5) {
+        opts.onSuccess5 = delivered5;
+        opts.onFailure5 = deliveryfailed5;
+        if ((alias = topic_alias(topic, &known)) > 0) {
+            property.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+            property.value.integer2 = alias;
+            MQTTProperties_add(&pubmsg.properties, &property);
+            if (known)
+                sent = "";
+        }
+    } else {
+        opts.onSuccess = delivered;
+        opts.onFailure = deliveryfailed;
+    }
+    opts.context = slot = window_acquire(topic, payload, len);
+    slot->received = received;
+    metric_add(&publishstats.attempted, 1);
+    rc = MQTTAsync_sendMessage(client, sent, &pubmsg, &opts);
+    MQTTProperties_free(&pubmsg.properties);
+    if (rc != MQTTASYNC_SUCCESS) {
+        metric_add(&publishstats.refused, 1);
+        log_error("Published to MQTT, return code %d\n", rc);
+        if (alias > 0 && ! known)
+            topic_unalias(topic);
+        window_release(slot, 0);
+    } else {
+        metric_add(&publishstats.bytes, strlen(sent) + len);
+        if (known)
+            metric_add(&publishstats.aliased, 1);
+    }
+    return rc;
+}
+
+/*
+ * Store-and-forward spool
+ *
+ * while the broker can not be reached messages are appended to segments on disk,
+ * later messages are spooled too until the spool is empty so the order is kept.
+ * Only the segment being written and the one being sent are mapped, the total size
+ * on disk is bounded by SPOOLSIZE: the oldest segment is dropped when it is full.
+ * Only used by the publish thread.
+ */
+#define SPOOL_SEGMENT           (1024 * 1024)
+#define SPOOL_MAXSIZE           (64 * 1024 * 1024)
+#define SPOOL_RATE              100             // messages per second when draining
+#define SPOOL_BURST             64              // most messages sent per publisher loop
+
+typedef struct spoolqueue {
+        char            *dir;               // NULL when spooling is off
+        size_t          segsize;
+        size_t          maxsize;
+        int             rate;               // 0 unlimited
+        uint64_t        first;              // oldest segment on disk
+        uint64_t        next;               // sequence of the next segment to create
+        int             segments;           // segments on disk
+        unsigned long   pending;            // records not yet sent
+        unsigned long   dropped;
+        unsigned long   reported;
+        unsigned char   *wmap;              // segment being written, sequence next - 1
+        size_t          wpos;
+        unsigned char   *rmap;              // segment being sent, sequence first
+        size_t          rpos;
+        double          tokens;
+        uint64_t        refilled;
+} spoolqueue;
+
+static struct spoolqueue spool;
+
+static void spool_path( uint64_t seq, char *path, size_t size ) {
+    snprintf(path, size, "%s/spool-%016llx.seg", spool.dir, (unsigned long long)seq);
+}
+
+/*
+ * Map a segment, NULL when it does not exist or is not a spool segment
+ */
+static unsigned char *spool_map( uint64_t seq, int create ) {
+    char                path[1200];
+    struct spoolheader  *hdr;
+    unsigned char       *map;
+    struct stat         st;
+    int                 fd;
+
+    spool_path(seq, path, sizeof(path));
+    if ((fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644)) < 0)
+        return NULL;
+    if (create && ftruncate(fd, spool.segsize) != 0) {
+        close(fd);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size != (off_t)spool.segsize) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, spool.segsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    hdr = (struct spoolheader *)map;
+    if (create) {
+        memcpy(hdr->magic, SPOOL_MAGIC, 8);
+        hdr->version = SPOOL_VERSION;
+        hdr->headersize = SPOOL_ALIGN(sizeof(struct spoolheader));
+        hdr->sequence = seq;
+        hdr->readpos = hdr->headersize;
+    } else if (memcmp(hdr->magic, SPOOL_MAGIC, 8) != 0 || hdr->version != SPOOL_VERSION) {
+        munmap(map, spool.segsize);
+        return NULL;
+    }
+    return map;
+}
+
+/*
+ * Record at pos, NULL at the end of the segment
+ */
+static struct spoolrecord *spool_record( unsigned char *map, size_t pos ) {
+    struct spoolrecord  *rec;
+
+    if (pos + sizeof(struct spoolrecord) > spool.segsize)
+        return NULL;
+    rec = (struct spoolrecord *)(map + pos);
+    if (rec->length == 0 || pos + rec->length > spool.segsize)
+        return NULL;
+    return rec;
+}
+
+/*
+ * Remove the oldest segment, counting what was not sent as dropped when asked to
+ */
+static void spool_remove( int dropping ) {
+    char                path[1200];
+    unsigned char       *map;
+    size_t              pos;
+    struct spoolrecord  *rec;
+    unsigned long       left = 0;
+
+    if (spool.rmap != NULL)
+        map = spool.rmap;
+    else if (spool.wmap != NULL && spool.first == spool.next - 1)
+        map = spool.wmap;
+    else
+        map = spool_map(spool.first, 0);
+    if (map != NULL) {
+        pos = (map == spool.rmap) ? spool.rpos : ((struct spoolheader *)map)->readpos;
+        while ((rec = spool_record(map, pos)) != NULL) {
+            left++;
+            pos += rec->length;
+        }
+        munmap(map, spool.segsize);
+    }
+    if (map == spool.wmap)
+        spool.wmap = NULL;
+    spool.rmap = NULL;
+    spool_path(spool.first, path, sizeof(path));
+    unlink(path);
+    spool.first++;
+    spool.segments--;
+    spool.pending -= (left < spool.pending) ? left : spool.pending;
+    if (dropping)
+        spool.dropped += left;
+}
+
+/*
+ * Find the segments left by an earlier run, sending continues where it stopped
+ */
+static void spool_open( void ) {
+    DIR                 *dir;
+    struct dirent       *entry;
+    unsigned long long  seq;
+    uint64_t            seq_min = UINT64_MAX;
+    uint64_t            seq_max = 0;
+    unsigned char       *map;
+    struct spoolrecord  *rec;
+    size_t              pos;
+    unsigned long       left;
+
+    if (mkdir(spool.dir, 0755) != 0 && errno != EEXIST) {
+        log_error("Can not create spool directory %s: %s\n", spool.dir, strerror( errno ));
+        spool.dir = NULL;
+        return;
+    }
+    if ((dir = opendir(spool.dir)) == NULL) {
+        log_error("Can not open spool directory %s: %s\n", spool.dir, strerror( errno ));
+        spool.dir = NULL;
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "spool-%16llx.seg", &seq) != 1)
+            continue;
+        if (seq < seq_min)
+            seq_min = seq;
+        if (seq > seq_max)
+            seq_max = seq;
+    }
+    closedir(dir);
+
+    spool.first = spool.next = seq_max + 1;
+    if (seq_min != UINT64_MAX) {
+        spool.first = seq_min;
+        spool.segments = seq_max - seq_min + 1;
+        for (seq = seq_min; seq <= seq_max; seq++) {
+            left = 0;
+            if ((map = spool_map(seq, 0)) != NULL) {
+                pos = ((struct spoolheader *)map)->readpos;
+                while ((rec = spool_record(map, pos)) != NULL) {
+                    left++;
+                    pos += rec->length;
+                }
+                munmap(map, spool.segsize);
+            }
+            // segments sent completely before the stop go right away
+            if (left == 0 && seq == spool.first)
+                spool_remove(0);
+            spool.pending += left;
+        }
+        if (spool.pending > 0)
+            log_info("Spool %s holds %lu unsent messages\n", spool.dir, spool.pending);
+    }
+    spool.refilled = monotonic_ns();
+}
+
+/*
+ * Append a message, the oldest segment is dropped when the spool is full
+ */
+static void spool_append( const char *topic, const char *payload, int len ) {
+    struct spoolrecord  *rec;
+    size_t              topiclen = strlen(topic) + 1;
+    size_t              need = SPOOL_ALIGN(sizeof(struct spoolrecord) + topiclen + len);
+
+    if (need + SPOOL_ALIGN(sizeof(struct spoolheader)) + sizeof(uint32_t) > spool.segsize) {
+        spool.dropped++;
+        return;
+    }
+    if (spool.wmap == NULL || spool.wpos + need + sizeof(uint32_t) > spool.segsize) {
+        if (spool.wmap != NULL && spool.wmap != spool.rmap)
+            munmap(spool.wmap, spool.segsize);
+        spool.wmap = NULL;
+        while (spool.segments > 0 && (size_t)(spool.segments + 1) * spool.segsize > spool.maxsize)
+            spool_remove(1);
+        if ((spool.wmap = spool_map(spool.next, 1)) == NULL) {
+            log_error("Can not create spool segment in %s: %s\n", spool.dir, strerror( errno ));
+            spool.dropped++;
+            return;
+        }
+        if (spool.segments == 0)
+            spool.first = spool.next;
+        spool.next++;
+        spool.segments++;
+        spool.wpos = ((struct spoolheader *)spool.wmap)->headersize;
+    }
+    rec = (struct spoolrecord *)(spool.wmap + spool.wpos);
+    rec->topiclen = topiclen;
+    rec->payloadlen = len;
+    rec->queued = (uint64_t)time(NULL) * 1000;
+    memcpy(rec->data, topic, topiclen);
+    memcpy(rec->data + topiclen, payload, len);
+    atomic_thread_fence(memory_order_release);
+    rec->length = need;
+    spool.wpos += need;
+    spool.pending++;
+}
+
+/*
+ * Oldest unsent record, finished segments are removed on the way
+ */
+static struct spoolrecord *spool_peek( void ) {
+    struct spoolrecord  *rec;
+
+    while (spool.pending > 0 && spool.segments > 0) {
+        if (spool.rmap == NULL) {
+            if (spool.wmap != NULL && spool.first == spool.next - 1)
+                spool.rmap = spool.wmap;
+            else if ((spool.rmap = spool_map(spool.first, 0)) == NULL) {
+                spool_remove(1);
+                continue;
+            }
+            spool.rpos = ((struct spoolheader *)spool.rmap)->readpos;
+        }
+        if ((rec = spool_record(spool.rmap, spool.rpos)) != NULL)
+            return rec;
+        if (spool.rmap == spool.wmap)
+            return NULL;                // caught up with the writer
+        spool_remove(0);
+    }
+    return NULL;
+}
+
+/*
+ * Mark the record returned by spool_peek() as sent
+ */
+static void spool_consume( struct spoolrecord *rec ) {
+    spool.rpos += rec->length;
+    ((struct spoolheader *)spool.rmap)->readpos = spool.rpos;
+    spool.pending--;
+}
+
+/*
+ * Spool the messages that failed or were unconfirmed when the broker went away
+ */
+static void spool_unsent( void ) {
+    struct unsent   *msg;
+    struct unsent   *next;
+    unsigned long   count = 0;
+
+    for (msg = window_unsent(); msg != NULL; msg = next) {
+        next = msg->next;
+        spool_append(msg->data, msg->data + msg->topiclen, msg->len);
+        free(msg);
+        count++;
+    }
+    if (count > 0) {
+        metric_add(&publishstats.spooled, count);
+        log_info("%lu unconfirmed messages spooled again\n", count);
+    }
+}
+
+/*
+ * Send spooled messages at the configured rate, returns the milliseconds until
+ * more can be sent
+ */
+static long spool_drain( uint64_t now ) {
+    struct spoolrecord  *rec;
+    int                 sent = 0;
+
+    if (spool.dropped != spool.reported) {
+        log_error("Spool full, %lu messages dropped\n", spool.dropped - spool.reported);
+        spool.reported = spool.dropped;
+    }
+    if (spool.pending == 0 || !mqtt_connected())
+        return 100;
+    if (spool.rate > 0) {
+        spool.tokens += (now - spool.refilled) / 1e9 * spool.rate;
+        if (spool.tokens > spool.rate)
+            spool.tokens = spool.rate;
+    }
+    spool.refilled = now;
+    while (sent < SPOOL_BURST && (spool.rate == 0 || spool.tokens >= 1.0) && (rec = spool_peek()) != NULL) {
+        metric_add(&publishstats.retried, 1);
+        if (publish_send(rec->data, rec->data + rec->topiclen, rec->payloadlen, 0) != MQTTASYNC_SUCCESS)
+            break;
+        spool_consume(rec);
+        spool.tokens -= 1.0;
+        sent++;
+    }
+    if (spool.pending == 0)
+        log_info("Spool drained\n");
+    return (spool.pending == 0) ? 100 : (spool.rate > 0 ? 1000 / spool.rate + 1 : 1);
+}
+
+/*
+ * Unmap the segments, what was not sent stays on disk for the next start
+ */
+static void spool_close( void ) {
+    if (spool.rmap != NULL && spool.rmap != spool.wmap)
+        munmap(spool.rmap, spool.segsize);
+    if (spool.wmap != NULL)
+        munmap(spool.wmap, spool.segsize);
+    spool.rmap = spool.wmap = NULL;
+}
+
+/*
+ * Publish a message, or spool it while the broker is away or older messages wait
+ */
+static void publish_message( const char *topic, char *payload, int len, uint64_t received ) {
+    if (spool.dir != NULL && (spool.pending > 0 || !mqtt_connected())) {
+        metric_add(&publishstats.spooled, 1);
+        spool_append(topic, payload, len);
+        return;
+    }
+    if (publish_send(topic, payload, len, received) != MQTTASYNC_SUCCESS && spool.dir != NULL) {
+        metric_add(&publishstats.spooled, 1);
+        spool_append(topic, payload, len);
+    }
+}
+
+/*
+ * Batched publishing
+ *
+ * with BATCH set, values are collected in one {"d":[entry,...]} message on the
+ * gateway topic which is sent when BATCH values are collected, the buffer is full
+ * or BATCHWINDOW milliseconds passed since the first value. Only used by the
+ * publish thread.
+ */
+#define BATCH_BUFSIZE           (64 * 1024)
+#define BATCH_WINDOW            100
+
+typedef struct publishbatch {
+        char            *buf;
+        size_t          len;
+        int             count;
+        uint64_t        first;              // monotonic ns the oldest value was received
+        uint64_t        opened;             // monotonic ns the first value was added
+} publishbatch;
+
+static struct publishbatch batch;
+static struct timecache publishtime = { -1 };   // only used by the publish thread
+static struct devicetable *pubtable;            // device table of the publish thread, see devicetable_adopt()
+
+/*
+ * Gateway event topic derived from a g:org:type:id client id
+ */
+static void gateway_topic( const char *event, int format, char *topic, size_t size ) {
+    char            gwtype[255];
+    char            gwid[255];
+
+    if (sscanf(configuration.clientid, "g:%*[^:]:%254[^:]:%254s", gwtype, gwid) == 2)
+        snprintf(topic, size, "iot-2/type/%s/id/%s/evt/%s/fmt/%s", gwtype, gwid, event, payloadformats[format]);
+    else
+        snprintf(topic, size, "iot-2/evt/%s/fmt/%s", event, payloadformats[format]);
+}
+
+/*
+ * Allocate the batch buffer, the gateway topic is the default batch topic
+ */
+static void batch_init( void ) {
+    if ((batch.buf = malloc(BATCH_BUFSIZE)) == NULL) {
+        log_error("Out of memory: %s\n", strerror( errno ));
+        exit( -9 );
+    }
+    if (configuration.batchwindow <= 0)
+        configuration.batchwindow = BATCH_WINDOW;
+    if (configuration.batchtopic[0] == '\0')
+        gateway_topic("batch", configuration.format, configuration.batchtopic, sizeof(configuration.batchtopic));
+    log_trace("batch of %d values or %ld ms on %s\n", configuration.batch, configuration.batchwindow, configuration.batchtopic);
+}
+
+/*
+ * Send the collected values as one message
+ */
+static void batch_flush( void ) {
+    if (batch.count == 0)
+        return;
+    if (configuration.format == FORMAT_CBOR) {
+        batch.buf[batch.len++] = (char)CBOR_BREAK;
+    } else {
+        memcpy(batch.buf + batch.len, "]}", 2);
+        batch.len += 2;
+    }
+    publish_message(configuration.batchtopic, batch.buf, batch.len, batch.first);
+    batch.len = 0;
+    batch.count = 0;
+}
+
+/*
+ * Add a formatted value to the batch, the date and time come from publishtime.
+ * A CBOR batch is an array of indefinite length, an entry ends with the time.
+ */
+static void batch_add( struct device *actual, const char *value, int len, uint64_t time, uint64_t received ) {
+    const char      *entry = DEVSTR(pubtable, actual->entry);
+    size_t          entrylen = strlen(entry);
+    size_t          need = entrylen + len + publishtime.suffixlen + 16;
+    unsigned char   *p;
+
+    if (batch.count > 0 && batch.len + need > BATCH_BUFSIZE)
+        batch_flush();
+    if (batch.count == 0) {
+        if (configuration.format == FORMAT_CBOR) {
+            p = CBOR_KEY(cbor_head((unsigned char *)batch.buf, CBOR_MAP, 1), "d");
+            *p++ = CBOR_ARRAY | CBOR_INDEFINITE;
+            batch.len = (char *)p - batch.buf;
+        } else {
+            batch.len = PAYLOAD_PUT(batch.buf, "{\"d\":[") - batch.buf;
+        }
+        batch.first = received;
+        batch.opened = monotonic_ns();
+    } else if (configuration.format != FORMAT_CBOR) {
+        batch.buf[batch.len++] = ',';
+    }
+    memcpy(batch.buf + batch.len, entry, entrylen);
+    batch.len += entrylen;
+    memcpy(batch.buf + batch.len, value, len);
+    batch.len += len;
+    if (configuration.format == FORMAT_CBOR) {
+        p = cbor_head(CBOR_KEY((unsigned char *)batch.buf + batch.len, "time"), CBOR_UINT, time);
+        batch.len = (char *)p - batch.buf;
+    } else {
+        // the cached suffix ends in "}}", an entry only closes one object
+        memcpy(batch.buf + batch.len, publishtime.suffix, publishtime.suffixlen - 1);
+        batch.len += publishtime.suffixlen - 1;
+    }
+    if (++batch.count >= configuration.batch)
+        batch_flush();
+}
+
+/*
+ * Milliseconds until the batch window closes, flushes the batch when it did
+ */
+static long batch_due( uint64_t now ) {
+    uint64_t        window = configuration.batchwindow * 1000000ULL;
+
+    if (batch.count == 0)
+        return 100;
+    if (now < batch.opened)
+        return configuration.batchwindow;
+    if (now - batch.opened < window)
+        return (window - (now - batch.opened)) / 1000000 + 1;
+    batch_flush();
+    return 100;
+}
+
+/*
+ * Format the payload of a device value and publish it, time is the wall clock in ms
+ */
+static void publish_value( struct device *actual, struct devicestate *state, const struct value *val, uint64_t time, uint64_t received ) {
+    char                    payload[1024];
+    char                    *p;
+    char                    buffer[255];
+    unsigned char           *q;
+    int                     len;
+
+    state->last = *val;
+    state->published = received;
+    state->pending = 0;
+    if (configuration.format == FORMAT_CBOR) {
+        len = (char *)cbor_value((unsigned char *)buffer, val) - buffer;
+        if (configuration.batch > 0) {
+            batch_add( actual, buffer, len, time, received );
+            return;
+        }
+        q = CBOR_KEY(cbor_head((unsigned char *)payload, CBOR_MAP, 1), "d");
+        q = CBOR_KEY(cbor_head(q, CBOR_MAP, 2), "value");
+        memcpy(q, buffer, len);
+        q = cbor_head(CBOR_KEY(q + len, "time"), CBOR_UINT, time);
+        publish_message(DEVSTR(pubtable, actual->topic), payload, (char *)q - payload, received);
+        return;
+    }
+    timecache_get( &publishtime, time / 1000 );
+    len = value_json( val, buffer, sizeof(buffer) );
+    if (len >= (int)sizeof(buffer))
+        len = sizeof(buffer) - 1;
+    if (configuration.batch > 0) {
+        batch_add( actual, buffer, len, time, received );
+        return;
+    }
+
+    p = PAYLOAD_PUT(payload, PAYLOAD_PREFIX);
+    memcpy(p, buffer, len);
+    p += len;
+    memcpy(p, publishtime.suffix, publishtime.suffixlen);
+    p += publishtime.suffixlen;
+    *p = '\0';
+    // #define PAYLOAD     "{\"d\":{\"value\":\"42.00\",\"date\":\"2016-07-19\",\"time\":\"15:55:29\"}}"
+    publish_message(DEVSTR(pubtable, actual->topic), payload, p - payload, received);
+}
+
+/*
+ * Republish the latest value of devices that were silent for their heartbeat
+ * interval and publish values held back by minint once it expired, checked once
+ * a second or when the first held back value is due
+ */
+static void device_heartbeats( uint64_t now ) {
+    struct devicetable      *table = pubtable;
+    struct devicestate      *state;
+    struct device           *dev;
+    struct timeval          tv;
+    uint64_t                elapsed;
+    uint64_t                due;
+    int                     idx;
+
+    if (now < heartbeatscan || table->heartbeatcount == 0)
+        return;
+    heartbeatscan = now + 1000000000ULL;
+    gettimeofday(&tv, NULL);
+    for (idx = 0; idx < table->heartbeatcount; idx++) {
+        dev = &table->devices[table->heartbeats[idx]];
+        state = &table->state[table->heartbeats[idx]];
+        if (state->published == 0)
+            continue;
+        elapsed = (now - state->published) / 1000000;
+        if ((state->pending && elapsed >= dev->filter.minint) ||
+            (dev->filter.heartbeat > 0 && elapsed >= dev->filter.heartbeat)) {
+            publish_value(dev, state, &state->latest, (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000, now);
+        } else if (state->pending) {
+            due = state->published + (uint64_t)dev->filter.minint * 1000000;
+            if (due < heartbeatscan)
+                heartbeatscan = due;
+        }
+    }
+}
+
+/*
+ * Group reads
+ *
+ * devices with poll=seconds are read periodically by the publish thread. Due times
+ * are kept in a hierarchical timer wheel, three levels of 64 slots with a tick of
+ * 100 ms: the levels cover 6.4 seconds, 6.8 minutes and 7.3 hours, longer intervals
+ * go round the last level again. Adding, firing and moving a device down a level
+ * take constant time however many devices poll. The first read of a device falls at
+ * a random point of its interval and every interval is stretched by up to 1/16 at
+ * random, so reads never line up on the bus. A device that reported within its
+ * interval is not read, its next read is one interval after the report. Reads go
+ * through the command queue of the line and are paced with the writes.
+ */
+#define POLL_TICK               100000000ULL    // ns
+#define POLL_LEVELS             3
+#define POLL_SLOTBITS           6
+#define POLL_SLOTS              (1 << POLL_SLOTBITS)
+
+typedef struct pollwheel {
+        int32_t         slots[POLL_LEVELS][POLL_SLOTS];     // first device of the slot or DEVICE_NONE
+        uint64_t        tick;               // last tick done
+        uint64_t        start;              // monotonic ns of tick 0
+        uint32_t        seed;
+        int             count;              // devices that poll
+} pollwheel;
+
+static struct pollwheel polls;              // only used by the publish thread
+
+static inline uint32_t poll_random( uint32_t range ) {
+    polls.seed = polls.seed * 1103515245 + 12345;
+    return range ? (polls.seed >> 8) % range : 0;
+}
+
+/*
+ * Put a device in the slot of its due tick, on the lowest level whose block holds it
+ */
+static void poll_insert( struct devicetable *table, int32_t idx, uint64_t due ) {
+    struct devicestate      *state = &table->state[idx];
+    uint64_t                place = due;
+    int                     level;
+    int                     slot;
+
+    state->polldue = due;
+    for (level = 0; level < POLL_LEVELS - 1; level++)
+        if ((due >> (POLL_SLOTBITS * (level + 1))) == (polls.tick >> (POLL_SLOTBITS * (level + 1))))
+            break;
+    // beyond the wheel: the last slot of the top level before it comes round again
+    if (level == POLL_LEVELS - 1 && (due >> (POLL_SLOTBITS * POLL_LEVELS)) != (polls.tick >> (POLL_SLOTBITS * POLL_LEVELS)))
+        place = ((polls.tick >> (POLL_SLOTBITS * level)) - 1) << (POLL_SLOTBITS * level);
+    slot = (place >> (POLL_SLOTBITS * level)) & (POLL_SLOTS - 1);
+    state->pollnext = polls.slots[level][slot];
+    polls.slots[level][slot] = idx;
+}
+
+/*
+ * Read a due device unless it reported within its interval, and schedule it again
+ */
+static void poll_device( struct devicetable *table, int32_t idx, uint64_t now ) {
+    struct device           *dev = &table->devices[idx];
+    struct devicestate      *state = &table->state[idx];
+    uint64_t                interval = (uint64_t)dev->poll * 1000000;
+    uint64_t                due = polls.tick + interval / POLL_TICK;
+    struct command          cmd;
+
+    if (state->seen != 0 && now - state->seen < interval) {
+        metric_add(&publishstats.pollsskipped, 1);
+        due = (state->seen + interval - polls.start) / POLL_TICK;
+    } else {
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.knxaddress = ntohs(dev->daddr);
+        cmd.priority = dev->priority;
+        cmd.read = 1;
+        cmd.received = bench ? now : 0;
+        bus_command(table, dev, &cmd);
+        metric_add(&publishstats.polls, 1);
+    }
+    due += poll_random(interval / POLL_TICK / 16 + 1);
+    poll_insert(table, idx, due > polls.tick ? due : polls.tick + 1);
+}
+
+/*
+ * Move the devices of a slot of a higher level down or read them
+ */
+static void poll_slot( struct devicetable *table, int level, int slot, uint64_t now ) {
+    int32_t                 idx = polls.slots[level][slot];
+    int32_t                 next;
+
+    polls.slots[level][slot] = DEVICE_NONE;
+    for (; idx != DEVICE_NONE; idx = next) {
+        next = table->state[idx].pollnext;
+        if (table->state[idx].polldue <= polls.tick)
+            poll_device(table, idx, now);
+        else
+            poll_insert(table, idx, table->state[idx].polldue);
+    }
+}
+
+/*
+ * Run the wheel up to now, returns the milliseconds until the next tick
+ */
+static long poll_advance( uint64_t now ) {
+    uint64_t                target = (now - polls.start) / POLL_TICK;
+    int                     level;
+
+    while (polls.tick < target) {
+        polls.tick++;
+        for (level = POLL_LEVELS - 1; level > 0; level--)
+            if ((polls.tick & ((1ULL << (POLL_SLOTBITS * level)) - 1)) == 0)
+                poll_slot(pubtable, level, (polls.tick >> (POLL_SLOTBITS * level)) & (POLL_SLOTS - 1), now);
+        poll_slot(pubtable, 0, polls.tick & (POLL_SLOTS - 1), now);
+    }
+    return (polls.start + (polls.tick + 1) * POLL_TICK - now) / 1000000 + 1;
+}
+
+/*
+ * Fill the wheel with the devices of a new table. A device kept over a reload keeps
+ * its due time, the others get a random one within their interval.
+ */
+static void poll_schedule( struct devicetable *table, uint64_t now ) {
+    double                  bits = 0;
+    uint64_t                interval;
+    int32_t                 idx;
+
+    if (polls.start == 0) {
+        polls.start = now;
+        polls.seed = now ^ getpid();
+    }
+    polls.tick = (now - polls.start) / POLL_TICK;
+    memset(polls.slots, 0xff, sizeof(polls.slots));
+    polls.count = 0;
+    for (idx = 0; idx < table->count; idx++) {
+        if (table->devices[idx].poll == 0)
+            continue;
+        interval = (uint64_t)table->devices[idx].poll * 1000000 / POLL_TICK;
+        if (table->state[idx].polldue <= polls.tick || table->state[idx].polldue > polls.tick + interval + interval / 16 + 1)
+            table->state[idx].polldue = polls.tick + 1 + poll_random(interval + 1);
+        poll_insert(table, idx, table->state[idx].polldue);
+        bits += tp1_bits(1) * 1000.0 / table->devices[idx].poll;
+        polls.count++;
+    }
+    if (polls.count > 0)
+        log_info("Polling %d devices, at most %.2f%% of a TP1 line\n", polls.count, 100.0 * bits / TP1_BITRATE);
+}
+
+/*
+ * Publish the cached value of a device with the time and sender it was seen with
+ */
+static void publish_state( struct device *actual, const struct lastvalue *lv ) {
+    char                    payload[1024];
+    char                    buffer[255];
+    char                    source[KNX_ADDRSIZE];
+    struct tm               tm;
+    time_t                  sec = lv->time / 1000;
+    unsigned char           *p;
+    int                     len;
+
+    if (configuration.format == FORMAT_CBOR) {
+        p = CBOR_KEY(cbor_head((unsigned char *)payload, CBOR_MAP, 1), "d");
+        p = cbor_value(CBOR_KEY(cbor_head(p, CBOR_MAP, 3), "value"), &lv->val);
+        p = cbor_head(CBOR_KEY(p, "time"), CBOR_UINT, lv->time);
+        knx_physical( lv->source, source );
+        p = cbor_text(CBOR_KEY(p, "source"), source, strlen(source));
+        publish_message(DEVSTR(pubtable, actual->topic), payload, (char *)p - payload, bench ? monotonic_ns() : 0);
+        return;
+    }
+    localtime_r(&sec, &tm);
+    value_json( &lv->val, buffer, sizeof(buffer) );
+    len = snprintf(payload, sizeof(payload),
+                   "{\"d\":{\"value\":\"%s\",\"date\":\"%04d/%02d/%02d\",\"time\":\"%02d:%02d:%02d\",\"source\":\"%s\"}}",
+                   buffer, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                   knx_physical( lv->source, source ));
+    if (len >= (int)sizeof(payload))
+        len = sizeof(payload) - 1;
+    publish_message(DEVSTR(pubtable, actual->topic), payload, len, bench ? monotonic_ns() : 0);
+}
+
+/*
+ * Answer the pending state requests from the last value cache
+ */
+static void state_serve( void ) {
+    struct devicetable      *table = pubtable;
+    struct lastvalue        lv;
+    int32_t                 devices[STATE_MAXREQUESTS];
+    int32_t                 device;
+    int                     count;
+    int                     all;
+    int                     idx;
+
+    pthread_mutex_lock(&staterequests.lock);
+    all = staterequests.all;
+    count = staterequests.count;
+    memcpy(devices, staterequests.devices, count * sizeof(int32_t));
+    staterequests.all = 0;
+    staterequests.count = 0;
+    atomic_store(&staterequests.pending, 0);
+    pthread_mutex_unlock(&staterequests.lock);
+
+    if (all) {
+        count = 0;
+        for (idx = 0; idx < table->count; idx++)
+            if (lastvalue_get(table->devices[idx].daddr, &lv))
+                publish_state(&table->devices[idx], &lv);
+    }
+    for (idx = 0; idx < count; idx++)
+        if ((device = table->bygroup[devices[idx]]) != DEVICE_NONE && lastvalue_get(devices[idx], &lv))
+            publish_state(&table->devices[device], &lv);
+}
+
+/*
+ * Shared memory telegram feed, written by the publish thread, see bluehome_eib.h
+ */
+#define FEED_SLOTS              4096
+
+typedef struct feedwriter {
+        int             fd;
+        size_t          size;
+        struct feedheader *hdr;             // NULL when there is no feed
+        struct feedslot *slots;
+        uint32_t        mask;
+} feedwriter;
+
+static struct feedwriter feed = { -1, 0, NULL, NULL, 0 };
+
+/*
+ * Create the feed file, a file of the same layout is taken over with its sequence
+ * so readers carry on after a restart
+ */
+static int feed_create( struct feedwriter *fw, const char *path, int slots ) {
+    struct feedheader       *hdr;
+    struct stat             st;
+    uint32_t                count = 64;
+
+    while (count < (uint32_t)slots)
+        count *= 2;
+    fw->size = FEED_HEADERSIZE + (size_t)count * sizeof(struct feedslot);
+    if ((fw->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        return -1;
+    if (fstat(fw->fd, &st) != 0)
+        return -1;
+    if ((size_t)st.st_size != fw->size && ftruncate(fw->fd, fw->size) != 0)
+        return -1;
+    if ((hdr = mmap(NULL, fw->size, PROT_READ | PROT_WRITE, MAP_SHARED, fw->fd, 0)) == MAP_FAILED)
+        return -1;
+    if ((size_t)st.st_size != fw->size || memcmp(hdr->magic, FEED_MAGIC, 8) != 0 || hdr->version != FEED_VERSION
+            || hdr->headersize != FEED_HEADERSIZE || hdr->slotsize != sizeof(struct feedslot) || hdr->slots != count) {
+        memset(hdr, 0, fw->size);
+        hdr->version = FEED_VERSION;
+        hdr->headersize = FEED_HEADERSIZE;
+        hdr->slotsize = sizeof(struct feedslot);
+        hdr->slots = count;
+        hdr->created = time(NULL);
+        // the magic last, a reader never sees a half made header as a feed
+        atomic_thread_fence(memory_order_release);
+        memcpy(hdr->magic, FEED_MAGIC, 8);
+    }
+    fw->hdr = hdr;
+    fw->slots = (struct feedslot *)((char *)hdr + FEED_HEADERSIZE);
+    fw->mask = count - 1;
+    log_info("Telegram feed %s of %u slots at record %llu\n", path, count,
+             (unsigned long long)atomic_load(&hdr->head));
+    return 0;
+}
+
+/*
+ * Put one telegram in the next slot and wake readers that wait for it
+ */
+static void feed_publish( struct feedwriter *fw, const struct telegram *tg, int line, int32_t device, int eis, const struct value *val ) {
+    struct feedheader       *hdr = fw->hdr;
+    uint64_t                n = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+    struct feedslot         *slot = &fw->slots[n & fw->mask];
+    struct feedrecord       *rec = &slot->rec;
+    size_t                  len = (tg->len < FEED_CEMILEN) ? tg->len : FEED_CEMILEN;
+
+    atomic_store_explicit(&slot->seq, 2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    rec->time = (uint64_t)tg->tv.tv_sec * 1000000 + tg->tv.tv_usec;
+    rec->received = tg->received;
+    rec->device = device;
+    rec->generation = pubtable->generation;
+    rec->line = line;
+    rec->eis = eis;
+    rec->length = len;
+    rec->reserved = 0;
+    rec->val = *val;
+    if (device != DEVICE_NONE)
+        strncpy(rec->name, DEVSTR(pubtable, pubtable->devices[device].name), FEED_NAMELEN - 1);
+    else
+        rec->name[0] = '\0';
+    rec->name[FEED_NAMELEN - 1] = '\0';
+    memcpy(rec->cemi, &tg->frame, len);
+    atomic_store_explicit(&slot->seq, 2 * n + 2, memory_order_release);
+    atomic_store_explicit(&hdr->head, n + 1, memory_order_release);
+    atomic_fetch_add(&hdr->bell, 1);
+    if (atomic_load(&hdr->waiters) > 0)
+        syscall(SYS_futex, &hdr->bell, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * Log, decode, filter and publish one telegram taken from the ring of a line
+ */
+static void publish_telegram( struct telegram *tg, int line ) {
+    const struct tm         *ltime;
+    CEMIFRAME               *cemiframe;
+    struct value            val;
+    int                     eis;
+    struct device           *actual;
+    struct devicestate      *state;
+    int32_t                 device;
+
+    cemiframe = &tg->frame;
+    // device was looked up by the receive thread, unless the table was reloaded since
+    device = (tg->generation == pubtable->generation) ? tg->device : pubtable->bygroup[cemiframe->daddr];
+    actual = (device == DEVICE_NONE) ? NULL : &pubtable->devices[device];
+
+    val.type = VALUE_NONE;
+    eis = EIS_AUTO;
+    if( cemiframe->apci & (A_WRITE_VALUE_REQ | A_RESPONSE_VALUE_REQ) ) {
+        eis = decode_value( actual ? actual->eis : EIS_AUTO, cemiframe, &val );
+        if (cemiframe->ntwrk & EIB_DAF_GROUP)
+            lastvalue_update( cemiframe->daddr, cemiframe->saddr, eis, &val, &tg->tv );
+    }
+    if (feed.hdr != NULL)
+        feed_publish( &feed, tg, line, device, eis, &val );
+
+    // the whole trace line is formatted at once and only when tracing
+    if (log_enabled(LEVEL_TRACE)) {
+        char        seq[16] = "";
+        char        code[8];
+        char        source[KNX_ADDRSIZE];
+        char        target[KNX_ADDRSIZE];
+        char        detail[320] = "";
+        char        buffer[255];
+        const char  *prio = "";
+
+        if( total != -1 )
+            snprintf(seq, sizeof(seq), "%*u: ", spaces, tg->seq );
+        if( cemiframe->code == L_DATA_REQ ) {
+            strcpy(code, "REQ " );
+        } else if( cemiframe->code == L_DATA_CON ) {
+            strcpy(code, "CON " );
+        } else if( cemiframe->code == L_DATA_IND ) {
+            strcpy(code, "IND " );
+        } else if( cemiframe->code == L_BUSMON_IND ) {
+            strcpy(code, "MON " );
+        } else {
+            snprintf(code, sizeof(code), " %02x ", cemiframe->code );
+        }
+        if( cemiframe->ctrl & EIB_CTRL_PRIO_LOW ) {
+            prio = "low";
+        } else if( cemiframe->ctrl & EIB_CTRL_PRIO_HIGH ) {
+            prio = "hgh";
+        } else if( cemiframe->ctrl & EIB_CTRL_PRIO_SYSTEM ) {
+            prio = "sys";
+        } else if( cemiframe->ctrl & EIB_CTRL_PRIO_ALARM ) {
+            prio = "alm";
+        }
+        if( cemiframe->apci & (A_WRITE_VALUE_REQ | A_RESPONSE_VALUE_REQ) ) {
+            value_format( &val, buffer, sizeof(buffer) );
+            snprintf(detail, sizeof(detail), " : %s (%s - eis %d)", buffer,
+                     (cemiframe->length == 1) ? hexdump( &cemiframe->apci, 1, 1 )
+                                              : hexdump( (unsigned char *)(&cemiframe->apci) +1, cemiframe->length -1, 1 ),
+                     eis );
+        }
+        knx_physical( cemiframe->saddr, source );
+        ltime = timecache_get( &publishtime, tg->tv.tv_sec );
+        log_trace("EIB: %s%04d/%02d/%02d %02d:%02d:%02d:%03d - %8s  %s%s%s%s%s%8s%s\n",
+                  seq, ltime->tm_year + 1900, ltime->tm_mon +1, ltime->tm_mday,
+                  ltime->tm_hour, ltime->tm_min, ltime->tm_sec, (uint32_t)tg->tv.tv_usec / 1000,
+                  source, code, prio,
+                  (cemiframe->ctrl & EIB_CTRL_REPEAT) ? " r" : "  ",
+                  (cemiframe->ctrl & EIB_CTRL_ACK) ? "k " : "  ",
+                  (cemiframe->apci & A_WRITE_VALUE_REQ) ? "W " : (cemiframe->apci & A_RESPONSE_VALUE_REQ) ? "A " : "R ",
+                  (cemiframe->ntwrk & EIB_DAF_GROUP) ? knx_group( cemiframe->daddr, target ) : knx_physical( cemiframe->daddr, target ),
+                  detail );
+    }
+
+    // if device is found and the frame carries a value that passes its filter
+    if(actual != NULL && val.type != VALUE_NONE) {
+        state = &pubtable->state[device];
+        state->seen = tg->received;
+        if (configuration.history > 0 && val.type != VALUE_STRING)
+            history_add(actual->daddr, (uint64_t)tg->tv.tv_sec * 1000 + tg->tv.tv_usec / 1000, value_number(&val));
+        if (device_filter(actual, state, &val, tg->received))
+            publish_value(actual, state, &val, (uint64_t)tg->tv.tv_sec * 1000 + tg->tv.tv_usec / 1000, tg->received);
+    }
+}
+
+/*
+ * Return the record at *pos and advance *pos, NULL at the end of the capture
+ */
+static const struct capturerecord *capture_next( const unsigned char *map, size_t size, size_t *pos ) {
+    const struct capturerecord  *rec;
+
+    for (;;) {
+        if (*pos + sizeof(struct capturerecord) > size)
+            return NULL;
+        rec = (const struct capturerecord *)(map + *pos);
+        if (rec->length == CAPTURE_SKIP) {
+            *pos = (*pos / CAPTURE_CHUNK + 1) * CAPTURE_CHUNK;
+            continue;
+        }
+        if (rec->length == 0 || *pos + sizeof(struct capturerecord) + rec->length > size)
+            return NULL;
+        *pos += CAPTURE_ALIGN(sizeof(struct capturerecord) + rec->length);
+        return rec;
+    }
+}
+
+/*
+ * Map the chunk starting at offset, growing the file when needed
+ */
+static int capture_mapchunk( struct capturefile *cf, off_t offset ) {
+    struct stat     st;
+
+    if (cf->map != NULL)
+        munmap(cf->map, CAPTURE_CHUNK);
+    cf->map = NULL;
+    if (fstat(cf->fd, &st) != 0)
+        return -1;
+    if (st.st_size < offset + CAPTURE_CHUNK && ftruncate(cf->fd, offset + CAPTURE_CHUNK) != 0)
+        return -1;
+    cf->map = mmap(NULL, CAPTURE_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED, cf->fd, offset);
+    if (cf->map == MAP_FAILED) {
+        cf->map = NULL;
+        return -1;
+    }
+    cf->mapoffset = offset;
+    return 0;
+}
+
+/*
+ * Open a capture file for appending, an existing capture is continued after its last record
+ */
+static int capture_open( struct capturefile *cf, const char *filename ) {
+    struct captureheader        *hdr;
+    const unsigned char         *old;
+    struct stat                 st;
+    size_t                      end = 0;
+
+    if ((cf->fd = open(filename, O_RDWR | O_CREAT, 0644)) < 0)
+        return -1;
+    if (fstat(cf->fd, &st) != 0)
+        return -1;
+    if (st.st_size >= (off_t)sizeof(struct captureheader)) {
+        old = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, cf->fd, 0);
+        if (old == MAP_FAILED)
+            return -1;
+        hdr = (struct captureheader *)old;
+        if (memcmp(hdr->magic, CAPTURE_MAGIC, 8) != 0 || hdr->version != CAPTURE_VERSION) {
+            munmap((void *)old, st.st_size);
+            errno = EINVAL;
+            return -1;
+        }
+        end = hdr->headersize;
+        while (capture_next(old, st.st_size, &end) != NULL)
+            ;
+        munmap((void *)old, st.st_size);
+    }
+    if (capture_mapchunk(cf, (end / CAPTURE_CHUNK) * CAPTURE_CHUNK) != 0)
+        return -1;
+    cf->used = end % CAPTURE_CHUNK;
+    if (end == 0) {
+        hdr = (struct captureheader *)cf->map;
+        memcpy(hdr->magic, CAPTURE_MAGIC, 8);
+        hdr->version = CAPTURE_VERSION;
+        hdr->headersize = CAPTURE_ALIGN(sizeof(struct captureheader));
+        hdr->created = time(NULL);
+        cf->used = hdr->headersize;
+    }
+    return 0;
+}
+
+/*
+ * Append one raw frame
+ */
+static void capture_write( struct capturefile *cf, const unsigned char *frame, uint16_t length ) {
+    struct capturerecord    *rec;
+    struct timespec         ts;
+    size_t                  size = CAPTURE_ALIGN(sizeof(struct capturerecord) + length);
+
+    if (cf->map == NULL || length == 0 || length == CAPTURE_SKIP)
+        return;
+    if (cf->used + size > CAPTURE_CHUNK) {
+        if (cf->used + sizeof(struct capturerecord) <= CAPTURE_CHUNK)
+            ((struct capturerecord *)(cf->map + cf->used))->length = CAPTURE_SKIP;
+        if (capture_mapchunk(cf, cf->mapoffset + CAPTURE_CHUNK) != 0) {
+            log_error("Capture file can not grow, capturing stopped: %s\n", strerror( errno ));
+            return;
+        }
+        cf->used = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec = (struct capturerecord *)(cf->map + cf->used);
+    memcpy(rec->data, frame, length);
+    rec->timestamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec->length = length;
+    cf->used += size;
+    cf->records++;
+}
+
+/*
+ * Unmap and truncate the capture file to the end of the last record
+ */
+static void capture_close( struct capturefile *cf ) {
+    if (cf->fd < 0)
+        return;
+    if (cf->map != NULL) {
+        munmap(cf->map, CAPTURE_CHUNK);
+        if (ftruncate(cf->fd, cf->mapoffset + cf->used) != 0)
+            log_error("Can not truncate capture file: %s\n", strerror( errno ));
+    }
+    close(cf->fd);
+    cf->fd = -1;
+    cf->map = NULL;
+}
+
+/*
+ * Hand one raw frame to the publisher, capturing it first when requested
+ */
+static void receive_frame( struct busline *line, const unsigned char *frame, uint16_t length, uint32_t seq ) {
+    struct telegram         *tg;
+    struct devicetable      *table;
+    uint8_t                 seen = line - buses.lines + 1;
+
+    if (capture.map != NULL) {
+        pthread_mutex_lock(&capturelock);
+        if (capture.map != NULL)
+            capture_write(&capture, frame, length);
+        pthread_mutex_unlock(&capturelock);
+    }
+    if (bench)
+        atomic_fetch_add(&benchmark.frames, 1);
+    metric_add(&line->rx.frames[frame[0]], 1);
+    if (frame[0] == L_DATA_CON && length >= offsetof(CEMIFRAME, length) && atomic_load(&line->confirms.waiting) > 0)
+        confirm_frame(line, (const CEMIFRAME *)frame);
+    if( (tg = telegramring_reserve( &line->ring )) == NULL ) {
+        atomic_fetch_add( &line->ring.overflow, 1 );
+        return;
+    }
+    gettimeofday( &tg->tv, NULL );
+    tg->received = monotonic_ns();
+    tg->seq = seq;
+    tg->len = (length < sizeof(CEMIFRAME)) ? length : sizeof(CEMIFRAME);
+    memcpy( &tg->frame, frame, tg->len );
+    rcu_read_lock();
+    table = devicetable_get();
+    tg->device = table->bygroup[tg->frame.daddr];
+    tg->generation = table->generation;
+    rcu_read_unlock();
+    metric_add((tg->device != DEVICE_NONE) ? &line->rx.matched : &line->rx.unmatched, 1);
+    // remember the line of the group address for commands, written only when it moves
+    if (buses.count > 1 && (tg->frame.ntwrk & EIB_DAF_GROUP) &&
+        atomic_load_explicit(&buses.seen[tg->frame.daddr], memory_order_relaxed) != seen)
+        atomic_store_explicit(&buses.seen[tg->frame.daddr], seen, memory_order_relaxed);
+    telegramring_commit( &line->ring );
+}
+
+/*
+ * Number a received telegram, 0 when the -c count of all lines was already reached
+ */
+static uint32_t bus_count( void ) {
+    int                     seq = atomic_fetch_add(&buses.received, 1) + 1;
+
+    if (total != -1 && seq >= total) {
+        pthread_mutex_lock(&buses.lock);
+        pthread_cond_broadcast(&buses.stopped);
+        pthread_mutex_unlock(&buses.lock);
+        if (seq > total)
+            return 0;
+    }
+    return seq;
+}
+
+static int bus_finished( void ) {
+    return total != -1 && atomic_load(&buses.received) >= total;
+}
+
+/*
+ * A receive thread ends
+ */
+static void bus_stopped( void ) {
+    if (bench)
+        atomic_fetch_add(&benchmark.monitorcpu, threadcpu_ns());
+    pthread_mutex_lock(&buses.lock);
+    buses.running--;
+    pthread_cond_broadcast(&buses.stopped);
+    pthread_mutex_unlock(&buses.lock);
+}
+
+/*
+ * Wait until every receive thread ended or the -c count is reached
+ */
+static void bus_wait( void ) {
+    pthread_mutex_lock(&buses.lock);
+    while (buses.running > 0 && ! bus_finished())
+        pthread_cond_wait(&buses.stopped, &buses.lock);
+    pthread_mutex_unlock(&buses.lock);
+}
+
+/*
+ * Receive thread
+ *
+ * reads telegrams of one line from eibnetmux and hands them to the publisher through
+ * the ring of the line, never waits for MQTT
+ */
+static void *bus_receiver( void *arg ) {
+    struct busline          *line = arg;
+    uint16_t                value_size;
+    uint16_t                buflen;
+    unsigned char           *buf;
+    uint32_t                seq;
+
+    buf = malloc( 10 );
+    buflen = 10;
+
+    while( ! bus_finished() ) {
+        buf = enmx_monitor( line->sock_con, 0xffff, buf, &buflen, &value_size );
+        if( buf == NULL ) {
+            switch( enmx_geterror( line->sock_con )) {
+                case ENMX_E_COMMUNICATION:
+                case ENMX_E_NO_CONNECTION:
+                case ENMX_E_WRONG_USAGE:
+                case ENMX_E_NO_MEMORY:
+                    log_error("Error on write on line %s: %s\n", line->name, enmx_errormessage( line->sock_con ));
+                    enmx_close( line->sock_con );
+                    exit( -4 );
+                    break;
+                case ENMX_E_INTERNAL:
+                    log_error("Bad status returned on line %s\n", line->name );
+                    break;
+                case ENMX_E_SERVER_ABORTED:
+                    log_error("EOF reached on line %s: %s\n", line->name, enmx_errormessage( line->sock_con ));
+                    enmx_close( line->sock_con );
+                    exit( -4 );
+                    break;
+                case ENMX_E_TIMEOUT:
+                    log_error("No value received on line %s\n", line->name );
+                    break;
+            }
+        } else if( (seq = bus_count()) != 0 ) {
+            receive_frame( line, buf, value_size, seq );
+        }
+    }
+    bus_stopped();
+    return( NULL );
+}
+
+/*
+ * KNXnet/IP receive thread
+ *
+ * same as bus_receiver() for frames read directly from a KNX IP router or interface
+ */
+static void *knxip_receiver( void *arg ) {
+    struct busline          *line = arg;
+    const unsigned char     *frame;
+    uint16_t                length;
+    unsigned long           lost = 0;
+    uint32_t                seq;
+
+    while( ! bus_finished() ) {
+        frame = knxip_receive( &line->knx, &length, 1000 );
+        if( frame == NULL ) {
+            if( line->knx.error != NULL ) {
+                log_error("Error on receive from %s: %s\n", line->target, line->knx.error );
+                exit( -4 );
+            }
+            if( line->knx.lost != lost ) {
+                log_error("Router %s lost %lu telegrams\n", line->target, line->knx.lost - lost );
+                lost = line->knx.lost;
+            }
+        } else if( (seq = bus_count()) != 0 ) {
+            receive_frame( line, frame, length, seq );
+        }
+    }
+    bus_stopped();
+    return( NULL );
+}
+
+/*
+ * Replay thread
+ *
+ * feeds a capture file through the same path as frames received from eibnetmux,
+ * at the original pace or as fast as the publisher takes them
+ */
+static void *replay_receiver( void *arg ) {
+    struct busline              *line = arg;
+    const struct capturerecord  *rec;
+    const struct captureheader  *hdr;
+    const unsigned char         *map;
+    struct stat                 st;
+    struct timespec             start;
+    struct timespec             due;
+    uint64_t                    first = 0;
+    uint64_t                    offset;
+    size_t                      pos;
+    int                         fd;
+    uint32_t                    seq;
+    int                         count = 0;
+
+    if ((fd = open(replayfile, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        log_error("Can not open capture file %s: %s\n", replayfile, strerror( errno ));
+        exit( -2 );
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    hdr = (const struct captureheader *)map;
+    if (map == MAP_FAILED || st.st_size < (off_t)sizeof(struct captureheader) ||
+        memcmp(hdr->magic, CAPTURE_MAGIC, 8) != 0 || hdr->version != CAPTURE_VERSION) {
+        log_error("%s is not a capture file\n", replayfile);
+        exit( -2 );
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pos = hdr->headersize;
+    while (! bus_finished() && (rec = capture_next(map, st.st_size, &pos)) != NULL) {
+        if (! replayfast) {
+            if (first == 0)
+                first = rec->timestamp;
+            offset = (uint64_t)start.tv_nsec + (rec->timestamp - first);
+            due.tv_sec = start.tv_sec + offset / 1000000000;
+            due.tv_nsec = offset % 1000000000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+                ;
+        }
+        if ((seq = bus_count()) == 0)
+            break;
+        count++;
+        receive_frame( line, rec->data, rec->length, seq );
+    }
+    log_info("Replay of %s finished after %d telegrams\n", replayfile, count);
+    munmap((void *)map, st.st_size);
+    close(fd);
+    bus_stopped();
+    return( NULL );
+}
+
+/*
+ * Metrics exposition
+ *
+ * Prometheus text format on http://METRICS/metrics, served by its own thread one
+ * connection at a time, and an optional {"d":{...}} stats message with the totals
+ * every STATSINTERVAL seconds on the gateway topic, sent by the publish thread.
+ */
+#define METRICS_BUFSIZE         (64 * 1024)
+
+typedef struct textbuf {
+        char            *buf;
+        size_t          len;
+        size_t          size;
+} textbuf;
+
+static struct timecache statstime = { -1 };     // only used by the publish thread
+static uint64_t         statsdue;
+
+static void text_printf( struct textbuf *tb, const char *fmt, ... ) {
+    va_list         ap;
+    int             len;
+
+    if (tb->len >= tb->size)
+        return;
+    va_start(ap, fmt);
+    len = vsnprintf(tb->buf + tb->len, tb->size - tb->len, fmt, ap);
+    va_end(ap);
+    tb->len = (len < 0 || (size_t)len >= tb->size - tb->len) ? tb->size : tb->len + len;
+}
+
+static const char *cemi_name( int code ) {
+    switch (code) {
+        case L_DATA_IND:        return "L_Data.ind";
+        case L_DATA_CON:        return "L_Data.con";
+        case L_DATA_REQ:        return "L_Data.req";
+        case L_BUSMON_IND:      return "L_Busmon.ind";
+        case L_RAW_IND:         return "L_Raw.ind";
+        case L_POLL_DATA_CON:   return "L_Poll_Data.con";
+        case M_PROP_INFO_IND:   return "M_PropInfo.ind";
+        case M_RESET_IND:       return "M_Reset.ind";
+        default:                return NULL;
+    }
+}
+
+static void metrics_header( struct textbuf *tb, const char *name, const char *type, const char *help ) {
+    text_printf(tb, "# HELP bluehome_%s %s\n# TYPE bluehome_%s %s\n", name, help, name, type);
+}
+
+static void metrics_line( struct textbuf *tb, const char *name, unsigned long value ) {
+    text_printf(tb, "bluehome_%s %lu\n", name, value);
+}
+
+/*
+ * All metrics in Prometheus text format
+ */
+static void metrics_prometheus( struct textbuf *tb ) {
+    struct busline  *line;
+    unsigned long   connects = metric_get(&mqttstats.connects);
+    unsigned long   count;
+    const char      *name;
+    int             idx;
+    int             code;
+
+    metrics_header(tb, "frames_total", "counter", "Bus frames received per line and cEMI message code");
+    for (idx = 0; idx < buses.count; idx++) {
+        line = &buses.lines[idx];
+        for (code = 0; code < 256; code++) {
+            if ((count = metric_get(&line->rx.frames[code])) == 0)
+                continue;
+            if ((name = cemi_name(code)) != NULL)
+                text_printf(tb, "bluehome_frames_total{line=\"%s\",code=\"%s\"} %lu\n", line->name, name, count);
+            else
+                text_printf(tb, "bluehome_frames_total{line=\"%s\",code=\"0x%02x\"} %lu\n", line->name, code, count);
+        }
+    }
+    metrics_header(tb, "frames_matched_total", "counter", "Frames for a configured device");
+    for (idx = 0; idx < buses.count; idx++)
+        text_printf(tb, "bluehome_frames_matched_total{line=\"%s\"} %lu\n", buses.lines[idx].name, metric_get(&buses.lines[idx].rx.matched));
+    metrics_header(tb, "frames_unmatched_total", "counter", "Frames without a configured device");
+    for (idx = 0; idx < buses.count; idx++)
+        text_printf(tb, "bluehome_frames_unmatched_total{line=\"%s\"} %lu\n", buses.lines[idx].name, metric_get(&buses.lines[idx].rx.unmatched));
+    metrics_header(tb, "frames_dropped_total", "counter", "Frames dropped because the telegram ring was full");
+    for (idx = 0; idx < buses.count; idx++)
+        text_printf(tb, "bluehome_frames_dropped_total{line=\"%s\"} %lu\n", buses.lines[idx].name, atomic_load(&buses.lines[idx].ring.overflow));
+    metrics_header(tb, "commands_total", "counter", "Commands written to the bus");
+    for (idx = 0; idx < buses.count; idx++)
+        text_printf(tb, "bluehome_commands_total{line=\"%s\"} %lu\n", buses.lines[idx].name, metric_get(&buses.lines[idx].tx.commands));
+    metrics_header(tb, "commands_failed_total", "counter", "Commands that could not be written to the bus");
+    for (idx = 0; idx < buses.count; idx++)
+        text_printf(tb, "bluehome_commands_failed_total{line=\"%s\"} %lu\n", buses.lines[idx].name, metric_get(&buses.lines[idx].tx.failed));
+    metrics_header(tb, "commands_confirmed_total", "counter", "Writes confirmed by an L_Data.con");
+    for (idx = 0; idx < buses.count; idx++)
+        text_printf(tb, "bluehome_commands_confirmed_total{line=\"%s\"} %lu\n", buses.lines[idx].name, metric_get(&buses.lines[idx].rx.confirmed));
+    metrics_header(tb, "command_confirm_seconds_total", "counter", "Time from write to L_Data.con, summed over the confirmed writes");
+    for (idx = 0; idx < buses.count; idx++)
+        text_printf(tb, "bluehome_command_confirm_seconds_total{line=\"%s\"} %.6f\n", buses.lines[idx].name,
+                    metric_get(&buses.lines[idx].rx.confirmnanos) / 1e9);
+    metrics_header(tb, "commands_retried_total", "counter", "Writes sent again without a confirmation");
+    for (idx = 0; idx < buses.count; idx++)
+        text_printf(tb, "bluehome_commands_retried_total{line=\"%s\"} %lu\n", buses.lines[idx].name, metric_get(&buses.lines[idx].tx.retried));
+    metrics_header(tb, "commands_unconfirmed_total", "counter", "Writes given up without a confirmation");
+    for (idx = 0; idx < buses.count; idx++)
+        text_printf(tb, "bluehome_commands_unconfirmed_total{line=\"%s\"} %lu\n", buses.lines[idx].name, metric_get(&buses.lines[idx].tx.unconfirmed));
+    metrics_header(tb, "commands_coalesced_total", "counter", "Commands that replaced the queued value of their group address");
+    for (idx = 0; idx < buses.count; idx++) {
+        line = &buses.lines[idx];
+        pthread_mutex_lock(&line->commands.lock);
+        count = line->commands.coalesced;
+        pthread_mutex_unlock(&line->commands.lock);
+        text_printf(tb, "bluehome_commands_coalesced_total{line=\"%s\"} %lu\n", line->name, count);
+    }
+    metrics_header(tb, "polls_total", "counter", "Group reads queued for devices with poll=");
+    metrics_line(tb, "polls_total", metric_get(&publishstats.polls));
+    metrics_header(tb, "polls_skipped_total", "counter", "Group reads left out as the device reported recently");
+    metrics_line(tb, "polls_skipped_total", metric_get(&publishstats.pollsskipped));
+    metrics_header(tb, "polls_dropped_total", "counter", "Group reads of an eibnetmux line dropped as the address or a full queue was waiting");
+    for (idx = 0; idx < buses.count; idx++)
+        text_printf(tb, "bluehome_polls_dropped_total{line=\"%s\"} %lu\n", buses.lines[idx].name, metric_get(&buses.lines[idx].tx.readsdropped));
+    metrics_header(tb, "polls_unanswered_total", "counter", "Group reads of an eibnetmux line without a response in the eibnetmux timeout");
+    for (idx = 0; idx < buses.count; idx++)
+        text_printf(tb, "bluehome_polls_unanswered_total{line=\"%s\"} %lu\n", buses.lines[idx].name, metric_get(&buses.lines[idx].tx.unanswered));
+    metrics_header(tb, "published_bytes_total", "counter", "Topic and payload bytes handed to the MQTT client");
+    metrics_line(tb, "published_bytes_total", metric_get(&publishstats.bytes));
+    metrics_header(tb, "published_aliased_total", "counter", "Messages sent with an MQTT 5 topic alias instead of the topic");
+    metrics_line(tb, "published_aliased_total", metric_get(&publishstats.aliased));
+    metrics_header(tb, "history_queries_total", "counter", "HISTORY commands answered");
+    metrics_line(tb, "history_queries_total", metric_get(&publishstats.historyqueries));
+    metrics_header(tb, "commands_rejected_total", "counter", "Malformed MQTT commands");
+    metrics_line(tb, "commands_rejected_total", atomic_load(&commandrejects));
+    metrics_header(tb, "publishes_total", "counter", "Messages handed to the MQTT client");
+    metrics_line(tb, "publishes_total", metric_get(&publishstats.attempted));
+    metrics_header(tb, "publishes_failed_total", "counter", "Messages refused by the MQTT client or not delivered");
+    metrics_line(tb, "publishes_failed_total", metric_get(&publishstats.refused) + metric_get(&mqttstats.deliveryfailed));
+    metrics_header(tb, "publishes_retried_total", "counter", "Spooled messages sent again");
+    metrics_line(tb, "publishes_retried_total", metric_get(&publishstats.retried));
+    metrics_header(tb, "spooled_total", "counter", "Messages written to the spool");
+    metrics_line(tb, "spooled_total", metric_get(&publishstats.spooled));
+    metrics_header(tb, "spool_dropped_total", "counter", "Spooled messages dropped because the spool was full");
+    metrics_line(tb, "spool_dropped_total", metric_get(&publishstats.spooldropped));
+    metrics_header(tb, "reconnects_total", "counter", "MQTT reconnects after the first connect");
+    metrics_line(tb, "reconnects_total", connects > 0 ? connects - 1 : 0);
+    metrics_header(tb, "connection_lost_total", "counter", "MQTT connections lost");
+    metrics_line(tb, "connection_lost_total", metric_get(&mqttstats.connectionlost));
+    metrics_header(tb, "telegram_ring_depth", "gauge", "Telegrams waiting for the publisher");
+    for (idx = 0; idx < buses.count; idx++) {
+        line = &buses.lines[idx];
+        text_printf(tb, "bluehome_telegram_ring_depth{line=\"%s\"} %u\n", line->name,
+                    atomic_load(&line->ring.head) - atomic_load(&line->ring.tail));
+    }
+    if (configuration.busload > 0) {
+        metrics_header(tb, "bus_load_ratio", "gauge", "Estimated TP1 bus utilization over the last minute");
+        for (idx = 0; idx < buses.count; idx++)
+            text_printf(tb, "bluehome_bus_load_ratio{line=\"%s\"} %.3f\n", buses.lines[idx].name,
+                        metric_get(&buses.lines[idx].load.utilization) / 1000.0);
+    }
+    metrics_header(tb, "command_queue_depth", "gauge", "Commands waiting to be written to the bus");
+    for (idx = 0; idx < buses.count; idx++) {
+        line = &buses.lines[idx];
+        pthread_mutex_lock(&line->commands.lock);
+        count = line->commands.count;
+        pthread_mutex_unlock(&line->commands.lock);
+        text_printf(tb, "bluehome_command_queue_depth{line=\"%s\"} %lu\n", line->name, count);
+    }
+    pthread_mutex_lock(&window.lock);
+    count = window.inflight;
+    pthread_mutex_unlock(&window.lock);
+    metrics_header(tb, "mqtt_inflight", "gauge", "Published messages waiting for delivery confirmation");
+    metrics_line(tb, "mqtt_inflight", count);
+    metrics_header(tb, "mqtt_connected", "gauge", "Whether the MQTT client is connected");
+    metrics_line(tb, "mqtt_connected", mqtt_connected());
+    metrics_header(tb, "spool_pending", "gauge", "Messages in the spool");
+    metrics_line(tb, "spool_pending", metric_get(&publishstats.spoolpending));
+}
+
+/*
+ * HTTP thread, answers GET /metrics
+ */
+static void *metrics_server( void *arg ) {
+    int                 listenfd = (int)(intptr_t)arg;
+    struct timeval      tv = { 2, 0 };
+    struct textbuf      tb;
+    char                request[1024];
+    char                header[256];
+    ssize_t             got;
+    size_t              sent;
+    ssize_t             done;
+    int                 fd;
+    int                 hlen;
+
+    if ((tb.buf = malloc(METRICS_BUFSIZE)) == NULL) {
+        log_error("Out of memory: %s\n", strerror( errno ));
+        return NULL;
+    }
+    tb.size = METRICS_BUFSIZE;
+    for (;;) {
+        if ((fd = accept(listenfd, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            log_error("Metrics endpoint stopped: %s\n", strerror( errno ));
+            break;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        got = recv(fd, request, sizeof(request) - 1, 0);
+        request[got > 0 ? got : 0] = '\0';
+        tb.len = 0;
+        if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+            metrics_prometheus(&tb);
+            hlen = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\nConnection: close\r\n\r\n", tb.len);
+        } else {
+            text_printf(&tb, "not found\n");
+            hlen = snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n"
+                            "Content-Length: %zu\r\nConnection: close\r\n\r\n", tb.len);
+        }
+        if (send(fd, header, hlen, MSG_NOSIGNAL) == hlen) {
+            for (sent = 0; sent < tb.len; sent += done)
+                if ((done = send(fd, tb.buf + sent, tb.len - sent, MSG_NOSIGNAL)) <= 0)
+                    break;
+        }
+        close(fd);
+    }
+    free(tb.buf);
+    close(listenfd);
+    return NULL;
 }
 
-void connlost(void *context, char *cause) {
-	 fprintf(logfile, "\nConnection lost\n");
-	 fprintf(logfile, "     cause: %s\n", cause);
+/*
+ * Listen on [address:]port and start the metrics thread
+ */
+static void metrics_start( const char *spec ) {
+    struct sockaddr_in  addr;
+    char                host[64] = "127.0.0.1";
+    const char          *colon = strrchr(spec, ':');
+    pthread_t           thread;
+    int                 one = 1;
+    int                 fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(colon ? colon + 1 : spec));
+    if (colon != NULL)
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1 || addr.sin_port == 0) {
+        log_error("Invalid metrics address %s\n", spec);
+        return;
+    }
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0 ||
+        thread_start(&thread, metrics_server, (void *)(intptr_t)fd) != 0) {
+        log_error("Can not serve metrics on %s: %s\n", spec, strerror( errno ));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    pthread_detach(thread);
+    log_info("Metrics on http://%s:%d/metrics\n", host, ntohs(addr.sin_port));
 }
 
+/*
+ * Publish the totals as a stats message when one is due, returns the milliseconds
+ * until the next one
+ */
+static long stats_publish( uint64_t now ) {
+    static char     topic[1024];
+    struct textbuf  tb;
+    char            payload[1024];
+    unsigned long   frames = 0;
+    unsigned long   matched = 0;
+    unsigned long   unmatched = 0;
+    unsigned long   dropped = 0;
+    unsigned long   commands = 0;
+    unsigned long   failed = 0;
+    unsigned long   connects = metric_get(&mqttstats.connects);
+    struct timeval  tv;
+    int             idx;
+    int             code;
 
-int main( int argc, char **argv ) {
-    uint16_t                value_size;
+    if (statsdue == 0)
+        statsdue = now + (uint64_t)configuration.statsinterval * 1000000000;
+    if (now < statsdue)
+        return (statsdue - now) / 1000000 + 1;
+    if (topic[0] == '\0')
+        gateway_topic("stats", FORMAT_JSON, topic, sizeof(topic));
+    statsdue = now + (uint64_t)configuration.statsinterval * 1000000000;
+    for (idx = 0; idx < buses.count; idx++) {
+        for (code = 0; code < 256; code++)
+            frames += metric_get(&buses.lines[idx].rx.frames[code]);
+        matched += metric_get(&buses.lines[idx].rx.matched);
+        unmatched += metric_get(&buses.lines[idx].rx.unmatched);
+        dropped += atomic_load(&buses.lines[idx].ring.overflow);
+        commands += metric_get(&buses.lines[idx].tx.commands);
+        failed += metric_get(&buses.lines[idx].tx.failed);
+    }
+    gettimeofday(&tv, NULL);
+    timecache_get(&statstime, tv.tv_sec);
+    tb.buf = payload;
+    tb.size = sizeof(payload);
+    tb.len = 0;
+    text_printf(&tb, "{\"d\":{\"frames\":%lu,\"matched\":%lu,\"unmatched\":%lu,\"dropped\":%lu,"
+                "\"published\":%lu,\"failed\":%lu,\"retried\":%lu,\"spooled\":%lu,\"spoolpending\":%lu,"
+                "\"commands\":%lu,\"commandsfailed\":%lu,\"rejected\":%lu,\"reconnects\":%lu,\"event\":\"stats",
+                frames, matched, unmatched, dropped, metric_get(&publishstats.attempted),
+                metric_get(&publishstats.refused) + metric_get(&mqttstats.deliveryfailed), metric_get(&publishstats.retried),
+                metric_get(&publishstats.spooled), metric_get(&publishstats.spoolpending), commands, failed,
+                atomic_load(&commandrejects), connects > 0 ? connects - 1 : 0);
+    text_printf(&tb, "%.*s", (int)statstime.suffixlen, statstime.suffix);
+    if (tb.len < tb.size)
+        publish_message(topic, payload, tb.len, 0);
+    return configuration.statsinterval * 1000;
+}
+
+/*
+ * Count an address in a Space-Saving table, the least counted slot is taken over
+ * when the address is not tracked and all slots are in use
+ */
+static void topk_count( struct topk *tk, uint16_t addr ) {
+    int             min = 0;
+    int             idx;
+
+    for (idx = 0; idx < tk->used; idx++) {
+        if (tk->addr[idx] == addr) {
+            tk->count[idx]++;
+            return;
+        }
+    }
+    if (tk->used < BUSLOAD_SLOTS) {
+        idx = tk->used++;
+        tk->addr[idx] = addr;
+        tk->count[idx] = 1;
+        tk->error[idx] = 0;
+        return;
+    }
+    for (idx = 1; idx < BUSLOAD_SLOTS; idx++)
+        if (tk->count[idx] < tk->count[min])
+            min = idx;
+    tk->addr[min] = addr;
+    tk->error[min] = tk->count[min];
+    tk->count[min]++;
+}
+
+/*
+ * Append the busiest addresses of a table as a JSON array, highest count first
+ */
+static void topk_report( struct textbuf *tb, const char *key, struct topk *tk, int top, int physical, double seconds ) {
+    uint8_t         taken[BUSLOAD_SLOTS] = { 0 };
+    char            address[KNX_ADDRSIZE];
+    int             best;
+    int             idx;
+    int             n;
+
+    text_printf(tb, ",\"%s\":[", key);
+    for (n = 0; n < top && n < tk->used; n++) {
+        best = -1;
+        for (idx = 0; idx < tk->used; idx++)
+            if (! taken[idx] && (best < 0 || tk->count[idx] > tk->count[best]))
+                best = idx;
+        taken[best] = 1;
+        text_printf(tb, "%s{\"address\":\"%s\",\"fps\":%.3f,\"error\":%.3f}", n ? "," : "",
+                    physical ? knx_physical(tk->addr[best], address) : knx_group(tk->addr[best], address),
+                    tk->count[best] / seconds, tk->error[best] / seconds);
+    }
+    text_printf(tb, "]");
+}
+
+/*
+ * Slide the utilization window to second sec, seconds without frames are cleared
+ */
+static void busload_advance( struct busload *bl, uint64_t sec ) {
+    uint64_t        next;
+    int             slot;
+
+    if (sec <= bl->second)
+        return;
+    for (next = bl->second + 1; next <= sec && next <= bl->second + BUSLOAD_SECONDS; next++) {
+        slot = next % BUSLOAD_SECONDS;
+        bl->windowbits -= bl->bits[slot];
+        bl->bits[slot] = 0;
+    }
+    bl->second = sec;
+    metric_set(&bl->utilization, (uint64_t)bl->windowbits * 1000 / (BUSLOAD_SECONDS * TP1_BITRATE));
+}
+
+/*
+ * Account one frame taken from the ring of a line
+ */
+static inline void busload_count( struct busload *bl, const struct telegram *tg ) {
+    const CEMIFRAME *frame = &tg->frame;
+    uint32_t        bits;
+    int             slot;
+
+    if (frame->code != L_DATA_IND && frame->code != L_DATA_CON)
+        return;
+    bits = tp1_bits(frame->length);
+    busload_advance(bl, tg->received / 1000000000);
+    slot = bl->second % BUSLOAD_SECONDS;
+    bl->bits[slot] += bits;
+    bl->windowbits += bits;
+    if (bl->bits[slot] > bl->peakbits)
+        bl->peakbits = bl->bits[slot];
+    bl->frames++;
+    if (! (frame->ctrl & EIB_CTRL_NOREPEAT))
+        bl->repeated++;
+    bl->priority[(frame->ctrl & EIB_CTRL_PRIO_LOW) >> 2]++;
+    topk_count(&bl->sources, frame->saddr);
+    if (frame->ntwrk & EIB_DAF_GROUP)
+        topk_count(&bl->groups, frame->daddr);
+}
+
+/*
+ * Publish the bus load report of every line when one is due, starts the next
+ * interval, returns the milliseconds until the next report
+ */
+static long busload_publish( uint64_t now ) {
+    static char     topic[1024];
+    static uint64_t opened;
+    struct busline  *line;
+    struct busload  *bl;
+    struct textbuf  tb;
+    struct timeval  tv;
+    char            payload[8192];
+    uint64_t        interval = (uint64_t)configuration.busload * 1000000000;
+    double          seconds;
+    double          capacity;
+    int             top = (configuration.busloadtop > 0) ? configuration.busloadtop : BUSLOAD_TOP;
+    int             idx;
+
+    if (opened == 0)
+        opened = now;
+    if (now - opened < interval)
+        return (interval - (now - opened)) / 1000000 + 1;
+    if (topic[0] == '\0')
+        gateway_topic("busload", FORMAT_JSON, topic, sizeof(topic));
+    seconds = (now - opened) / 1e9;
+    opened = now;
+    gettimeofday(&tv, NULL);
+    timecache_get(&statstime, tv.tv_sec);
+    tb.buf = payload;
+    tb.size = sizeof(payload);
+    for (idx = 0; idx < buses.count; idx++) {
+        line = &buses.lines[idx];
+        bl = &line->load;
+        busload_advance(bl, now / 1000000000);
+        capacity = (double)BUSLOAD_SECONDS * TP1_BITRATE;
+        tb.len = 0;
+        text_printf(&tb, "{\"d\":{\"seconds\":%.0f,\"frames\":%u,\"fps\":%.2f,\"load\":%.1f,\"peak\":%.1f,\"repeated\":%.1f,"
+                    "\"priority\":{\"system\":%u,\"high\":%u,\"alarm\":%u,\"low\":%u}",
+                    seconds, bl->frames, bl->frames / seconds, 100.0 * bl->windowbits / capacity,
+                    100.0 * bl->peakbits / TP1_BITRATE, bl->frames ? 100.0 * bl->repeated / bl->frames : 0.0,
+                    bl->priority[0], bl->priority[1], bl->priority[2], bl->priority[3]);
+        topk_report(&tb, "sources", &bl->sources, top, 1, seconds);
+        topk_report(&tb, "groups", &bl->groups, top, 0, seconds);
+        text_printf(&tb, ",\"line\":\"%s%.*s", line->name, (int)statstime.suffixlen, statstime.suffix);
+        if (tb.len < tb.size)
+            publish_message(topic, payload, tb.len, 0);
+        else
+            log_error("Bus load report of line %s too long, use a smaller BUSLOADTOP\n", line->name);
+        log_info("Bus load of line %s %.1f%%, peak %.1f%%, %.2f frames/s, %.1f%% repeated\n", line->name,
+                 100.0 * bl->windowbits / capacity, 100.0 * bl->peakbits / TP1_BITRATE, bl->frames / seconds,
+                 bl->frames ? 100.0 * bl->repeated / bl->frames : 0.0);
+        bl->peakbits = bl->bits[bl->second % BUSLOAD_SECONDS];
+        bl->frames = 0;
+        bl->repeated = 0;
+        memset(bl->priority, 0, sizeof(bl->priority));
+        bl->sources.used = 0;
+        bl->groups.used = 0;
+    }
+    return configuration.busload * 1000;
+}
+
+/*
+ * Value history
+ *
+ * the recent numeric values of every device, kept by the publish thread and
+ * compressed as in Gorilla: the wall clock milliseconds as delta of delta, the values
+ * as XOR with the previous value. A device gets HISTORY bytes of blocks used as a
+ * ring, when the newest block fills up the oldest one is cleared for it. Every block
+ * keeps count, minimum, maximum and sum so rollups over whole blocks are served
+ * without decoding. Histories are kept by group address and survive a reload.
+ */
+#define HISTORY_BLOCK           256         // bytes of encoded values per block
+#define HISTORY_MAXBITS         (4 + 32 + 2 + 5 + 6 + 64)   // longest encoded value
+#define HISTORY_PAYLOAD         65536
+
+typedef struct historyblock {
+        uint64_t        first;              // wall clock ms of the first value
+        uint64_t        last;
+        double          min;
+        double          max;
+        double          sum;
+        uint32_t        count;
+        uint32_t        bits;               // bits of data in use
+        uint64_t        data[HISTORY_BLOCK / 8];
+} historyblock;
+
+typedef struct history {
+        int             blocks;
+        int             head;               // block being written
+        int             used;               // blocks holding values
+        uint8_t         leading;            // encoder state: XOR window of the last value,
+        uint8_t         trailing;           // leading 0xff when there is none
+        uint64_t        time;               // time, delta and bits of the last value
+        int64_t         delta;
+        uint64_t        bits;
+        struct historyblock block[];
+} history;
+
+typedef struct historycursor {
+        const struct historyblock *blk;
+        uint32_t        pos;
+        uint32_t        index;
+        uint8_t         leading;
+        uint8_t         trailing;
+        uint64_t        time;
+        int64_t         delta;
+        uint64_t        bits;
+} historycursor;
+
+static struct history   **historypages[256];    // by group address, only used by the publish thread
+
+static inline void history_putbits( struct historyblock *blk, uint64_t value, int n ) {
+    int                 word = blk->bits >> 6;
+    int                 room = 64 - (blk->bits & 63);
+
+    if (n < 64)
+        value &= (1ULL << n) - 1;
+    if (n <= room) {
+        blk->data[word] |= value << (room - n);
+    } else {
+        blk->data[word] |= value >> (n - room);
+        blk->data[word + 1] |= value << (64 - (n - room));
+    }
+    blk->bits += n;
+}
+
+static inline uint64_t history_getbits( struct historycursor *c, int n ) {
+    const uint64_t      *data = c->blk->data;
+    int                 word = c->pos >> 6;
+    int                 room = 64 - (c->pos & 63);
+    uint64_t            value;
+
+    if (n <= room)
+        value = data[word] >> (room - n);
+    else
+        value = (data[word] << (n - room)) | (data[word + 1] >> (64 - (n - room)));
+    c->pos += n;
+    return (n < 64) ? value & ((1ULL << n) - 1) : value;
+}
+
+static inline int64_t history_signed( uint64_t value, int n ) {
+    return (int64_t)(value << (64 - n)) >> (64 - n);
+}
+
+/*
+ * History of a group address (network byte order), allocated on the first value
+ */
+static struct history *history_get( uint16_t daddr, int create ) {
+    uint16_t            grp = ntohs(daddr);
+    struct history      **page = historypages[grp >> 8];
+    struct history      *h;
+    char                address[KNX_ADDRSIZE];
+    int                 blocks;
+
+    if (page == NULL) {
+        if (! create || (page = historypages[grp >> 8] = calloc(256, sizeof(struct history *))) == NULL)
+            return NULL;
+    }
+    if ((h = page[grp & 0xff]) == NULL && create) {
+        blocks = configuration.history / sizeof(struct historyblock);
+        if (blocks < 2)
+            blocks = 2;
+        if ((h = calloc(1, sizeof(struct history) + blocks * sizeof(struct historyblock))) == NULL) {
+            log_error("No memory for the history of %s\n", knx_group(daddr, address));
+            return NULL;
+        }
+        h->blocks = blocks;
+        page[grp & 0xff] = h;
+    }
+    return h;
+}
+
+/*
+ * Append a value to the history of a group address, publish thread only
+ */
+static void history_add( uint16_t daddr, uint64_t time, double value ) {
+    struct history      *h;
+    struct historyblock *blk;
+    uint64_t            bits;
+    uint64_t            x;
+    int64_t             delta;
+    int64_t             dod;
+    int                 lead;
+    int                 trail;
+
+    if ((h = history_get(daddr, 1)) == NULL)
+        return;
+    memcpy(&bits, &value, sizeof(bits));
+    blk = &h->block[h->head];
+    delta = time - h->time;
+    dod = delta - h->delta;
+    if (blk->count == 0 || time < h->time || dod < INT32_MIN || dod > INT32_MAX
+            || blk->bits + HISTORY_MAXBITS > HISTORY_BLOCK * 8) {
+        // start a block, the first value is kept whole
+        if (blk->count > 0) {
+            h->head = (h->head + 1) % h->blocks;
+            blk = &h->block[h->head];
+        }
+        if (h->used < h->blocks)
+            h->used++;
+        memset(blk, 0, sizeof(*blk));
+        blk->first = time;
+        blk->min = blk->max = value;
+        history_putbits(blk, bits, 64);
+        h->leading = 0xff;
+        h->delta = 0;
+    } else {
+        if (dod == 0)
+            history_putbits(blk, 0, 1);
+        else if (dod >= -64 && dod < 64)
+            history_putbits(blk, (0x2ULL << 7) | ((uint64_t)dod & 0x7f), 2 + 7);
+        else if (dod >= -256 && dod < 256)
+            history_putbits(blk, (0x6ULL << 9) | ((uint64_t)dod & 0x1ff), 3 + 9);
+        else if (dod >= -2048 && dod < 2048)
+            history_putbits(blk, (0xeULL << 12) | ((uint64_t)dod & 0xfff), 4 + 12);
+        else
+            history_putbits(blk, (0xfULL << 32) | ((uint64_t)dod & 0xffffffff), 4 + 32);
+        h->delta = delta;
+
+        if ((x = bits ^ h->bits) == 0) {
+            history_putbits(blk, 0, 1);
+        } else {
+            lead = __builtin_clzll(x);
+            trail = __builtin_ctzll(x);
+            if (lead > 31)
+                lead = 31;
+            if (h->leading != 0xff && lead >= h->leading && trail >= h->trailing) {
+                history_putbits(blk, 0x2, 2);
+                history_putbits(blk, x >> h->trailing, 64 - h->leading - h->trailing);
+            } else {
+                history_putbits(blk, (0x3 << 11) | (lead << 6) | (63 - lead - trail), 2 + 5 + 6);
+                history_putbits(blk, x >> trail, 64 - lead - trail);
+                h->leading = lead;
+                h->trailing = trail;
+            }
+        }
+        if (value < blk->min)
+            blk->min = value;
+        if (value > blk->max)
+            blk->max = value;
+    }
+    blk->sum += value;
+    blk->last = time;
+    blk->count++;
+    h->time = time;
+    h->bits = bits;
+}
+
+/*
+ * Decode the next value of a block, 0 at its end
+ */
+static int history_next( struct historycursor *c, uint64_t *time, double *value ) {
+    uint64_t            x;
+    int                 len;
+
+    if (c->index == c->blk->count)
+        return 0;
+    if (c->index == 0) {
+        c->pos = 0;
+        c->time = c->blk->first;
+        c->delta = 0;
+        c->bits = history_getbits(c, 64);
+    } else {
+        if (history_getbits(c, 1) == 0)
+            ;
+        else if (history_getbits(c, 1) == 0)
+            c->delta += history_signed(history_getbits(c, 7), 7);
+        else if (history_getbits(c, 1) == 0)
+            c->delta += history_signed(history_getbits(c, 9), 9);
+        else if (history_getbits(c, 1) == 0)
+            c->delta += history_signed(history_getbits(c, 12), 12);
+        else
+            c->delta += history_signed(history_getbits(c, 32), 32);
+        c->time += c->delta;
+
+        if (history_getbits(c, 1) == 1) {
+            if (history_getbits(c, 1) == 1) {
+                c->leading = history_getbits(c, 5);
+                len = history_getbits(c, 6) + 1;
+                c->trailing = 64 - c->leading - len;
+            } else {
+                len = 64 - c->leading - c->trailing;
+            }
+            x = history_getbits(c, len);
+            c->bits ^= x << c->trailing;
+        }
+    }
+    c->index++;
+    *time = c->time;
+    memcpy(value, &c->bits, sizeof(*value));
+    return 1;
+}
+
+/*
+ * Queue a HISTORY command, range is from[,to[,step]] in seconds: from and to are
+ * epoch seconds or, when not positive, relative to now; to defaults to now and a
+ * step gives min/max/avg rollups of that many seconds instead of the values.
+ * Returns the reason when the command is rejected.
+ */
+static const char *history_request( int32_t daddr, const char *range ) {
+    struct historyrequest   req;
     struct timeval          tv;
-    struct tm               *ltime;
-    uint16_t                buflen;
-    unsigned char           *buf;
-    CEMIFRAME               *cemiframe;
-    int                     enmx_version;
+    int64_t                 field[3] = { 0, 0, 0 };
+    uint64_t                now;
+    char                    *end;
+    int                     idx;
+
+    if (configuration.history <= 0)
+        return "no history kept, set HISTORY";
+    for (idx = 0; idx < 3; idx++) {
+        field[idx] = strtoll(range, &end, 10);
+        if (end == range)
+            return "range is not from[,to[,step]]";
+        if (*end != ',')
+            break;
+        range = end + 1;
+    }
+    if (*end != '\0' || field[2] < 0)
+        return "range is not from[,to[,step]]";
+    gettimeofday(&tv, NULL);
+    now = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    req.daddr = daddr;
+    req.from = (field[0] > 0) ? (uint64_t)field[0] * 1000 : now + field[0] * 1000;
+    req.to = (field[1] > 0) ? (uint64_t)field[1] * 1000 : now + field[1] * 1000;
+    req.step = (uint64_t)field[2] * 1000;
+    if (req.to < req.from)
+        return "range ends before it starts";
+
+    pthread_mutex_lock(&historyrequests.lock);
+    if (historyrequests.count == HISTORY_MAXREQUESTS) {
+        pthread_mutex_unlock(&historyrequests.lock);
+        return "too many history queries waiting";
+    }
+    historyrequests.requests[historyrequests.count++] = req;
+    atomic_store(&historyrequests.pending, 1);
+    pthread_mutex_unlock(&historyrequests.lock);
+    publisher_wakeup();
+    return NULL;
+}
+
+/*
+ * Close a rollup bucket
+ */
+static void history_rollup( struct textbuf *tb, uint64_t start, double min, double max, double sum, uint32_t count ) {
+    if (count > 0)
+        text_printf(tb, "%s[%llu,%.10g,%.10g,%.10g,%u]", tb->buf[tb->len - 1] == '[' ? "" : ",",
+                    (unsigned long long)start, min, max, sum / count, count);
+}
+
+/*
+ * Answer one query on iot-2/type/<type>/id/<id>/evt/history/fmt/json, with the
+ * values or rollups of the range. A range too long for one message ends with the
+ * time to continue from as "more".
+ */
+static void history_answer( const struct device *actual, const struct historyrequest *req ) {
+    static char             topic[1024];
+    static char             payload[HISTORY_PAYLOAD];
+    struct history          *h = history_get(actual->daddr, 0);
+    struct historyblock     *blk;
+    struct historycursor    c;
+    struct textbuf          tb;
+    uint64_t                bucket = 0;
+    uint64_t                time;
+    uint64_t                more = 0;
+    double                  value;
+    double                  min = 0;
+    double                  max = 0;
+    double                  sum = 0;
+    uint32_t                count = 0;
+    int                     idx;
+
+    if (topic[0] == '\0')
+        gateway_topic("history", FORMAT_JSON, topic, sizeof(topic));
+    tb.buf = payload;
+    tb.size = sizeof(payload);
+    tb.len = 0;
+    text_printf(&tb, "{\"d\":{\"device\":\"%s\",\"from\":%llu,\"to\":%llu",
+                DEVSTR(pubtable, actual->name), (unsigned long long)req->from, (unsigned long long)req->to);
+    if (req->step > 0)
+        text_printf(&tb, ",\"step\":%llu,\"rollups\":[", (unsigned long long)req->step);
+    else
+        text_printf(&tb, ",\"values\":[");
+
+    for (idx = 0; h != NULL && idx < h->used && more == 0; idx++) {
+        blk = &h->block[(h->head - h->used + 1 + idx + h->blocks) % h->blocks];
+        if (blk->last < req->from || blk->first > req->to)
+            continue;
+        // a block inside the range and one bucket is rolled up from its totals
+        if (req->step > 0 && blk->first >= req->from && blk->last <= req->to
+                && (blk->first - req->from) / req->step == (blk->last - req->from) / req->step) {
+            if (count > 0 && (blk->first - req->from) / req->step != bucket) {
+                if (tb.len + 128 > tb.size - 64) {
+                    more = req->from + bucket * req->step;
+                    count = 0;
+                    break;
+                }
+                history_rollup(&tb, req->from + bucket * req->step, min, max, sum, count);
+                count = 0;
+            }
+            if (count == 0 || blk->min < min)
+                min = blk->min;
+            if (count == 0 || blk->max > max)
+                max = blk->max;
+            sum = (count == 0) ? blk->sum : sum + blk->sum;
+            count += blk->count;
+            bucket = (blk->first - req->from) / req->step;
+            continue;
+        }
+        memset(&c, 0, sizeof(c));
+        c.blk = blk;
+        while (history_next(&c, &time, &value)) {
+            if (time < req->from || time > req->to)
+                continue;
+            if (req->step == 0) {
+                if (tb.len + 64 > tb.size - 64) {
+                    more = time;
+                    break;
+                }
+                text_printf(&tb, "%s[%llu,%.10g]", tb.buf[tb.len - 1] == '[' ? "" : ",", (unsigned long long)time, value);
+                continue;
+            }
+            if (count > 0 && (time - req->from) / req->step != bucket) {
+                if (tb.len + 128 > tb.size - 64) {
+                    more = req->from + bucket * req->step;
+                    count = 0;
+                    break;
+                }
+                history_rollup(&tb, req->from + bucket * req->step, min, max, sum, count);
+                count = 0;
+            }
+            if (count == 0) {
+                bucket = (time - req->from) / req->step;
+                min = max = sum = value;
+            } else {
+                if (value < min)
+                    min = value;
+                if (value > max)
+                    max = value;
+                sum += value;
+            }
+            count++;
+        }
+    }
+    history_rollup(&tb, req->from + bucket * req->step, min, max, sum, count);
+    text_printf(&tb, "]");
+    if (more != 0)
+        text_printf(&tb, ",\"more\":%llu", (unsigned long long)more);
+    text_printf(&tb, "}}");
+    metric_add(&publishstats.historyqueries, 1);
+    publish_message(topic, payload, tb.len, 0);
+}
+
+/*
+ * Answer the pending history queries
+ */
+static void history_serve( void ) {
+    struct historyrequest   requests[HISTORY_MAXREQUESTS];
+    int32_t                 device;
+    int                     count;
+    int                     idx;
+
+    pthread_mutex_lock(&historyrequests.lock);
+    count = historyrequests.count;
+    memcpy(requests, historyrequests.requests, count * sizeof(struct historyrequest));
+    historyrequests.count = 0;
+    atomic_store(&historyrequests.pending, 0);
+    pthread_mutex_unlock(&historyrequests.lock);
+
+    for (idx = 0; idx < count; idx++)
+        if ((device = pubtable->bygroup[requests[idx].daddr]) != DEVICE_NONE)
+            history_answer(&pubtable->devices[device], &requests[idx]);
+}
+
+/*
+ * Move to the current device table, called by the publish thread inside a read
+ * section. The publish state of devices on the same group address is kept, the
+ * reload thread frees the old table only after this.
+ */
+static void devicetable_adopt( struct devicetable *table ) {
+    struct devicetable      *old = pubtable;
+    int32_t                 device;
+    int                     idx;
+
+    if (old != NULL) {
+        for (idx = 0; idx < table->count; idx++)
+            if ((device = old->bygroup[table->devices[idx].daddr]) != DEVICE_NONE)
+                table->state[idx] = old->state[device];
+    }
+    pubtable = table;
+    poll_schedule(table, monotonic_ns());
+    atomic_store(&adopted, table);
+}
+
+/*
+ * Reload thread
+ *
+ * waits for SIGHUP, which every other thread blocks, and replaces the device table
+ * when the configuration file reads without problems
+ */
+static void *devicetable_reloader( void *arg ) {
+    struct timespec         pause = { 0, 1000000 };
+    struct devicetable      *table;
+    struct devicetable      *old;
+    sigset_t                hangup;
+    int                     sig;
+
+    sigemptyset(&hangup);
+    sigaddset(&hangup, SIGHUP);
+    for (;;) {
+        if (sigwait(&hangup, &sig) != 0)
+            continue;
+        if (configuration.devicedb[0] != '\0') {
+            log_info("Reloading devices from %s\n", configuration.devicedb);
+            table = devicedb_map(configuration.devicedb);
+        } else {
+            log_info("Reloading devices from %s\n", configuration.configfile);
+            table = devicetable_load(configuration.configfile);
+        }
+        if (table == NULL) {
+            log_error("Reload rejected, keeping the running device table\n");
+            continue;
+        }
+        old = atomic_exchange(&configuration.devices, table);
+        // the publisher takes over the publish state before the old table can go
+        publisher_wakeup();
+        while (atomic_load(&adopted) != table)
+            nanosleep(&pause, NULL);
+        rcu_synchronize();
+        devicetable_free(old);
+        log_info("Device table reloaded, %d devices\n", table->count);
+    }
+    return NULL;
+}
+
+/*
+ * Publish thread
+ *
+ * takes telegrams from the rings of all lines and publishes them, reports telegrams
+ * the receive threads had to drop because a ring was full
+ */
+static void *mqtt_publisher( void *arg ) {
+    struct devicetable      *table;
+    struct telegram         *tg;
+    struct busline          *line;
+    unsigned long           overflow;
+    uint64_t                now;
+    long                    wait;
+    int                     taken;
+    int                     idx;
+    int                     n;
+
+    for (;;) {
+        // the table is held from here to the end of the bursts
+        rcu_read_lock();
+        if ((table = devicetable_get()) != pubtable)
+            devicetable_adopt(table);
+        now = monotonic_ns();
+        device_heartbeats(now);
+        wait = (configuration.batch > 0) ? batch_due(now) : 100;
+        if (spool.dir != NULL)
+            spool_unsent();
+        if (spool.dir != NULL && (spool.pending > 0 || spool.dropped != spool.reported)) {
+            long spoolwait = spool_drain(now);
+            if (spoolwait < wait)
+                wait = spoolwait;
+        }
+        if (atomic_load(&staterequests.pending))
+            state_serve();
+        if (atomic_load(&historyrequests.pending))
+            history_serve();
+        if (spool.dir != NULL) {
+            metric_set(&publishstats.spoolpending, spool.pending);
+            metric_set(&publishstats.spooldropped, spool.dropped);
+        }
+        if (configuration.statsinterval > 0) {
+            long statswait = stats_publish(now);
+            if (statswait < wait)
+                wait = statswait;
+        }
+        if (configuration.busload > 0) {
+            long loadwait = busload_publish(now);
+            if (loadwait < wait)
+                wait = loadwait;
+        }
+        if (polls.count > 0) {
+            long pollwait = poll_advance(now);
+            if (pollwait < wait)
+                wait = pollwait;
+        }
+        // a burst from every line in turn, so a busy line does not hold up the others
+        taken = 0;
+        for (idx = 0; idx < buses.count; idx++) {
+            line = &buses.lines[idx];
+            for (n = 0; n < BUS_BURST && (tg = telegramring_peek(&line->ring)) != NULL; n++) {
+                if (configuration.busload > 0)
+                    busload_count(&line->load, tg);
+                publish_telegram(tg, idx);
+                telegramring_release(&line->ring);
+            }
+            taken += n;
+        }
+        rcu_read_unlock();
+        if (taken > 0)
+            continue;
+        for (idx = 0; idx < buses.count; idx++) {
+            line = &buses.lines[idx];
+            overflow = atomic_load(&line->ring.overflow);
+            if (overflow != line->reported) {
+                log_error("Telegram ring of line %s full, %lu telegrams dropped\n", line->name, overflow - line->reported);
+                line->reported = overflow;
+            }
+        }
+        if (atomic_load(&receiver_done))
+            break;
+        publisher_wait(wait);
+    }
+    if (configuration.batch > 0)
+        batch_flush();
+    if (spool.dir != NULL) {
+        spool_unsent();
+        spool_close();
+    }
+    if (bench)
+        atomic_fetch_add(&benchmark.monitorcpu, threadcpu_ns());
+    return NULL;
+}
+
+int main( int argc, char **argv ) {
+    int                     enmx_version = 0;
     int                     c;
-    int                     total = -1;
-    int                     count = 0;
-    int                     spaces = 1;
     char                    *user = NULL;
     char                    *configfile = NULL;
+    char                    *logpath = NULL;
     char                    pwd[255];
     char                    *target;
-    char                    *eis_types;
-    int                     hour;
-    int                     minute;
-    int                     seconds;
-    unsigned char           value[20];
-    uint32_t                *p_int = 0;
-    double                  *p_real;
-
-    MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
-    MQTTClient_message pubmsg = MQTTClient_message_initializer;
-    MQTTClient_deliveryToken token;
-    int                      rc;
-    char                     payload[1024];
-    char                     topic[1024];
-    char                     buffer[255];
-    struct device            *actual;
-    char                     *subscription = strdup("iot-2/type/HomeGateway/id/HomePi3/cmd/+/fmt/+");
-
-    logfile = stdout;
-    setvbuf(stdout, NULL, _IONBF, 0);
-    setvbuf(logfile, NULL , _IONBF, 0);
+    char                    *bustarget = NULL;
+    char                    *etsexport = NULL;
+    char                    knxtarget[300];
+    struct busline          *line;
+    int                     idx;
+    int                     rc;
+    pthread_t               publisher;
+    pthread_t               reloader;
+    sigset_t                hangup;
+    MQTTAsync_disconnectOptions disc_opts = MQTTAsync_disconnectOptions_initializer;
+    static struct option    longopts[] = {
+        { "capture", required_argument, NULL, 'w' },
+        { "replay",  required_argument, NULL, 'r' },
+        { "fast",    no_argument,       NULL, 'F' },
+        { "bench",   no_argument,       NULL, 'b' },
+        { "routing", optional_argument, NULL, 'R' },
+        { "tunnel",  required_argument, NULL, 'T' },
+        { "ets-import", required_argument, NULL, 'E' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    // SIGHUP reloads the devices, it is taken by sigwait() in the reload thread only
+    sigemptyset(&hangup);
+    sigaddset(&hangup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hangup, NULL);
+
+    atexit(log_close);
     opterr = 0;
-    while( ( c = getopt( argc, argv, "c:u:f:l:q" )) != -1 ) {
+    while( ( c = getopt_long( argc, argv, "c:u:f:l:qw:r:b", longopts, NULL )) != -1 ) {
         switch( c ) {
+            case 'w':
+                if (capture_open(&capture, optarg) != 0) {
+                  log_error("Can not write to capture file %s: %s\n", optarg, strerror( errno ));
+                  exit( -1 );
+                }
+                break;
+            case 'r':
+                replayfile = strdup( optarg );
+                break;
+            case 'F':
+                replayfast = 1;
+                break;
+            case 'b':
+                bench = 1;
+                break;
+            case 'R':
+                snprintf( knxtarget, sizeof(knxtarget), optarg ? "routing=%s" : "routing", optarg );
+                bustarget = knxtarget;
+                break;
+            case 'T':
+                snprintf( knxtarget, sizeof(knxtarget), "tunnel=%s", optarg );
+                bustarget = knxtarget;
+                break;
+            case 'E':
+                etsexport = strdup( optarg );
+                break;
             case 'c':
                 total = atoi( optarg );
                 break;
@@ -461,17 +6469,13 @@ int main( int argc, char **argv ) {
                 configfile = strdup(optarg);
                 break;
             case 'l':
-                logfile = fopen (optarg, "a");
-                if (logfile == NULL) {
-                  fprintf(logfile, "Can not write to logfile %s\n", optarg );
-                  logfile = stdout;
-                }
+                logpath = strdup( optarg );
                 break;
             case 'q':
-                quiet = 1;
+                logger.level = LEVEL_INFO;
                 break;
             default:
-                fprintf(logfile, "Invalid option: %c\n", c );
+                fprintf(stdout, "Invalid option: %c\n", c );
                 Usage( argv[0] );
                 exit( -1 );
         }
@@ -484,293 +6488,233 @@ int main( int argc, char **argv ) {
         Usage(argv[0] );
         exit( -1 );
     }
-    configuration.devicelist = NULL;
+    if( bustarget == NULL )
+        bustarget = target;
+    log_open(logpath);
+    configuration.devices = NULL;
+    configuration.commandqueue = COMMAND_QUEUESIZE;
+    configuration.writebudget = COMMAND_BUDGET;
+    configuration.confirmtimeout = CONFIRM_TIMEOUT;
+    configuration.confirmretries = CONFIRM_RETRIES;
+    configuration.telegramring = TELEGRAM_RINGSIZE;
+    configuration.maxinflight = MQTT_MAXINFLIGHT;
+    configuration.loglevel = -1;
+    configuration.spoolrate = SPOOL_RATE;
     strcpy(configuration.solar_ip,"");
-    strcpy(configuration.eibd_ip,target);
+    // the line of the command line comes first, BUS= lines add more
+    if (replayfile != NULL)
+       buses.lines[bus_add("replay", replayfile)].mode = BUS_REPLAY;
+    else if (bustarget != NULL)
+       bus_add("default", bustarget);
     read_configfile(configfile,&configuration);
+    if (etsexport != NULL) {
+       if (configuration.devicedb[0] == '\0') {
+          log_error("No DEVICEDB in %s to import %s to\n", configuration.configfile, etsexport);
+          exit( -1 );
+       }
+       exit( (devicedb_import(etsexport, configuration.devices, configuration.devicedb) == 0) ? 0 : -1 );
+    }
+    if (configuration.devicedb[0] != '\0') {
+       struct devicetable *table = devicedb_map(configuration.devicedb);
+
+       if (table != NULL) {
+          devicetable_free(configuration.devices);
+          configuration.devices = table;
+          log_info("%d devices from %s\n", table->count, configuration.devicedb);
+       } else {
+          log_error("Using the DEVICE lines of %s\n", configuration.configfile);
+       }
+    }
+    if (buses.count == 0) {
+       Usage(argv[0] );
+       exit( -1 );
+    }
+    // -q limits the configured level to info
+    if (configuration.loglevel >= 0 && configuration.loglevel < logger.level)
+       logger.level = configuration.loglevel;
+    log_rotation(configuration.logsize, configuration.logfiles);
+    if (configuration.commandqueue < 1)
+       configuration.commandqueue = COMMAND_QUEUESIZE;
+    if (configuration.maxinflight < 1)
+       configuration.maxinflight = MQTT_MAXINFLIGHT;
+    if (configuration.batch > 0)
+       batch_init();
+    if (configuration.spooldir[0] != '\0') {
+       spool.dir = configuration.spooldir;
+       spool.segsize = (configuration.spoolsegment > 4096) ? configuration.spoolsegment : SPOOL_SEGMENT;
+       spool.maxsize = (configuration.spoolsize > 0) ? configuration.spoolsize : SPOOL_MAXSIZE;
+       spool.rate = (configuration.spoolrate >= 0) ? configuration.spoolrate : SPOOL_RATE;
+       spool_open();
+    }
+    if (configuration.feed[0] != '\0' && feed_create(&feed, configuration.feed,
+                                                      (configuration.feedslots > 0) ? configuration.feedslots : FEED_SLOTS) != 0) {
+       log_error("Can not create telegram feed %s: %s\n", configuration.feed, strerror( errno ));
+       exit( -1 );
+    }
+    window_init(configuration.maxinflight, spool.dir != NULL);
+    if (configuration.timeout <= 0)
+       configuration.timeout = 10000L;
+    for (idx = 0; idx < buses.count; idx++) {
+       commandqueue_init(&buses.lines[idx].commands, configuration.commandqueue);
+       telegramring_init(&buses.lines[idx].ring, configuration.telegramring);
+       pthread_mutex_init(&buses.lines[idx].confirms.lock, NULL);
+       pthread_mutex_init(&buses.lines[idx].reads.lock, NULL);
+       pthread_cond_init(&buses.lines[idx].reads.wakeup, NULL);
+    }
+
+    if (configuration.mqttversion == MQTTVERSION_5) {
+        MQTTAsync_createOptions create_opts = MQTTAsync_createOptions_initializer5;
 
-    rc = MQTTClient_create(&client, configuration.address, configuration.clientid,MQTTCLIENT_PERSISTENCE_NONE, NULL);
-    if (! quiet) {
-       fprintf(logfile, "MQTTClient created with return code %i\n",rc);
-       fprintf(logfile, "address %s\n",configuration.address );
-       fprintf(logfile, "clientid %s\n",configuration.clientid );
+        rc = MQTTAsync_createWithOptions(&client, configuration.address, configuration.clientid, MQTTCLIENT_PERSISTENCE_NONE, NULL,
+                                         &create_opts);
+    } else {
+        rc = MQTTAsync_create(&client, configuration.address, configuration.clientid,MQTTCLIENT_PERSISTENCE_NONE, NULL);
     }
+    log_trace("MQTTAsync created with return code %i\n",rc);
+    log_trace("address %s\n",configuration.address );
+    log_trace("clientid %s\n",configuration.clientid );
  	  conn_opts.keepAliveInterval = 3000;
  	  conn_opts.cleansession = 1;
  	  conn_opts.username = strdup(configuration.username);
  	  conn_opts.password = strdup(configuration.password);
     conn_opts.retryInterval = 1;
-    if (! quiet) {
-       fprintf(logfile, "username %s\n",conn_opts.username );
-       fprintf(logfile, "password %s\n",conn_opts.password );
+    conn_opts.maxInflight = configuration.maxinflight;
+    conn_opts.automaticReconnect = 1;
+    conn_opts.onFailure = connectfailed;
+    if (configuration.mqttversion == MQTTVERSION_5) {
+        // a clean start replaces the clean session of 3.1.1, the callbacks get the v5 reason codes
+        conn_opts.MQTTVersion = MQTTVERSION_5;
+        conn_opts.cleansession = 0;
+        conn_opts.cleanstart = 1;
+        conn_opts.onFailure = NULL;
+        conn_opts.onSuccess5 = connectsucceeded5;
+        conn_opts.onFailure5 = connectfailed5;
     }
-	  MQTTClient_setCallbacks(client, NULL, connlost, msgarrvd, delivered);
+    log_trace("username %s\n",conn_opts.username );
+    log_trace("password %s\n",conn_opts.password );
+    log_trace("maximum in-flight messages %d\n",conn_opts.maxInflight );
+	  MQTTAsync_setCallbacks(client, NULL, connlost, msgarrvd, NULL);
+    MQTTAsync_setConnected(client, NULL, connected);
 
-    if ((rc = MQTTClient_connect(client, &conn_opts)) != MQTTCLIENT_SUCCESS)  {
- 	  	  fprintf(logfile, "Failed to connect to MQTT, return code %d\n", rc);
+    if ((rc = MQTTAsync_connect(client, &conn_opts)) != MQTTASYNC_SUCCESS)  {
+ 	  	  log_error("Failed to start MQTT connect, return code %d\n", rc);
  		    exit(-1);
  	  }
 
-    MQTTClient_subscribe(client, subscription, 0);
+    // wait for the outcome of the first connect, later reconnects are automatic
+    pthread_mutex_lock(&window.lock);
+    while (window.connected == 0)
+        pthread_cond_wait(&window.changed, &window.lock);
+    pthread_mutex_unlock(&window.lock);
+    if (window.connected < 0)
+        exit(-1);
 
     // catch signals for shutdown
     signal( SIGINT, Shutdown );
     signal( SIGTERM, Shutdown );
 
-    // request monitoring connection
-    if( (enmx_version = enmx_init()) != ENMX_VERSION_API ) {
-        fprintf(logfile, "Incompatible eibnetmux API version (%d, expected %d)\n", enmx_version, ENMX_VERSION_API );
-        exit( -8 );
-    }
-    sock_con = enmx_open( target, "BlueHouse" );
-    if( sock_con < 0 ) {
-        fprintf(logfile, "Connect to eibnetmux failed (%d): %s\n", sock_con, enmx_errormessage( sock_con ));
-        exit( -2 );
-    }
-
-    // authenticate
-    if( user != NULL ) {
+    // authenticate on every eibnetmux line with the same password
+    if( user != NULL && replayfile == NULL ) {
         if( getpassword( pwd ) != 0 ) {
-            fprintf(logfile, "Error reading password - cannot continue\n" );
+            log_error("Error reading password - cannot continue\n" );
             exit( -6 );
         }
-        if( enmx_auth( sock_con, user, pwd ) != 0 ) {
-            fprintf(logfile, "Authentication failure\n" );
-            exit( -3 );
-        }
     }
-    if( quiet == 0 ) {
-        fprintf(logfile, "Connection to eibnetmux %s established\n", enmx_gethost( sock_con ));
+    for( idx = 0; idx < buses.count; idx++ ) {
+        line = &buses.lines[idx];
+        if( line->mode == KNXIP_ROUTING || line->mode == KNXIP_TUNNELLING ) {
+            if( knxip_open( &line->knx, line->mode, line->target, configuration.knxaddress ) != 0 ) {
+                log_error("Connect to KNX IP %s %s failed: %s\n", line->mode == KNXIP_ROUTING ? "router" : "interface", line->target,
+                          line->knx.error );
+                exit( -2 );
+            }
+            log_info("Connection to KNX IP %s %s established\n", line->mode == KNXIP_ROUTING ? "router" : "interface", line->target );
+        } else if( line->mode == BUS_EIBNETMUX ) {
+            // request monitoring connection, the library is initialized once
+            if( enmx_version != ENMX_VERSION_API && (enmx_version = enmx_init()) != ENMX_VERSION_API ) {
+                log_error("Incompatible eibnetmux API version (%d, expected %d)\n", enmx_version, ENMX_VERSION_API );
+                exit( -8 );
+            }
+
+            line->sock_con = enmx_open( line->target, "BlueHouse" );
+            if( line->sock_con < 0 ) {
+                log_error("Connect to eibnetmux %s failed (%d): %s\n", line->target, line->sock_con, enmx_errormessage( line->sock_con ));
+                exit( -2 );
+            }
+            if( user != NULL && enmx_auth( line->sock_con, user, pwd ) != 0 ) {
+                log_error("Authentication failure on %s\n", line->target );
+                exit( -3 );
+            }
+            log_info("Connection to eibnetmux %s established\n", enmx_gethost( line->sock_con ));
+        }
+
+        // start command executor, it opens its own eibnetmux connection on the first command
+        if (thread_start(&line->executor, command_executor, line) != 0) {
+            log_error("Can not start command executor: %s\n", strerror( errno ));
+            exit( -1 );
+        }
+        // and the group reader, which does the same on the first read
+        if (line->mode == BUS_EIBNETMUX && thread_start(&line->reader, groupread_thread, line) != 0) {
+            log_error("Can not start group reader: %s\n", strerror( errno ));
+            exit( -1 );
+        }
     }
 
-    buf = malloc( 10 );
-    buflen = 10;
     if( total != -1 ) {
         spaces = floor( log10( total )) +1;
     }
 
-   fflush(logfile);
-
-    while( total == -1 || count < total ) {
-        buf = enmx_monitor( sock_con, 0xffff, buf, &buflen, &value_size );
-        if( buf == NULL ) {
-            switch( enmx_geterror( sock_con )) {
-                case ENMX_E_COMMUNICATION:
-                case ENMX_E_NO_CONNECTION:
-                case ENMX_E_WRONG_USAGE:
-                case ENMX_E_NO_MEMORY:
-                    fprintf(logfile, "Error on write: %s\n", enmx_errormessage( sock_con ));
-                    enmx_close( sock_con );
-                    exit( -4 );
-                    break;
-                case ENMX_E_INTERNAL:
-                    fprintf(logfile, "Bad status returned\n" );
-                    break;
-                case ENMX_E_SERVER_ABORTED:
-                    fprintf(logfile, "EOF reached: %s\n", enmx_errormessage( sock_con ));
-                    enmx_close( sock_con );
-                    exit( -4 );
-                    break;
-                case ENMX_E_TIMEOUT:
-                    fprintf(logfile, "No value received\n" );
-                    break;
-            }
-        } else {
-            count++;
-            cemiframe = (CEMIFRAME *) buf;
-            gettimeofday( &tv, NULL );
-            ltime = localtime( &tv.tv_sec );
-            fprintf(logfile,  "EIB: " );
-            if( total != -1 ) {
-                fprintf(logfile,  "%*d: ", spaces, count );
-            }
-            fprintf(logfile, "%04d/%02d/%02d %02d:%02d:%02d:%03d - ",
-                       ltime->tm_year + 1900, ltime->tm_mon +1, ltime->tm_mday,
-                       ltime->tm_hour, ltime->tm_min, ltime->tm_sec, (uint32_t)tv.tv_usec / 1000 );
-            fprintf(logfile,  "%8s  ", knx_physical( cemiframe->saddr ));
-            if( cemiframe->code == L_DATA_REQ ) {
-                fprintf(logfile,  "REQ " );
-            } else if( cemiframe->code == L_DATA_CON ) {
-                fprintf(logfile,  "CON " );
-            } else if( cemiframe->code == L_DATA_IND ) {
-                fprintf(logfile,  "IND " );
-            } else if( cemiframe->code == L_BUSMON_IND ) {
-                fprintf(logfile,  "MON " );
-            } else {
-                fprintf(logfile,  " %02x ", cemiframe->code );
-            }
-            if( cemiframe->ctrl & EIB_CTRL_PRIO_LOW ) {
-                fprintf(logfile,  "low" );
-            } else if( cemiframe->ctrl & EIB_CTRL_PRIO_HIGH ) {
-                    fprintf(logfile,  "hgh" );
-            } else if( cemiframe->ctrl & EIB_CTRL_PRIO_SYSTEM ) {
-                    fprintf(logfile,  "sys" );
-            } else if( cemiframe->ctrl & EIB_CTRL_PRIO_ALARM ) {
-                    fprintf(logfile,  "alm" );
-            }
-            if( cemiframe->ctrl & EIB_CTRL_REPEAT ) {
-                fprintf(logfile,  " r" );
-            } else {
-                fprintf(logfile,  "  " );
-            }
-            if( cemiframe->ctrl & EIB_CTRL_ACK ) {
-                fprintf(logfile,  "k " );
-            } else {
-                fprintf(logfile,  "  " );
-            }
-            if( cemiframe->apci & A_WRITE_VALUE_REQ ) {
-                fprintf(logfile,  "W " );
-            } else if( cemiframe->apci & A_RESPONSE_VALUE_REQ ) {
-                fprintf(logfile,  "A " );
-            } else {
-                fprintf(logfile,  "R " );
-            }
-            fprintf(logfile,  "%8s", (cemiframe->ntwrk & EIB_DAF_GROUP) ? knx_group( cemiframe->daddr ) : knx_physical( cemiframe->daddr ));
-            if( cemiframe->apci & (A_WRITE_VALUE_REQ | A_RESPONSE_VALUE_REQ) ) {
-                fprintf(logfile,  " : " );
-                p_int = (uint32_t *)value;
-                p_real = (double *)value;
-                switch( cemiframe->length ) {
-                    case 1:     // EIS 1, 2, 7, 8
-                        enmx_frame2value( 1, cemiframe, value );
-                        fprintf(logfile, "%s | ", (*p_int == 0) ? "off" : "on" );
-                        sprintf(buffer,"%s",(*p_int == 0) ? "0" : "1" );
-                        enmx_frame2value( 2, cemiframe, value );
-                        fprintf(logfile,  "%d | ", *p_int );
-                        enmx_frame2value( 7, cemiframe, value );
-                        fprintf(logfile,  "%d | ", *p_int );
-                        enmx_frame2value( 8, cemiframe, value );
-                        fprintf(logfile,  "%d", *p_int );
-                        eis_types = "1, 2, 7, 8";
-                        break;
-                    case 2:     // 6, 13, 14
-                        enmx_frame2value( 6, cemiframe, value );
-                        fprintf(logfile,  "%d%% | %d", *p_int * 100 / 255, *p_int );
-                        sprintf(buffer,"%d%%", *p_int * 100 / 255);
-                        enmx_frame2value( 13, cemiframe, value );
-                        if( *p_int >=  0x20 && *p_int < 0x7f ) {
-                            fprintf(logfile,  " | %c", *p_int );
-                            eis_types = "6, 14, 13";
-                        } else {
-                            eis_types = "6, 14";
-                        }
-                        break;
-                    case 3:     // 5, 10
-                        enmx_frame2value( 5, cemiframe, value );
-                        fprintf(logfile,  "%.2f | ", *p_real );
-                        sprintf(buffer,"%.2f", *p_real );
-                        enmx_frame2value( 10, cemiframe, value );
-                        fprintf(logfile,  "%d", *p_int );
-                        eis_types = "5, 10";
-                        break;
-                    case 4:     // 3, 4
-                        enmx_frame2value( 3, cemiframe, value );
-                        seconds = *p_int;
-                        hour = seconds / 3600;
-                        seconds %= 3600;
-                        minute = seconds / 60;
-                        seconds %= 60;
-                        fprintf(logfile,  "%02d:%02d:%02d | ", hour, minute, seconds );
-                        sprintf(buffer, "%02d:%02d:%02d", hour, minute, seconds );
-                        enmx_frame2value( 4, cemiframe, value );
-                        ltime = localtime( (time_t *)p_int );
-                        if( ltime != NULL ) {
-                            fprintf(logfile,  "%04d/%02d/%02d", ltime->tm_year + 1900, ltime->tm_mon +1, ltime->tm_mday );
-                        } else {
-                            fprintf(logfile,  "inval date" );
-                        }
-                        eis_types = "3, 4";
-                        break;
-                    case 5:     // 9, 11, 12
-                        enmx_frame2value( 11, cemiframe, value );
-                        fprintf(logfile, "%d | ", *p_int );
-                        sprintf(buffer, "%d", *p_int );
-                        enmx_frame2value( 9, cemiframe, value );
-                        fprintf(logfile,  "%.2f", *p_real );
-                        enmx_frame2value( 12, cemiframe, value );
-                        fprintf(logfile,  "12: <->" );
-                        eis_types = "9, 11, 12";
-                        break;
-                    default:    // 15
-                        // fprintf(logfile,  "%s", string );
-                        eis_types = "15";
-                        break;
-                }
-                if( cemiframe->length == 1 ) {
-                    fprintf(logfile,  " (%s", hexdump( &cemiframe->apci, 1, 1 ));
-                } else {
-                    fprintf(logfile,  " (%s", hexdump( (unsigned char *)(&cemiframe->apci) +1, cemiframe->length -1, 1 ));
-                }
-                fprintf(logfile,  " - eis types: %s)", eis_types );
-            }
-            fprintf(logfile,  "\n" );
-
-            // search device in the list of devices
-            actual = configuration.devicelist;
-            char knxaddres [16];
-            strcpy(knxaddres,knx_group(cemiframe->daddr));
-            while ((strcmp(actual->knx,knxaddres) != 0) && (actual->next)){
-                actual = actual->next;
-            }
+    if (configuration.metrics[0] != '\0')
+        metrics_start(configuration.metrics);
 
-            // if device is found
-            if(strcmp(actual->knx,knxaddres) == 0) {
-            strcpy(topic,"iot-2/type/");
-            strcat(topic,actual->event);
-            strcat(topic,"/id/");
-            strcat(topic,actual->name);
-            strcat(topic,"/evt/");
-            strcat(topic,actual->type);
-            strcat(topic,"/fmt/json");
-            // #define TOPIC       "iot-2/type/Temperature/id/Boiler/evt/Measurement/fmt/json"
-            strcpy(payload,"{\"d\":{\"value\":\"");
-            strcat(payload,buffer);
-            strcat(payload,"\",\"date\":\"");
-            sprintf(buffer,"%04d/%02d/%02d",ltime->tm_year + 1900, ltime->tm_mon +1, ltime->tm_mday);
-            strcat(payload,buffer);
-            strcat(payload,"\",\"time\":\"");
-            sprintf(buffer,"%02d:%02d:%02d",ltime->tm_hour, ltime->tm_min, ltime->tm_sec);
-            strcat(payload,buffer);
-            strcat(payload,"\"}}");
-            // #define PAYLOAD     "{\"d\":{\"value\":\"42.00\",\"date\":\"2016-07-19\",\"time\":\"15:55:29\"}}"
-            if (! quiet) {
-              fprintf(logfile,"Published topic: %s\n",topic);
-              fprintf(logfile,"Published payload: %s\n",payload);
-            }
-            pubmsg.payload = payload;
-          	pubmsg.payloadlen = strlen(payload);
-         	  pubmsg.qos = configuration.qos;
-         	  pubmsg.retained = 0;
-         //	  deliveredtoken = 0;
-
-         	  rc = MQTTClient_publishMessage(client, topic, &pubmsg, &token);
-            if (rc) {
-                fprintf(logfile, "Published to MQTT, return code %d\n", rc);
-                sleep(1);
-                if (MQTTClient_isConnected(client) == 0) {
-                  fprintf(logfile, "Reconnecting MQTT Client\n");
-                  if ((rc = MQTTClient_connect(client, &conn_opts)) != MQTTCLIENT_SUCCESS)  {
-          	  	    fprintf(logfile, "Failed to connect to MQTT, return code %d\n", rc);
-          		      exit(-1);
-          	      }
-                  MQTTClient_subscribe(client, subscription, 0);
-                }
-                rc = MQTTClient_publishMessage(client, topic, &pubmsg, &token);
-                fprintf(logfile, "Retry published to MQTT and return code %d\n", rc);
-            }
-}
-fflush(logfile);
+    // bus telegrams are received by a thread per line and published by one thread
+    benchmark.start = monotonic_ns();
+    if (thread_start(&publisher, mqtt_publisher, NULL) != 0) {
+        log_error("Can not start bus threads: %s\n", strerror( errno ));
+        exit( -1 );
+    }
+    if (thread_start(&reloader, devicetable_reloader, NULL) == 0)
+        pthread_detach(reloader);
+    else
+        log_error("Can not start reload thread, SIGHUP is ignored: %s\n", strerror( errno ));
+    buses.running = buses.count;
+    for (idx = 0; idx < buses.count; idx++) {
+        line = &buses.lines[idx];
+        if (thread_start(&line->receiver, line->mode == BUS_REPLAY ? replay_receiver :
+                         line->mode == BUS_EIBNETMUX ? bus_receiver : knxip_receiver, line) != 0) {
+            log_error("Can not start bus threads: %s\n", strerror( errno ));
+            exit( -1 );
         }
     }
+    bus_wait();
+
+    // count or end of replay reached, publish what is still in the rings
+    pthread_mutex_lock(&capturelock);
+    capture_close(&capture);
+    pthread_mutex_unlock(&capturelock);
+    atomic_store(&receiver_done, 1);
+    publisher_wakeup();
+    pthread_join(publisher, NULL);
+    window_drain();
+    if (bench) {
+        for (idx = 0; idx < buses.count; idx++)
+            commandqueue_drain(&buses.lines[idx].commands);
+        benchmark.end = monotonic_ns();
+        bench_report();
+    }
+    for (idx = 0; idx < buses.count; idx++)
+        if (buses.lines[idx].mode == KNXIP_ROUTING || buses.lines[idx].mode == KNXIP_TUNNELLING)
+            knxip_close(&buses.lines[idx].knx);
+    disc_opts.timeout = 10000;
+    MQTTAsync_disconnect(client, &disc_opts);
     return( 0 );
 }
 
 
 /*
- * Return representation of physical device KNX address as string
+ * Write physical device KNX address as string into textual, KNX_ADDRSIZE bytes
  */
-static char *knx_physical( uint16_t phy_addr ) {
-        static char     textual[64];
+static char *knx_physical( uint16_t phy_addr, char *textual ) {
         int             area;
         int             line;
         int             device;
@@ -781,16 +6725,15 @@ static char *knx_physical( uint16_t phy_addr ) {
         line = (phy_addr & 0x0f00) >> 8;
         device = phy_addr & 0x00ff;
 
-        sprintf( textual, "%d.%d.%d", area, line, device );
+        snprintf( textual, KNX_ADDRSIZE, "%d.%d.%d", area, line, device );
         return( textual );
 }
 
 
 /*
- * Return representation of logical KNX group address as string
+ * Write logical KNX group address as string into textual, KNX_ADDRSIZE bytes
  */
-static char *knx_group( uint16_t grp_addr ) {
-        static char     textual[64];
+static char *knx_group( uint16_t grp_addr, char *textual ) {
         int             top;
         int             sub;
         int             group;
@@ -800,6 +6743,6 @@ static char *knx_group( uint16_t grp_addr ) {
         top = (grp_addr & 0x7800) >> 11;
         sub = (grp_addr & 0x0700) >> 8;
         group = grp_addr & 0x00ff;
-        sprintf( textual, "%d/%d/%d", top, sub, group );
+        snprintf( textual, KNX_ADDRSIZE, "%d/%d/%d", top, sub, group );
         return( textual );
 }
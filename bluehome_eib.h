@@ -0,0 +1,284 @@
+/*
+ * bluehome_eib.h - definitions shared by bluehome_eib and its tools
+ *
+ * EIB constants, the cEMI frame as delivered by eibnetmux, decoded values, the
+ * layout of the telegram capture file, spool segments and shared memory telegram
+ * feed, the feed reader (bluehome_feed.c) and the KNXnet/IP client
+ */
+
+#ifndef BLUEHOME_EIB_H
+#define BLUEHOME_EIB_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+/*
+ * EIB constants
+ */
+#define EIB_CTRL_LENGTHTABLE                    0x00
+#define EIB_CTRL_LENGTHBYTE                     0x80
+#define EIB_CTRL_DATA                           0x00
+#define EIB_CTRL_POLL                           0x40
+#define EIB_CTRL_REPEAT                         0x00
+#define EIB_CTRL_NOREPEAT                       0x20
+#define EIB_CTRL_ACK                            0x00
+#define EIB_CTRL_NONACK                         0x10
+#define EIB_CTRL_PRIO_LOW                       0x0c
+#define EIB_CTRL_PRIO_HIGH                      0x04
+#define EIB_CTRL_PRIO_ALARM                     0x08
+#define EIB_CTRL_PRIO_SYSTEM                    0x00
+#define EIB_NETWORK_HOPCOUNT                    0x70
+#define EIB_DAF_GROUP                           0x80
+#define EIB_DAF_PHYSICAL                        0x00
+#define EIB_LL_NETWORK                          0x70
+#define T_GROUPDATA_REQ                         0x00
+#define A_READ_VALUE_REQ                        0x0000
+#define A_WRITE_VALUE_REQ                       0x0080
+#define A_RESPONSE_VALUE_REQ                    0x0040
+
+/**
+ * cEMI Message Codes
+ **/
+#define L_BUSMON_IND            0x2B
+#define L_RAW_IND               0x2D
+#define L_RAW_REQ               0x10
+#define L_RAW_CON               0x2F
+#define L_DATA_REQ              0x11
+#define L_DATA_CON              0x2E
+#define L_DATA_IND              0x29
+#define L_POLL_DATA_REQ         0x13
+#define L_POLL_DATA_CON         0x25
+#define M_PROP_READ_REQ         0xFC
+#define M_PROP_READ_CON         0xFB
+#define M_PROP_WRITE_REQ        0xF6
+#define M_PROP_WRITE_CON        0xF5
+#define M_PROP_INFO_IND         0xF7
+#define M_RESET_REQ             0xF1
+#define M_RESET_IND             0xF0
+
+/*
+ * EIB request frame
+ */
+typedef struct __attribute__((packed)) {
+        uint8_t  code;
+        uint8_t  zero;
+        uint8_t  ctrl;
+        uint8_t  ntwrk;
+        uint16_t saddr;
+        uint16_t daddr;
+        uint8_t  length;
+        uint8_t  tpci;
+        uint8_t  apci;
+        uint8_t  data[16];
+} CEMIFRAME;
+
+/*
+ * Decoded telegram value
+ */
+#define VALUE_NONE              0
+#define VALUE_BOOL              1
+#define VALUE_INT               2
+#define VALUE_PERCENT           3
+#define VALUE_FLOAT             4
+#define VALUE_TIME              5       // seconds since midnight
+#define VALUE_DATE              6       // time_t
+#define VALUE_CHAR              7
+#define VALUE_STRING            8
+#define VALUE_SINT              9       // v.i holds a two's complement signed integer
+
+typedef struct value {
+        int             type;
+        union {
+                uint32_t        i;
+                double          f;
+                char            s[16];
+        } v;
+} value;
+
+/*
+ * Telegram capture file
+ *
+ * a header followed by records holding a monotonic timestamp, the length and the
+ * raw cEMI bytes as delivered by eibnetmux. The file grows in chunks which are
+ * mapped one at a time; a record never crosses a chunk, the rest of a chunk is
+ * skipped with a CAPTURE_SKIP record. A zero length ends the capture, the file is
+ * truncated to its real size when the gateway stops.
+ */
+#define CAPTURE_MAGIC           "BHCAPTUR"
+#define CAPTURE_VERSION         1
+#define CAPTURE_CHUNK           (1024 * 1024)
+#define CAPTURE_SKIP            0xffff
+#define CAPTURE_ALIGN(len)      (((len) + 7) & ~7)
+
+typedef struct __attribute__((packed)) captureheader {
+        char            magic[8];
+        uint32_t        version;
+        uint32_t        headersize;
+        uint64_t        created;            // wall clock seconds
+} captureheader;
+
+typedef struct __attribute__((packed)) capturerecord {
+        uint64_t        timestamp;          // CLOCK_MONOTONIC nanoseconds
+        uint16_t        length;
+        unsigned char   data[];
+} capturerecord;
+
+/*
+ * Store-and-forward spool segment
+ *
+ * messages that can not be published are appended to fixed size segment files
+ * spool-<sequence>.seg in the spool directory. A segment is a header followed by
+ * records holding the topic and the payload, a zero length ends the segment. The
+ * header keeps the offset of the oldest record not yet sent, after a restart the
+ * spool is sent again from there.
+ */
+#define SPOOL_MAGIC             "BHSPOOL "
+#define SPOOL_VERSION           1
+#define SPOOL_ALIGN(len)        (((len) + 7) & ~7)
+
+typedef struct __attribute__((packed)) spoolheader {
+        char            magic[8];
+        uint32_t        version;
+        uint32_t        headersize;
+        uint64_t        sequence;
+        uint64_t        readpos;            // offset of the first record not yet sent
+} spoolheader;
+
+typedef struct __attribute__((packed)) spoolrecord {
+        uint32_t        length;             // whole record, aligned, written last
+        uint16_t        topiclen;           // including the terminating zero
+        uint16_t        reserved;
+        uint32_t        payloadlen;
+        uint32_t        reserved2;
+        uint64_t        queued;             // wall clock milliseconds
+        char            data[];             // topic, payload
+} spoolrecord;
+
+/*
+ * Shared memory telegram feed
+ *
+ * with FEED=/dev/shm/<name> the publish thread copies every telegram it takes from
+ * the bus, with its device, decoded value and time, into a ring of fixed size slots
+ * in a shared file. Any number of local processes map the file read-only and follow
+ * the ring at their own pace, the gateway never waits for them. A slot is guarded by
+ * its sequence count, odd while the slot is written: seq is 2n+1 during and 2n+2
+ * after record n is written, head is the number of the next record. A reader that
+ * falls more than the ring behind loses the oldest records and is told how many.
+ * Readers waiting for new records sleep on the futex word bell, the gateway wakes
+ * them only when waiters is not zero. A restarted gateway continues the sequence of
+ * a feed file with the same layout.
+ */
+#define FEED_MAGIC              "BHFEED  "
+#define FEED_VERSION            1
+#define FEED_HEADERSIZE         4096        // the slots start on a page of their own
+#define FEED_NAMELEN            32
+#define FEED_CEMILEN            32
+
+typedef struct feedheader {
+        char            magic[8];
+        uint32_t        version;
+        uint32_t        headersize;         // offset of the first slot
+        uint32_t        slotsize;
+        uint32_t        slots;              // a power of two
+        uint64_t        created;            // wall clock seconds
+        _Atomic uint64_t head;              // number of the next record
+        _Atomic uint32_t bell;              // bumped with every record, futex word
+        _Atomic uint32_t waiters;           // readers sleeping on bell
+} feedheader;
+
+typedef struct feedrecord {
+        uint64_t        time;               // wall clock microseconds
+        uint64_t        received;           // CLOCK_MONOTONIC nanoseconds
+        int32_t         device;             // index in the device table, -1 when not configured
+        uint32_t        generation;         // of the device table, changes with every reload
+        uint8_t         line;               // bus line, in the order of the BUS lines
+        uint8_t         eis;                // EIS type the value was decoded with, 16..18 are EIS 14, 10 and 11 signed
+        uint8_t         length;             // bytes in cemi
+        uint8_t         reserved;
+        struct value    val;                // VALUE_NONE when the frame carries no value
+        char            name[FEED_NAMELEN]; // device name, empty when not configured
+        unsigned char   cemi[FEED_CEMILEN]; // raw frame in CEMIFRAME layout
+} feedrecord;
+
+typedef struct feedslot {
+        _Atomic uint64_t seq;
+        struct feedrecord rec;
+} feedslot;
+
+typedef struct feedreader {
+        int             fd;
+        size_t          size;
+        struct feedheader *hdr;
+        struct feedslot *slots;
+        int             writable;           // the file could be opened for writing, waits sleep on bell
+        uint64_t        next;               // number of the next record to read
+        uint64_t        seq;                // sequence count of the record being read
+        unsigned long   lost;               // records overwritten before they were read
+} feedreader;
+
+int                     feed_open( struct feedreader *feed, const char *path, int fromstart );
+const struct feedrecord *feed_read( struct feedreader *feed );
+int                     feed_release( struct feedreader *feed );
+int                     feed_copy( struct feedreader *feed, struct feedrecord *copy );
+int                     feed_wait( struct feedreader *feed, int timeout );
+void                    feed_close( struct feedreader *feed );
+
+/*
+ * KNXnet/IP client (bluehome_knxip.c)
+ *
+ * talks to KNX IP routers and interfaces directly instead of through eibnetmux.
+ * Routing joins the multicast group (or listens on a unicast port), tunnelling
+ * opens a link layer tunnel to one interface. Datagrams are read in batches with
+ * recvmmsg() from a non-blocking socket, cEMI frames are returned in CEMIFRAME
+ * layout. knxip_receive() is called by one thread, knxip_groupwrite() and
+ * knxip_groupread() by another.
+ */
+#define KNXIP_PORT              3671
+#define KNXIP_MULTICAST         "224.0.23.12"
+
+#define KNXIP_ROUTING           1
+#define KNXIP_TUNNELLING        2
+
+/*
+ * KNXnet/IP services
+ */
+#define KNXIP_CONNECT_REQ               0x0205
+#define KNXIP_CONNECT_RES               0x0206
+#define KNXIP_CONNECTIONSTATE_REQ       0x0207
+#define KNXIP_CONNECTIONSTATE_RES       0x0208
+#define KNXIP_DISCONNECT_REQ            0x0209
+#define KNXIP_DISCONNECT_RES            0x020a
+#define KNXIP_TUNNELLING_REQ            0x0420
+#define KNXIP_TUNNELLING_ACK            0x0421
+#define KNXIP_ROUTING_IND               0x0530
+#define KNXIP_ROUTING_LOST              0x0531
+#define KNXIP_ROUTING_BUSY              0x0532
+
+typedef struct knxip {
+        int             mode;
+        int             fd;
+        struct sockaddr_in peer;            // router group or tunnelling interface
+        uint16_t        individual;         // source address of routed frames, network order
+        uint8_t         channel;            // tunnel channel
+        uint8_t         rxseq;              // next expected tunnelling sequence
+        uint8_t         txseq;
+        int             acked;              // last tunnelling request was acknowledged
+        uint64_t        heartbeat;          // monotonic ns of the next connection state request
+        int             missed;             // connection state requests not answered
+        unsigned long   lost;               // frames a router reported lost
+        void            *rx;                // receive batch
+        CEMIFRAME       frame;              // frame with additional info removed
+        const char      *error;
+        pthread_mutex_t lock;               // channel, txseq, acked
+        pthread_cond_t  ack;
+} knxip;
+
+int                     knxip_open( struct knxip *knx, int mode, const char *address, uint16_t individual );
+const unsigned char     *knxip_receive( struct knxip *knx, uint16_t *length, int timeout );
+int                     knxip_groupwrite( struct knxip *knx, uint16_t daddr, const unsigned char *data, int len, int priority );
+int                     knxip_groupread( struct knxip *knx, uint16_t daddr, int priority );
+void                    knxip_close( struct knxip *knx );
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * bluehome_feed - reader of the shared memory telegram feed of bluehome_eib
+ *
+ * maps the feed file written by the gateway (FEED= in bluehome.conf) and follows
+ * its ring. Records are read in place: feed_read() returns the record in shared
+ * memory and feed_release() tells whether it was overwritten while it was used,
+ * feed_copy() does both for a copy. Layout and rules are in bluehome_eib.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "bluehome_eib.h"
+
+#define FEED_POLL               1000000         // ns between looks at a feed that can not be waited on
+
+/*
+ * Map the feed at path, reading starts with the next record or, with fromstart, the
+ * oldest one still in the ring. Returns -1 with errno set when the file is not a feed.
+ */
+int feed_open( struct feedreader *feed, const char *path, int fromstart ) {
+    struct feedheader       *hdr;
+    struct stat             st;
+    uint64_t                head;
+    int                     prot = PROT_READ | PROT_WRITE;
+
+    memset(feed, 0, sizeof(*feed));
+    // the reader only writes waiters, it can follow a feed it may not write without waiting
+    if ((feed->fd = open(path, O_RDWR)) < 0) {
+        if ((feed->fd = open(path, O_RDONLY)) < 0)
+            return -1;
+        prot = PROT_READ;
+    }
+    feed->writable = (prot & PROT_WRITE) != 0;
+    if (fstat(feed->fd, &st) != 0 || st.st_size < FEED_HEADERSIZE) {
+        close(feed->fd);
+        errno = EINVAL;
+        return -1;
+    }
+    feed->size = st.st_size;
+    if ((feed->hdr = mmap(NULL, feed->size, prot, MAP_SHARED, feed->fd, 0)) == MAP_FAILED) {
+        close(feed->fd);
+        return -1;
+    }
+    hdr = feed->hdr;
+    if (memcmp(hdr->magic, FEED_MAGIC, 8) != 0 || hdr->version != FEED_VERSION || hdr->slotsize != sizeof(struct feedslot)
+            || hdr->slots == 0 || (hdr->slots & (hdr->slots - 1)) != 0
+            || hdr->headersize + (size_t)hdr->slots * hdr->slotsize > feed->size) {
+        feed_close(feed);
+        errno = EINVAL;
+        return -1;
+    }
+    feed->slots = (struct feedslot *)((char *)hdr + hdr->headersize);
+    head = atomic_load_explicit(&hdr->head, memory_order_acquire);
+    if (! fromstart)
+        feed->next = head;
+    else if (head > hdr->slots)
+        feed->next = head - hdr->slots;
+    return 0;
+}
+
+/*
+ * The next record in shared memory, NULL when there is none yet. Records the
+ * writer got past first are counted in lost and skipped.
+ */
+const struct feedrecord *feed_read( struct feedreader *feed ) {
+    struct feedheader       *hdr = feed->hdr;
+    struct feedslot         *slot;
+    uint64_t                head;
+
+    for (;;) {
+        head = atomic_load_explicit(&hdr->head, memory_order_acquire);
+        if (feed->next >= head)
+            return NULL;
+        if (head - feed->next > hdr->slots) {
+            feed->lost += head - hdr->slots - feed->next;
+            feed->next = head - hdr->slots;
+        }
+        slot = &feed->slots[feed->next & (hdr->slots - 1)];
+        feed->seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (feed->seq == 2 * feed->next + 2)
+            return &slot->rec;
+        // taken over by a later record since head was read
+        feed->lost++;
+        feed->next++;
+    }
+}
+
+/*
+ * Done with the record of feed_read(), returns 0 when the writer overwrote it
+ * meanwhile: what was read may be torn and should be dropped
+ */
+int feed_release( struct feedreader *feed ) {
+    struct feedslot         *slot = &feed->slots[feed->next & (feed->hdr->slots - 1)];
+    int                     valid;
+
+    atomic_thread_fence(memory_order_acquire);
+    valid = atomic_load_explicit(&slot->seq, memory_order_relaxed) == feed->seq;
+    if (! valid)
+        feed->lost++;
+    feed->next++;
+    return valid;
+}
+
+/*
+ * Copy the next record, 0 when there is none yet
+ */
+int feed_copy( struct feedreader *feed, struct feedrecord *copy ) {
+    const struct feedrecord *rec;
+
+    while ((rec = feed_read(feed)) != NULL) {
+        memcpy(copy, rec, sizeof(*copy));
+        if (feed_release(feed))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Wait up to timeout ms (-1 for ever) for a record, returns 1 when one is there.
+ * Sleeps on the futex of the feed, or looks every millisecond when the feed could
+ * only be opened for reading.
+ */
+int feed_wait( struct feedreader *feed, int timeout ) {
+    struct feedheader       *hdr = feed->hdr;
+    struct timespec         ts;
+    struct timespec         pause = { 0, FEED_POLL };
+    long                    slept = 0;
+    uint32_t                bell;
+
+    if (atomic_load(&hdr->head) > feed->next)
+        return 1;
+    if (! feed->writable) {
+        while (atomic_load(&hdr->head) <= feed->next) {
+            if (timeout >= 0 && slept >= (long)timeout * 1000000)
+                return 0;
+            nanosleep(&pause, NULL);
+            slept += FEED_POLL;
+        }
+        return 1;
+    }
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    // waiters goes up before bell is read, the writer bumps bell before it reads waiters
+    atomic_fetch_add(&hdr->waiters, 1);
+    bell = atomic_load(&hdr->bell);
+    if (atomic_load(&hdr->head) <= feed->next)
+        syscall(SYS_futex, &hdr->bell, FUTEX_WAIT, bell, (timeout >= 0) ? &ts : NULL, NULL, 0);
+    atomic_fetch_sub(&hdr->waiters, 1);
+    return atomic_load(&hdr->head) > feed->next;
+}
+
+void feed_close( struct feedreader *feed ) {
+    if (feed->hdr != NULL && feed->hdr != MAP_FAILED)
+        munmap(feed->hdr, feed->size);
+    if (feed->fd >= 0)
+        close(feed->fd);
+    feed->hdr = NULL;
+    feed->fd = -1;
+}
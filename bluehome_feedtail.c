@@ -0,0 +1,129 @@
+/*
+ * bluehome_feedtail - example consumer of the bluehome_eib telegram feed
+ *
+ * follows the shared memory feed of a gateway started with FEED= and prints every
+ * telegram with its device and value, without a connection to eibnetmux or the
+ * MQTT broker. Records are formatted in place in shared memory.
+ *
+ * requires bluehome_feed.c
+ *   gcc bluehome_feedtail.c bluehome_feed.c -o bluehome_feedtail
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include "bluehome_eib.h"
+
+#define FEEDTAIL_PATH           "/dev/shm/bluehome"
+
+static void Usage( char *progname ) {
+    fprintf(stderr, "Usage: %s [-a] [-c count] [feed]\n"
+                    "  -a       : start with the oldest telegram in the feed instead of the next one\n"
+                    "  -c count : stop after count telegrams\n"
+                    "  feed     : feed file, default %s\n", progname, FEEDTAIL_PATH);
+    exit(-1);
+}
+
+static int format_value( const struct value *val, char *buffer, size_t size ) {
+    switch (val->type) {
+        case VALUE_BOOL:
+        case VALUE_INT:
+        case VALUE_TIME:
+        case VALUE_DATE:
+            return snprintf(buffer, size, "%u", val->v.i);
+        case VALUE_SINT:
+            return snprintf(buffer, size, "%d", (int32_t)val->v.i);
+        case VALUE_PERCENT:
+            return snprintf(buffer, size, "%u%%", val->v.i * 100 / 255);
+        case VALUE_FLOAT:
+            return snprintf(buffer, size, "%.2f", val->v.f);
+        case VALUE_CHAR:
+            return snprintf(buffer, size, "%c", (val->v.i >= 0x20 && val->v.i < 0x7f) ? (char)val->v.i : '?');
+        case VALUE_STRING:
+            return snprintf(buffer, size, "%.*s", (int)sizeof(val->v.s), val->v.s);
+        default:
+            return snprintf(buffer, size, "-");
+    }
+}
+
+/*
+ * One line per telegram, the fields are read from shared memory and only printed
+ * when the record was not overwritten meanwhile
+ */
+static int print_record( struct feedreader *feed, const struct feedrecord *rec ) {
+    char            line[256];
+    char            value[64];
+    struct tm       tm;
+    time_t          sec = rec->time / 1000000;
+    CEMIFRAME       frame;
+    uint16_t        saddr;
+    uint16_t        daddr;
+
+    memset(&frame, 0, sizeof(frame));
+    memcpy(&frame, rec->cemi, (rec->length < sizeof(frame)) ? rec->length : sizeof(frame));
+    saddr = ntohs(frame.saddr);
+    daddr = ntohs(frame.daddr);
+    localtime_r(&sec, &tm);
+    format_value(&rec->val, value, sizeof(value));
+    snprintf(line, sizeof(line), "%04d/%02d/%02d %02d:%02d:%02d.%03u line %u %u.%u.%u -> %u/%u/%u %-16.*s %s\n",
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+             (unsigned)(rec->time % 1000000) / 1000, rec->line,
+             saddr >> 12, (saddr >> 8) & 0x0f, saddr & 0xff,
+             (frame.ntwrk & EIB_DAF_GROUP) ? daddr >> 11 : daddr >> 12,
+             (frame.ntwrk & EIB_DAF_GROUP) ? (daddr >> 8) & 0x07 : (daddr >> 8) & 0x0f, daddr & 0xff,
+             FEED_NAMELEN, rec->device >= 0 ? rec->name : "", value);
+    if (! feed_release(feed))
+        return 0;
+    fputs(line, stdout);
+    return 1;
+}
+
+int main( int argc, char **argv ) {
+    struct feedreader       feed;
+    const struct feedrecord *rec;
+    const char              *path = FEEDTAIL_PATH;
+    unsigned long           lost = 0;
+    long                    count = -1;
+    int                     fromstart = 0;
+    int                     c;
+
+    while ((c = getopt(argc, argv, "ac:")) != -1) {
+        switch (c) {
+            case 'a':
+                fromstart = 1;
+                break;
+            case 'c':
+                count = atol(optarg);
+                break;
+            default:
+                Usage(argv[0]);
+        }
+    }
+    if (optind < argc)
+        path = argv[optind];
+    if (feed_open(&feed, path, fromstart) != 0) {
+        fprintf(stderr, "Can not open telegram feed %s: %s\n", path, strerror(errno));
+        exit(-1);
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    while (count != 0) {
+        while (count != 0 && (rec = feed_read(&feed)) != NULL)
+            if (print_record(&feed, rec) && count > 0)
+                count--;
+        if (feed.lost != lost) {
+            fprintf(stderr, "%lu telegrams lost, the reader fell behind\n", feed.lost - lost);
+            lost = feed.lost;
+        }
+        if (count != 0)
+            feed_wait(&feed, 1000);
+    }
+    feed_close(&feed);
+    return 0;
+}
@@ -0,0 +1,495 @@
+/*
+ * bluehome_knxip - KNXnet/IP routing and tunnelling client for bluehome_eib
+ *
+ * receives cEMI frames from a KNX IP router (routing) or interface (tunnelling)
+ * without the eibnetmux daemon, and writes group values to the bus
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "bluehome_eib.h"
+
+#define KNXIP_BATCH             32              // datagrams per recvmmsg()
+#define KNXIP_DATAGRAM          512
+#define KNXIP_HEADERSIZE        6
+#define KNXIP_CONNECTTIMEOUT    10              // seconds
+#define KNXIP_HEARTBEAT         60              // seconds between connection state requests
+#define KNXIP_MAXMISSED         3
+#define KNXIP_ACKTIMEOUT        1000            // ms a tunnelling request waits for its ack
+
+typedef struct knxipbatch {
+        struct mmsghdr  msgs[KNXIP_BATCH];
+        struct iovec    iov[KNXIP_BATCH];
+        unsigned char   buf[KNXIP_BATCH][KNXIP_DATAGRAM];
+        int             count;                  // datagrams received
+        int             next;                   // next datagram to look at
+} knxipbatch;
+
+static uint64_t knxip_now( void ) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Write the KNXnet/IP header, returns the position after it
+ */
+static unsigned char *knxip_header( unsigned char *buf, uint16_t service, uint16_t length ) {
+    buf[0] = KNXIP_HEADERSIZE;
+    buf[1] = 0x10;                              // protocol version 1.0
+    buf[2] = service >> 8;
+    buf[3] = service & 0xff;
+    buf[4] = length >> 8;
+    buf[5] = length & 0xff;
+    return buf + KNXIP_HEADERSIZE;
+}
+
+/*
+ * Host protocol address information 0.0.0.0:0, the interface answers to the
+ * address the request came from (route back, works through NAT)
+ */
+static unsigned char *knxip_hpai( unsigned char *buf ) {
+    buf[0] = 8;
+    buf[1] = 0x01;                              // UDP
+    memset(buf + 2, 0, 6);
+    return buf + 8;
+}
+
+static int knxip_send( struct knxip *knx, const unsigned char *buf, size_t len ) {
+    if (sendto(knx->fd, buf, len, 0, (struct sockaddr *)&knx->peer, sizeof(knx->peer)) < 0) {
+        knx->error = strerror(errno);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Parse "host[:port]" into an IPv4 socket address
+ */
+static int knxip_address( const char *address, struct sockaddr_in *sa ) {
+    char            host[256];
+    const char      *colon = strchr(address, ':');
+    size_t          len = colon ? (size_t)(colon - address) : strlen(address);
+
+    if (len >= sizeof(host))
+        return -1;
+    memcpy(host, address, len);
+    host[len] = '\0';
+    memset(sa, 0, sizeof(*sa));
+    sa->sin_family = AF_INET;
+    sa->sin_port = htons(colon ? atoi(colon + 1) : KNXIP_PORT);
+    return (inet_pton(AF_INET, host, &sa->sin_addr) == 1) ? 0 : -1;
+}
+
+/*
+ * Read datagrams into the batch, waiting at most timeout ms for the first one
+ */
+static int knxip_fill( struct knxip *knx, int timeout ) {
+    struct knxipbatch   *rx = knx->rx;
+    struct pollfd       pfd = { knx->fd, POLLIN, 0 };
+    int                 idx;
+    int                 rc;
+
+    for (idx = 0; idx < KNXIP_BATCH; idx++) {
+        rx->iov[idx].iov_base = rx->buf[idx];
+        rx->iov[idx].iov_len = KNXIP_DATAGRAM;
+        memset(&rx->msgs[idx].msg_hdr, 0, sizeof(struct msghdr));
+        rx->msgs[idx].msg_hdr.msg_iov = &rx->iov[idx];
+        rx->msgs[idx].msg_hdr.msg_iovlen = 1;
+    }
+    rx->count = rx->next = 0;
+    rc = recvmmsg(knx->fd, rx->msgs, KNXIP_BATCH, MSG_DONTWAIT, NULL);
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if ((rc = poll(&pfd, 1, timeout)) <= 0)
+            return rc;
+        rc = recvmmsg(knx->fd, rx->msgs, KNXIP_BATCH, MSG_DONTWAIT, NULL);
+    }
+    if (rc < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        knx->error = strerror(errno);
+        return -1;
+    }
+    rx->count = rc;
+    return rc;
+}
+
+/*
+ * Next datagram of the batch with a valid header, NULL when the batch is used up
+ */
+static unsigned char *knxip_next( struct knxip *knx, uint16_t *service, uint16_t *length ) {
+    struct knxipbatch   *rx = knx->rx;
+    unsigned char       *buf;
+    unsigned int        len;
+
+    while (rx->next < rx->count) {
+        buf = rx->buf[rx->next];
+        len = rx->msgs[rx->next].msg_len;
+        rx->next++;
+        if (len < KNXIP_HEADERSIZE || buf[0] != KNXIP_HEADERSIZE || buf[1] != 0x10)
+            continue;
+        *service = (buf[2] << 8) | buf[3];
+        *length = (buf[4] << 8) | buf[5];
+        if (*length > len || *length < KNXIP_HEADERSIZE)
+            continue;
+        return buf;
+    }
+    return NULL;
+}
+
+/*
+ * Open a tunnel, waits for the connect response
+ */
+static int knxip_connect( struct knxip *knx ) {
+    unsigned char   req[26];
+    unsigned char   *p;
+    unsigned char   *buf;
+    uint16_t        service;
+    uint16_t        length;
+    uint64_t        deadline = knxip_now() + KNXIP_CONNECTTIMEOUT * 1000000000ULL;
+
+    p = knxip_header(req, KNXIP_CONNECT_REQ, sizeof(req));
+    p = knxip_hpai(p);                          // control endpoint
+    p = knxip_hpai(p);                          // data endpoint
+    p[0] = 4;                                   // connection request information
+    p[1] = 0x04;                                // tunnel connection
+    p[2] = 0x02;                                // link layer
+    p[3] = 0;
+    if (knxip_send(knx, req, sizeof(req)) != 0)
+        return -1;
+
+    while (knxip_now() < deadline) {
+        if (knxip_fill(knx, 1000) < 0)
+            return -1;
+        while ((buf = knxip_next(knx, &service, &length)) != NULL) {
+            if (service != KNXIP_CONNECT_RES || length < 8)
+                continue;
+            if (buf[7] != 0) {
+                knx->error = "tunnel connection refused";
+                return -1;
+            }
+            // the sender reads channel and txseq under the lock, a request still
+            // waiting for its ack on the old channel times out
+            pthread_mutex_lock(&knx->lock);
+            knx->channel = buf[6];
+            knx->txseq = 0;
+            pthread_mutex_unlock(&knx->lock);
+            knx->rxseq = 0;
+            knx->missed = 0;
+            knx->heartbeat = knxip_now() + KNXIP_HEARTBEAT * 1000000000ULL;
+            return 0;
+        }
+    }
+    knx->error = "no answer to tunnel connect request";
+    return -1;
+}
+
+static void knxip_disconnect( struct knxip *knx ) {
+    unsigned char   req[16];
+    unsigned char   *p;
+
+    p = knxip_header(req, KNXIP_DISCONNECT_REQ, sizeof(req));
+    p[0] = knx->channel;
+    p[1] = 0;
+    knxip_hpai(p + 2);
+    knxip_send(knx, req, sizeof(req));
+}
+
+/*
+ * Connection state request, the tunnel is opened again after KNXIP_MAXMISSED
+ * unanswered ones
+ */
+static int knxip_heartbeat( struct knxip *knx ) {
+    unsigned char   req[16];
+    unsigned char   *p;
+
+    if (knx->missed >= KNXIP_MAXMISSED) {
+        knxip_disconnect(knx);
+        if (knxip_connect(knx) != 0)
+            return -1;
+    }
+    p = knxip_header(req, KNXIP_CONNECTIONSTATE_REQ, sizeof(req));
+    p[0] = knx->channel;
+    p[1] = 0;
+    knxip_hpai(p + 2);
+    knx->missed++;
+    knx->heartbeat = knxip_now() + KNXIP_HEARTBEAT * 1000000000ULL;
+    return knxip_send(knx, req, sizeof(req));
+}
+
+/*
+ * Copy a cEMI message into CEMIFRAME layout, skipping additional information
+ */
+static const unsigned char *knxip_cemi( struct knxip *knx, unsigned char *cemi, int len, uint16_t *length ) {
+    int             addil;
+
+    if (len < 2)
+        return NULL;
+    addil = cemi[1];
+    if (addil == 0) {
+        *length = len;                          // already in CEMIFRAME layout
+        return cemi;
+    }
+    if (len < 2 + addil)
+        return NULL;
+    len -= addil;
+    if (len > (int)sizeof(CEMIFRAME))
+        len = sizeof(CEMIFRAME);
+    knx->frame.code = cemi[0];
+    knx->frame.zero = 0;
+    memcpy(&knx->frame.ctrl, cemi + 2 + addil, len - 2);
+    *length = len;
+    return (const unsigned char *)&knx->frame;
+}
+
+int knxip_open( struct knxip *knx, int mode, const char *address, uint16_t individual ) {
+    struct sockaddr_in  local;
+    struct ip_mreq      mreq;
+    int                 one = 1;
+    int                 zero = 0;
+    int                 rcvbuf = 1024 * 1024;
+
+    memset(knx, 0, sizeof(*knx));
+    knx->mode = mode;
+    knx->individual = individual;
+    pthread_mutex_init(&knx->lock, NULL);
+    pthread_cond_init(&knx->ack, NULL);
+    if (knxip_address(address ? address : KNXIP_MULTICAST, &knx->peer) != 0) {
+        knx->error = "invalid address";
+        return -1;
+    }
+    if ((knx->rx = calloc(1, sizeof(struct knxipbatch))) == NULL ||
+        (knx->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) {
+        knx->error = strerror(errno);
+        return -1;
+    }
+    setsockopt(knx->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (mode == KNXIP_ROUTING) {
+        // routers send to the group port, several listeners may share it
+        local.sin_port = knx->peer.sin_port;
+        setsockopt(knx->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (bind(knx->fd, (struct sockaddr *)&local, sizeof(local)) != 0) {
+        knx->error = strerror(errno);
+        return -1;
+    }
+
+    if (mode == KNXIP_ROUTING) {
+        if (IN_MULTICAST(ntohl(knx->peer.sin_addr.s_addr))) {
+            mreq.imr_multiaddr = knx->peer.sin_addr;
+            mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+            if (setsockopt(knx->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+                knx->error = strerror(errno);
+                return -1;
+            }
+            // our own group writes are not received again
+            setsockopt(knx->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &zero, sizeof(zero));
+        }
+        return 0;
+    }
+    return knxip_connect(knx);
+}
+
+/*
+ * Next cEMI frame, NULL when none arrived within timeout ms (error is NULL) or on
+ * an error. The frame stays valid until the next call.
+ */
+const unsigned char *knxip_receive( struct knxip *knx, uint16_t *length, int timeout ) {
+    struct knxipbatch   *rx = knx->rx;
+    unsigned char       ack[10];
+    unsigned char       *buf;
+    const unsigned char *frame;
+    uint16_t            service;
+    uint16_t            len;
+    uint64_t            deadline = knxip_now() + (uint64_t)timeout * 1000000;
+    uint64_t            now;
+    int                 wait;
+
+    knx->error = NULL;
+    for (;;) {
+        while ((buf = knxip_next(knx, &service, &len)) != NULL) {
+            switch (service) {
+                case KNXIP_ROUTING_IND:
+                    if (knx->mode != KNXIP_ROUTING)
+                        break;
+                    if ((frame = knxip_cemi(knx, buf + KNXIP_HEADERSIZE, len - KNXIP_HEADERSIZE, length)) != NULL)
+                        return frame;
+                    break;
+                case KNXIP_ROUTING_LOST:
+                    if (len >= 10)
+                        knx->lost += (buf[8] << 8) | buf[9];
+                    break;
+                case KNXIP_TUNNELLING_REQ:
+                    if (knx->mode != KNXIP_TUNNELLING || len < 10 || buf[7] != knx->channel)
+                        break;
+                    // the expected request and a repeat of the last one are acknowledged,
+                    // only the expected one is passed on; any other sequence is dropped
+                    // unacknowledged so the interface repeats or reconnects
+                    if (buf[8] != knx->rxseq && buf[8] != (uint8_t)(knx->rxseq - 1))
+                        break;
+                    knxip_header(ack, KNXIP_TUNNELLING_ACK, sizeof(ack));
+                    ack[6] = 4;
+                    ack[7] = knx->channel;
+                    ack[8] = buf[8];
+                    ack[9] = 0;
+                    knxip_send(knx, ack, sizeof(ack));
+                    if (buf[8] != knx->rxseq)
+                        break;
+                    knx->rxseq++;
+                    if ((frame = knxip_cemi(knx, buf + 10, len - 10, length)) != NULL)
+                        return frame;
+                    break;
+                case KNXIP_TUNNELLING_ACK:
+                    if (len < 10 || buf[7] != knx->channel)
+                        break;
+                    pthread_mutex_lock(&knx->lock);
+                    if (buf[8] == (uint8_t)(knx->txseq - 1) && buf[9] == 0) {
+                        knx->acked = 1;
+                        pthread_cond_signal(&knx->ack);
+                    }
+                    pthread_mutex_unlock(&knx->lock);
+                    break;
+                case KNXIP_CONNECTIONSTATE_RES:
+                    if (len >= 8 && buf[6] == knx->channel && buf[7] == 0)
+                        knx->missed = 0;
+                    break;
+                case KNXIP_DISCONNECT_REQ:
+                    if (knx->mode != KNXIP_TUNNELLING || len < 8 || buf[6] != knx->channel)
+                        break;
+                    knxip_header(ack, KNXIP_DISCONNECT_RES, 8);
+                    ack[6] = knx->channel;
+                    ack[7] = 0;
+                    knxip_send(knx, ack, 8);
+                    if (knxip_connect(knx) != 0)
+                        return NULL;
+                    break;
+            }
+        }
+
+        now = knxip_now();
+        if (knx->mode == KNXIP_TUNNELLING && now >= knx->heartbeat && knxip_heartbeat(knx) != 0)
+            return NULL;
+        if (rx->next < rx->count)
+            continue;
+        if (now >= deadline)
+            return NULL;
+        wait = (deadline - now) / 1000000 + 1;
+        if (knx->mode == KNXIP_TUNNELLING && knx->heartbeat > now && (knx->heartbeat - now) / 1000000 + 1 < (uint64_t)wait)
+            wait = (knx->heartbeat - now) / 1000000 + 1;
+        if (knxip_fill(knx, wait) < 0)
+            return NULL;
+    }
+}
+
+/*
+ * Send a group telegram. A single byte is a short value sent in the APCI, longer
+ * values follow the APCI, a read has none. priority holds the EIB_CTRL_PRIO_* bits.
+ * Tunnelling waits for the acknowledgement of the interface and repeats the request
+ * once.
+ */
+static int knxip_groupsend( struct knxip *knx, uint16_t daddr, uint8_t apci, const unsigned char *data, int len, int priority ) {
+    unsigned char   req[KNXIP_HEADERSIZE + 4 + sizeof(CEMIFRAME)];
+    unsigned char   *p;
+    CEMIFRAME       cemi;
+    struct timespec ts;
+    size_t          cemilen;
+    int             attempt;
+    int             rc = -1;
+
+    memset(&cemi, 0, sizeof(cemi));
+    cemi.code = (knx->mode == KNXIP_ROUTING) ? L_DATA_IND : L_DATA_REQ;
+    cemi.ctrl = EIB_CTRL_LENGTHBYTE | 0x30 | (priority & EIB_CTRL_PRIO_LOW);  // standard frame, no repeat, broadcast
+    cemi.ntwrk = EIB_DAF_GROUP | 0x60;                              // hop count 6
+    cemi.saddr = (knx->mode == KNXIP_ROUTING) ? knx->individual : 0;
+    cemi.daddr = daddr;
+    cemi.tpci = T_GROUPDATA_REQ;
+    cemi.apci = apci;
+    if (len == 0) {
+        cemi.length = 1;
+    } else if (len == 1) {
+        cemi.apci |= data[0] & 0x3f;
+        cemi.length = 1;
+    } else {
+        memcpy(cemi.data, data, len);
+        cemi.length = len + 1;
+    }
+    cemilen = offsetof(CEMIFRAME, tpci) + 1 + cemi.length;
+
+    if (knx->mode == KNXIP_ROUTING) {
+        p = knxip_header(req, KNXIP_ROUTING_IND, KNXIP_HEADERSIZE + cemilen);
+        memcpy(p, &cemi, cemilen);
+        return knxip_send(knx, req, KNXIP_HEADERSIZE + cemilen);
+    }
+
+    pthread_mutex_lock(&knx->lock);
+    p = knxip_header(req, KNXIP_TUNNELLING_REQ, KNXIP_HEADERSIZE + 4 + cemilen);
+    p[0] = 4;
+    p[1] = knx->channel;
+    p[2] = knx->txseq++;
+    p[3] = 0;
+    memcpy(p + 4, &cemi, cemilen);
+    for (attempt = 0; attempt < 2 && rc != 0; attempt++) {
+        knx->acked = 0;
+        if (knxip_send(knx, req, KNXIP_HEADERSIZE + 4 + cemilen) != 0)
+            break;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += KNXIP_ACKTIMEOUT * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        while (!knx->acked)
+            if (pthread_cond_timedwait(&knx->ack, &knx->lock, &ts) == ETIMEDOUT)
+                break;
+        if (knx->acked)
+            rc = 0;
+        else
+            knx->error = "no acknowledgement from the interface";
+    }
+    pthread_mutex_unlock(&knx->lock);
+    return rc;
+}
+
+int knxip_groupwrite( struct knxip *knx, uint16_t daddr, const unsigned char *data, int len, int priority ) {
+    if (len < 1 || len > (int)sizeof(((CEMIFRAME *)0)->data)) {
+        knx->error = "invalid value length";
+        return -1;
+    }
+    return knxip_groupsend(knx, daddr, A_WRITE_VALUE_REQ, data, len, priority);
+}
+
+/*
+ * Ask the devices on a group address for their value, the response comes in as a
+ * frame like any other
+ */
+int knxip_groupread( struct knxip *knx, uint16_t daddr, int priority ) {
+    return knxip_groupsend(knx, daddr, A_READ_VALUE_REQ, NULL, 0, priority);
+}
+
+void knxip_close( struct knxip *knx ) {
+    if (knx->fd <= 0)
+        return;
+    if (knx->mode == KNXIP_TUNNELLING)
+        knxip_disconnect(knx);
+    close(knx->fd);
+    knx->fd = -1;
+    free(knx->rx);
+    knx->rx = NULL;
+}